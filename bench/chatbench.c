@@ -0,0 +1,690 @@
+/*******************************************************************************
+ * Name          : chatbench.c
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Load generator for the chat server. Opens many client
+ *                 connections from a few threads, sends timestamped chat
+ *                 lines at a fixed rate, and reports the throughput and the
+ *                 end-to-end delivery latency.
+ ******************************************************************************/
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "../server/proto.h"
+
+#define USAGE "Usage: %s [-c connections] [-t threads] [-g room size] " \
+              "[-r messages per second] [-s message size] [-d seconds] " \
+              "<server IP> <port number>\n"
+
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_THREADS     2
+#define DEFAULT_ROOM_SIZE   10
+#define DEFAULT_RATE        1000
+#define DEFAULT_MSG_SIZE    128
+#define DEFAULT_DURATION    10
+// Longest chat line the server accepts.
+#define MAX_MSG_LEN 1024
+// Every chat line starts with "B<run> <send time> ", which takes this many
+// bytes, so messages cannot be shorter.
+#define STAMP_LEN 27
+// Max number of events returned by a single call to epoll_wait().
+#define MAX_EVENTS 256
+// Milliseconds a thread waits for events before it checks whether more
+// messages are due.
+#define TICK_MS 1
+// Most messages a thread sends in one go before it reads again.
+#define MAX_BURST 4096
+// Bytes read from a socket at a time.
+#define READ_BUFFER_SIZE 65536
+// Most bytes that may wait to be sent on one connection. Messages that are
+// due while a connection is this far behind are not sent, and are counted
+// as stalls.
+#define MAX_PENDING (1024 * 1024)
+// Seconds the connections have to log in and join their rooms, and seconds
+// given to the messages in flight to arrive once sending stops.
+#define SETUP_TIMEOUT 30
+#define DRAIN_TIMEOUT 5
+
+// Latencies are counted in a histogram with HIST_SUB_BUCKETS buckets for
+// every power of 2 nanoseconds, so every bucket is within about 3% of the
+// latencies in it.
+#define HIST_SUB_BITS    5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     (64 * HIST_SUB_BUCKETS)
+
+/**
+ * Stages a connection goes through before it can take part in the run.
+ */
+enum conn_state_t {
+    CONN_CONNECTING, // Waiting for the welcome message.
+    CONN_JOINING,    // Logged in, waiting to be told it is in its room.
+    CONN_READY,      // In its room.
+    CONN_FAILED      // Closed because of an error.
+};
+
+/**
+ * One client connection. Frames are parsed out of rbuf, and whatever the
+ * socket does not take right away waits in wbuf.
+ */
+struct bench_conn {
+    int fd;
+    int id;
+    int room_size; // Number of connections in this connection's room.
+    enum conn_state_t state;
+    char *rbuf;
+    size_t rlen;
+    char *wbuf;
+    size_t wlen, woff, wcap;
+};
+
+/**
+ * State of a load generating thread. The counters are read by the main
+ * thread while the run is going on.
+ */
+struct bench_thread {
+    pthread_t thread;
+    int id;
+    int epoll_fd;
+    struct bench_conn *conns;
+    int num_conns;
+    atomic_ulong sent, expected, delivered, stalls;
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t max_latency;
+};
+
+int num_connections = DEFAULT_CONNECTIONS;
+int num_threads = DEFAULT_THREADS;
+int room_size = DEFAULT_ROOM_SIZE;
+int rate = DEFAULT_RATE;
+int msg_size = DEFAULT_MSG_SIZE;
+int duration = DEFAULT_DURATION;
+struct sockaddr_in server_addr;
+
+// Tag of this run. Chat lines from earlier runs, such as the ones replayed
+// from a room's history, carry another tag and are ignored.
+unsigned run_tag;
+atomic_int num_ready = 0, num_failed = 0;
+// Times in nanoseconds at which sending starts and stops, or 0 if not set
+// yet. The threads stop once done is set.
+_Atomic uint64_t start_time = 0, stop_time = 0;
+atomic_bool done = false;
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds.
+ */
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Returns the histogram bucket of a latency.
+ */
+int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) {
+        return v;
+    }
+    int exp = 63 - __builtin_clzll(v);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+           ((v >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/**
+ * Returns the smallest latency counted in a histogram bucket.
+ */
+uint64_t hist_value(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exp = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    return ((uint64_t)HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) <<
+           (exp - HIST_SUB_BITS);
+}
+
+/**
+ * Returns the latency below which the given fraction of the counted
+ * latencies fall.
+ */
+uint64_t hist_percentile(const uint64_t *hist, uint64_t count,
+                         double fraction) {
+    uint64_t rank = (uint64_t)(fraction * count), seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) {
+            return hist_value(i);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Closes a connection after an error.
+ */
+void fail_conn(struct bench_conn *c, const char *what) {
+    if (c->state == CONN_FAILED) {
+        return;
+    }
+    fprintf(stderr, "Warning: Connection %d %s.\n", c->id, what);
+    if (c->state == CONN_READY) {
+        atomic_fetch_sub(&num_ready, 1);
+    }
+    c->state = CONN_FAILED;
+    atomic_fetch_add(&num_failed, 1);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/**
+ * Sends as much of a connection's pending output as the socket takes.
+ */
+void flush_conn(struct bench_conn *c) {
+    while (c->woff < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff,
+                         MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fail_conn(c, "failed to send");
+            }
+            break;
+        }
+        c->woff += n;
+    }
+    if (c->woff == c->wlen) {
+        c->woff = c->wlen = 0;
+    }
+}
+
+/**
+ * Appends a frame to a connection's pending output and tries to send it.
+ * Returns false if the connection is too far behind to take it.
+ */
+bool send_frame(struct bench_conn *c, unsigned char type, const char *payload,
+                size_t len) {
+    if (c->wlen - c->woff + PROTO_HEADER_LEN + len > MAX_PENDING) {
+        return false;
+    }
+    if (c->wlen + PROTO_HEADER_LEN + len > c->wcap) {
+        // Move the unsent part to the front before growing the buffer.
+        memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+        c->wlen -= c->woff;
+        c->woff = 0;
+        while (c->wlen + PROTO_HEADER_LEN + len > c->wcap) {
+            c->wcap = c->wcap ? c->wcap * 2 : 4096;
+        }
+        char *new_wbuf = realloc(c->wbuf, c->wcap);
+        if (!new_wbuf) {
+            fail_conn(c, "ran out of memory");
+            return false;
+        }
+        c->wbuf = new_wbuf;
+    }
+    proto_write_header(c->wbuf + c->wlen, type, len);
+    memcpy(c->wbuf + c->wlen + PROTO_HEADER_LEN, payload, len);
+    c->wlen += PROTO_HEADER_LEN + len;
+    flush_conn(c);
+    return true;
+}
+
+/**
+ * Records the latency of a chat line, if it was sent during this run. The
+ * payload is "[name]: " followed by what the sender sent.
+ */
+void handle_chat(struct bench_thread *t, const char *payload, size_t len) {
+    const char *end = payload + len;
+    const char *p = memchr(payload, ']', len);
+    if (!p || end - p < 3 + STAMP_LEN) {
+        return;
+    }
+    p += 3;
+    unsigned tag;
+    unsigned long long sent_at;
+    char stamp[STAMP_LEN + 1];
+    memcpy(stamp, p, STAMP_LEN);
+    stamp[STAMP_LEN] = '\0';
+    if (sscanf(stamp, "B%8x %16llx", &tag, &sent_at) != 2 || tag != run_tag) {
+        return;
+    }
+    uint64_t latency = now_ns() - sent_at;
+    t->hist[hist_bucket(latency)]++;
+    if (latency > t->max_latency) {
+        t->max_latency = latency;
+    }
+    atomic_fetch_add_explicit(&t->delivered, 1, memory_order_relaxed);
+}
+
+/**
+ * Handles a frame received on a connection.
+ */
+void handle_frame(struct bench_thread *t, struct bench_conn *c,
+                  const struct frame *f) {
+    char text[64];
+    switch (f->type) {
+        case MSG_WELCOME:
+            if (c->state == CONN_CONNECTING) {
+                int len = sprintf(text, "b%d", c->id);
+                send_frame(c, MSG_NAME, text, len);
+                len = sprintf(text, "/join bench-%d", c->id / room_size);
+                send_frame(c, MSG_CHAT, text, len);
+                c->state = CONN_JOINING;
+            }
+            break;
+        case MSG_INFO:
+            if (c->state == CONN_JOINING && f->len >= 15 &&
+                    memcmp(f->payload, "You are now in ", 15) == 0) {
+                c->state = CONN_READY;
+                atomic_fetch_add(&num_ready, 1);
+            }
+            break;
+        case MSG_CHAT:
+            handle_chat(t, f->payload, f->len);
+            break;
+        case MSG_BYE:
+            fail_conn(c, "was closed by the server");
+            break;
+        default:
+            break; // Join and leave notices do not matter here.
+    }
+}
+
+/**
+ * Reads whatever has arrived on a connection and handles every complete
+ * frame in it.
+ */
+void read_conn(struct bench_thread *t, struct bench_conn *c) {
+    while (c->state != CONN_FAILED) {
+        if (READ_BUFFER_SIZE - c->rlen < 4096) {
+            fail_conn(c, "received a frame that is too long");
+            return;
+        }
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, READ_BUFFER_SIZE - c->rlen,
+                         0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fail_conn(c, "failed to receive");
+            }
+            return;
+        }
+        if (n == 0) {
+            fail_conn(c, "was closed by the server");
+            return;
+        }
+        c->rlen += n;
+        size_t off = 0;
+        struct frame f;
+        ssize_t used;
+        while ((used = proto_parse_frame(c->rbuf + off, c->rlen - off,
+                                         READ_BUFFER_SIZE - PROTO_HEADER_LEN,
+                                         &f)) > 0) {
+            handle_frame(t, c, &f);
+            off += used;
+            if (c->state == CONN_FAILED) {
+                return;
+            }
+        }
+        if (used < 0) {
+            fail_conn(c, "received an invalid frame");
+            return;
+        }
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+        c->rlen -= off;
+    }
+}
+
+/**
+ * Opens a connection to the server without waiting for it to be set up.
+ * Returns true on success, false on failure.
+ */
+bool open_conn(struct bench_thread *t, struct bench_conn *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&server_addr,
+                sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        return false;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = c;
+    return epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, c->fd, &event) == 0;
+}
+
+/**
+ * Sends the chat lines that are due by now, spread over the thread's
+ * connections in turn. Each thread sends its share of the total rate.
+ */
+void send_due(struct bench_thread *t, uint64_t now, int *next_conn) {
+    uint64_t start = atomic_load(&start_time);
+    uint64_t elapsed = now - start;
+    uint64_t due = elapsed / 1000 * rate / num_threads / 1000000;
+    uint64_t sent = atomic_load_explicit(&t->sent, memory_order_relaxed);
+    uint64_t stalls = atomic_load_explicit(&t->stalls, memory_order_relaxed);
+    char payload[MAX_MSG_LEN];
+    memset(payload + STAMP_LEN, 'x', msg_size - STAMP_LEN);
+    for (int burst = 0; sent + stalls < due && burst < MAX_BURST; burst++) {
+        struct bench_conn *c = NULL;
+        for (int tries = 0; tries < t->num_conns; tries++) {
+            struct bench_conn *candidate = &t->conns[*next_conn];
+            *next_conn = (*next_conn + 1) % t->num_conns;
+            if (candidate->state == CONN_READY) {
+                c = candidate;
+                break;
+            }
+        }
+        if (!c) {
+            break;
+        }
+        char stamp[STAMP_LEN + 1];
+        sprintf(stamp, "B%08x %016llx ", run_tag,
+                (unsigned long long)now_ns());
+        memcpy(payload, stamp, STAMP_LEN);
+        if (send_frame(c, MSG_CHAT, payload, msg_size)) {
+            sent++;
+            atomic_fetch_add_explicit(&t->expected, c->room_size - 1,
+                                      memory_order_relaxed);
+        } else {
+            stalls++;
+        }
+    }
+    atomic_store_explicit(&t->sent, sent, memory_order_relaxed);
+    atomic_store_explicit(&t->stalls, stalls, memory_order_relaxed);
+}
+
+/**
+ * Body of a load generating thread. Connects its share of the connections,
+ * then sends and receives until the run is over.
+ */
+void *run_thread(void *arg) {
+    struct bench_thread *t = arg;
+    for (int i = 0; i < t->num_conns; i++) {
+        if (!open_conn(t, &t->conns[i])) {
+            fail_conn(&t->conns[i], "failed to connect");
+        }
+    }
+    struct epoll_event events[MAX_EVENTS];
+    int next_conn = 0;
+    while (!atomic_load(&done)) {
+        int n = epoll_wait(t->epoll_fd, events, MAX_EVENTS, TICK_MS);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: epoll_wait() failed. %s.\n",
+                    strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct bench_conn *c = events[i].data.ptr;
+            if (c->state == CONN_FAILED) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_conn(c);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                read_conn(t, c);
+            }
+        }
+        uint64_t now = now_ns();
+        uint64_t start = atomic_load(&start_time);
+        uint64_t stop = atomic_load(&stop_time);
+        if (start != 0 && now >= start && (stop == 0 || now < stop)) {
+            send_due(t, now, &next_conn);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Sums up the counter at the given offset in every thread.
+ */
+uint64_t total(struct bench_thread *threads, size_t offset) {
+    uint64_t sum = 0;
+    for (int i = 0; i < num_threads; i++) {
+        sum += atomic_load((atomic_ulong *)((char *)&threads[i] + offset));
+    }
+    return sum;
+}
+
+/**
+ * Parses a positive integer option.
+ * Returns true on success, false if the value is not a positive integer.
+ */
+bool parse_positive(const char *arg, int *value, const char *what) {
+    char *end;
+    errno = 0;
+    long v = strtol(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || v < 1 || v > 100000000) {
+        fprintf(stderr, "Error: Invalid %s '%s'.\n", what, arg);
+        return false;
+    }
+    *value = v;
+    return true;
+}
+
+/**
+ * Main function.
+ * Sets up the connections, runs the load for the given duration, and
+ * reports the results. Returns EXIT_FAILURE if a connection failed or a
+ * message was lost.
+ */
+int main(int argc, char *argv[]) {
+    int retval = EXIT_SUCCESS;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:g:r:s:d:")) != -1) {
+        bool ok = true;
+        switch (opt) {
+            case 'c':
+                ok = parse_positive(optarg, &num_connections,
+                                    "number of connections");
+                break;
+            case 't':
+                ok = parse_positive(optarg, &num_threads, "number of threads");
+                break;
+            case 'g':
+                ok = parse_positive(optarg, &room_size, "room size");
+                break;
+            case 'r':
+                ok = parse_positive(optarg, &rate, "message rate");
+                break;
+            case 's':
+                ok = parse_positive(optarg, &msg_size, "message size");
+                if (ok && (msg_size < STAMP_LEN || msg_size > MAX_MSG_LEN)) {
+                    fprintf(stderr, "Error: message size must be in range "
+                            "[%d, %d].\n", STAMP_LEN, MAX_MSG_LEN);
+                    ok = false;
+                }
+                break;
+            case 'd':
+                ok = parse_positive(optarg, &duration, "duration");
+                break;
+            default:
+                ok = false;
+                fprintf(stderr, USAGE, argv[0]);
+                break;
+        }
+        if (!ok) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, argv[optind], &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Error: Invalid IP address '%s'.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    int port;
+    if (!parse_positive(argv[optind + 1], &port, "port number") ||
+            port > 65535) {
+        return EXIT_FAILURE;
+    }
+    server_addr.sin_port = htons(port);
+    if (num_threads > num_connections) {
+        num_threads = num_connections;
+    }
+    run_tag = (unsigned)now_ns() ^ ((unsigned)getpid() << 16);
+
+    // Every connection needs a file descriptor.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+            limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // Connection i goes to thread i % num_threads and room i / room_size.
+    struct bench_thread *threads = calloc(num_threads,
+                                          sizeof(struct bench_thread));
+    struct bench_conn *conns = calloc(num_connections,
+                                      sizeof(struct bench_conn));
+    if (!threads || !conns) {
+        fprintf(stderr, "Error: Failed to allocate connections. %s.\n",
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+    int per_thread = (num_connections + num_threads - 1) / num_threads;
+    for (int i = 0; i < num_connections; i++) {
+        struct bench_conn *c = &conns[i];
+        c->fd = -1;
+        c->id = i;
+        int first = i / room_size * room_size;
+        c->room_size = num_connections - first < room_size
+                     ? num_connections - first : room_size;
+        c->state = CONN_CONNECTING;
+        if (!(c->rbuf = malloc(READ_BUFFER_SIZE))) {
+            fprintf(stderr, "Error: Failed to allocate connections. %s.\n",
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    int num_started = 0;
+    for (int i = 0; i < num_threads; i++) {
+        struct bench_thread *t = &threads[i];
+        t->id = i;
+        t->conns = conns + i * per_thread;
+        t->num_conns = num_connections - i * per_thread < per_thread
+                     ? num_connections - i * per_thread : per_thread;
+        if ((t->epoll_fd = epoll_create1(0)) < 0 ||
+                (errno = pthread_create(&t->thread, NULL, run_thread, t))) {
+            fprintf(stderr, "Error: Failed to start thread %d. %s.\n", i,
+                    strerror(errno));
+            retval = EXIT_FAILURE;
+            goto EXIT;
+        }
+        num_started++;
+    }
+
+    // Wait for every connection to be in its room, then run the load.
+    uint64_t setup_start = now_ns();
+    while (atomic_load(&num_ready) + atomic_load(&num_failed) <
+           num_connections &&
+           now_ns() - setup_start < SETUP_TIMEOUT * 1000000000ULL) {
+        usleep(10000);
+    }
+    if (atomic_load(&num_ready) < num_connections) {
+        fprintf(stderr, "Error: Only %d of %d connections joined their "
+                "rooms.\n", atomic_load(&num_ready), num_connections);
+        retval = EXIT_FAILURE;
+        goto EXIT;
+    }
+    double setup_secs = (now_ns() - setup_start) / 1e9;
+    uint64_t start = now_ns();
+    atomic_store(&start_time, start);
+    atomic_store(&stop_time, start + duration * 1000000000ULL);
+    sleep(duration);
+    usleep(10000);
+
+    // Give the messages in flight time to arrive.
+    size_t expected_off = offsetof(struct bench_thread, expected);
+    size_t delivered_off = offsetof(struct bench_thread, delivered);
+    uint64_t drain_start = now_ns();
+    while (total(threads, delivered_off) < total(threads, expected_off) &&
+           now_ns() - drain_start < DRAIN_TIMEOUT * 1000000000ULL) {
+        usleep(10000);
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+EXIT:
+    atomic_store(&done, true);
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    if (retval == EXIT_SUCCESS) {
+        uint64_t hist[HIST_BUCKETS] = { 0 };
+        uint64_t max_latency = 0;
+        for (int i = 0; i < num_threads; i++) {
+            for (int j = 0; j < HIST_BUCKETS; j++) {
+                hist[j] += threads[i].hist[j];
+            }
+            if (threads[i].max_latency > max_latency) {
+                max_latency = threads[i].max_latency;
+            }
+        }
+        uint64_t sent = total(threads, offsetof(struct bench_thread, sent));
+        uint64_t stalls = total(threads,
+                                offsetof(struct bench_thread, stalls));
+        uint64_t expected = total(threads, expected_off);
+        uint64_t delivered = total(threads, delivered_off);
+        printf("Connections: %d in rooms of %d, %d threads, set up in "
+               "%.2f s\n", num_connections, room_size, num_threads,
+               setup_secs);
+        printf("Sent:        %llu messages of %d bytes in %d s (%.0f/s of "
+               "%d/s asked for), %llu stalled\n", (unsigned long long)sent,
+               msg_size, duration, (double)sent / duration, rate,
+               (unsigned long long)stalls);
+        printf("Delivered:   %llu of %llu messages (%.0f/s, %.2f MB/s)\n",
+               (unsigned long long)delivered, (unsigned long long)expected,
+               delivered / secs, delivered * (double)msg_size / secs / 1e6);
+        if (delivered > 0) {
+            printf("Latency:     p50 %.1f us, p99 %.1f us, p99.9 %.1f us, "
+                   "max %.1f us\n",
+                   hist_percentile(hist, delivered, 0.5) / 1e3,
+                   hist_percentile(hist, delivered, 0.99) / 1e3,
+                   hist_percentile(hist, delivered, 0.999) / 1e3,
+                   max_latency / 1e3);
+        }
+        if (atomic_load(&num_failed) > 0 || delivered < expected) {
+            retval = EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < num_connections; i++) {
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+        free(conns[i].rbuf);
+        free(conns[i].wbuf);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (threads[i].epoll_fd > 0) {
+            close(threads[i].epoll_fd);
+        }
+    }
+    free(conns);
+    free(threads);
+    return retval;
+}
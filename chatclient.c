@@ -13,12 +13,18 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#include "proto.h"
 #include "util.h"
 
-#define ERR_USAGE "Usage: %s <server IP> <port>\n"
+#define ERR_USAGE "Usage: %s [-L] {<server IP> <port> | -U <socket path> [-S]}\n"
 #define ERR_INVALID_IP "Error: Invalid IP address '%s'.\n"
 #define ERR_PORT_RANGE "Error: Port must be in range [1024, 65535].\n"
 #define ERR_UNAME_LONG "Sorry, limit your username to %d characters.\n"
@@ -29,14 +35,199 @@
 #define PORT_RANGE_MIN 1024
 #define PORT_RANGE_MAX 65535
 
+// size of the buffers scripted input is read into and sent from
+#define SCRIPT_BUFLEN 65536
+
+// incoming messages are written out at most once per frame
+#define OUTPUT_FRAME_MS 33
+// most bytes of messages shown per frame on a terminal, older ones are collapsed
+#define OUTPUT_BUFLEN 65536
+// room in front of a frame for the notice about collapsed messages
+#define NOTICE_ROOM 64
+
+// largest shared ring taken from the server
+#define RING_MAX_SIZE (64 * 1024 * 1024)
+
 int client_socket = -1;
 char username[MAX_NAME_LEN + 1];
 char inbuf[BUFLEN + 1];
 char outbuf[MAX_MSG_LEN + 1];
 
+// set with -L to talk to servers that only speak the unframed protocol
+int legacy = 0;
+
+// set with -U to connect through the unix socket of a server on this host,
+// and with -S to also be sent messages through shared memory
+char *local_path = NULL;
+int want_ring = 0;
+
+// ring in shared memory the server writes frames into, its size, and the
+// eventfd the server signals when there is something new to read
+struct proto_ring *ring = NULL;
+uint32_t ring_size = 0;
+int ring_event = -1;
+// frames taken out of the ring, handled after it has room again
+char *ringbuf = NULL;
+// set while frames from the ring are handled
+int draining_ring = 0;
+// set when the server waited for room while frames were waiting in
+// script_out, the answer goes out after them like a pong
+int ring_ack_pending = 0;
+// file descriptors passed along with the frames on the socket
+int passed_fds[2];
+int num_passed = 0;
+
+// set when the server turned the username down, the next line typed is tried
+// as the username instead of being sent as a message
+int renaming = 0;
+
+// frames received from the server, possibly including a partial one at the end
+char *recvbuf = NULL;
+size_t recvbuf_len = 0;
+size_t recvbuf_cap = 0;
+
+// compressed frames are inflated into this, it holds the payload of the last one
+z_stream inflater;
+int inflater_ready = 0;
+char *inflated = NULL;
+size_t inflated_cap = 0;
+
+// set when stdin is not a terminal: input is read in large chunks and split
+// into lines here, many lines go out in one send, and no prompts are printed
+int scripted = 0;
+// input read but not sent yet, possibly ending with part of a line
+char script_in[SCRIPT_BUFLEN];
+size_t script_in_len = 0;
+int script_eof = 0;
+// set while dropping the rest of a line that did not fit in script_in
+int script_skipping = 0;
+// frames waiting to be sent, room for one more full frame past the limit
+char script_out[SCRIPT_BUFLEN + PROTO_HEADER_LEN + MAX_MSG_LEN];
+size_t script_out_len = 0;
+size_t script_out_off = 0;
+// set once bye is queued, the client exits when it has gone out
+int script_bye = 0;
+// set when the server pinged while frames were waiting in script_out, the
+// pong goes out after them so it does not land in the middle of one
+int pong_pending = 0;
+
+// incoming messages waiting for the next frame, kept after NOTICE_ROOM bytes
+// for the collapsed notice, with room at the end for the prompt
+char screen[NOTICE_ROOM + OUTPUT_BUFLEN + MAX_NAME_LEN + 4];
+size_t screen_len = 0;
+int screen_msgs = 0;
+// messages left out of this frame to make room for newer ones
+int screen_collapsed = 0;
+// set when stdout is a terminal, which only gets so much per frame
+int collapse = 0;
+long last_frame_ms = 0;
+
 
 void print_header() {
-    printf("[%s]: ", username);
+    // nobody is typing in scripted mode, so there is no prompt to redraw
+    if (scripted)
+        return;
+    if (renaming)
+        printf(STR_USER_PROMPT);
+    else
+        printf("[%s]: ", username);
+}
+
+long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void write_all(const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(STDOUT_FILENO, buf, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+int output_pending()
+{
+    return screen_len > 0 || screen_collapsed > 0;
+}
+
+// writes out the messages of this frame in one go, followed by the prompt
+void flush_output()
+{
+    last_frame_ms = now_ms();
+    if (!output_pending())
+        return;
+
+    char *start = screen + NOTICE_ROOM;
+    size_t len = screen_len;
+
+    // the notice goes right in front of the messages, so it is the same write
+    if (screen_collapsed > 0)
+    {
+        char notice[NOTICE_ROOM];
+        int n = sprintf(notice, scripted ? "*** %d earlier message%s not shown ***\n"
+                                         : "\n*** %d earlier message%s not shown ***",
+                        screen_collapsed, screen_collapsed == 1 ? "" : "s");
+        start -= n;
+        memcpy(start, notice, n);
+        len += n;
+    }
+    if (!scripted)
+        len += renaming ? sprintf(start + len, STR_USER_PROMPT)
+                        : sprintf(start + len, "[%s]: ", username);
+
+    // anything printed before has to come out first
+    fflush(stdout);
+    write_all(start, len);
+    screen_len = 0;
+    screen_msgs = 0;
+    screen_collapsed = 0;
+}
+
+// adds an incoming message to the next frame; on a terminal, a full frame is
+// thrown away in favor of the newer messages
+void show_message(const char *text, size_t len)
+{
+    char *msgs = screen + NOTICE_ROOM;
+
+    // too big for any frame, so it goes out on its own
+    if (len + 2 > OUTPUT_BUFLEN)
+    {
+        flush_output();
+        write_all(text, len);
+        write_all("\n", 1);
+        return;
+    }
+
+    if (screen_len + len + 2 > OUTPUT_BUFLEN)
+    {
+        if (collapse)
+        {
+            screen_collapsed += screen_msgs;
+            screen_len = 0;
+            screen_msgs = 0;
+        }
+        else
+            flush_output();
+    }
+
+    // the frame starts on a fresh line, below the prompt
+    if (screen_len == 0 && !scripted)
+        msgs[screen_len++] = '\n';
+    memcpy(msgs + screen_len, text, len);
+    screen_len += len;
+    msgs[screen_len++] = '\n';
+    screen_msgs++;
 }
 
 int readUsername(char *uname)
@@ -86,6 +277,38 @@ int readUsername(char *uname)
     return 0;
 }
 
+int send_frame(unsigned char type, const char *payload, size_t len)
+{
+    // header and payload go out in one send
+    char frame[PROTO_HEADER_LEN + MAX_MSG_LEN];
+    proto_write_header(frame, type, len);
+    memcpy(frame + PROTO_HEADER_LEN, payload, len);
+    return send(client_socket, frame, PROTO_HEADER_LEN + len, 0);
+}
+
+// sends the line just typed as the new username, once the old one was taken
+int send_new_username()
+{
+    size_t len = strlen(outbuf);
+
+    if (len > MAX_NAME_LEN)
+        fprintf(stderr, ERR_UNAME_LONG, MAX_NAME_LEN);
+    else if (len > 0)
+    {
+        if (send_frame(MSG_NAME, outbuf, len) < 0)
+        {
+            fprintf(stderr, "Error: Failed to send username to server. %s.\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        strcpy(username, outbuf);
+        renaming = 0;
+    }
+
+    outbuf[0] = '\0';
+    print_header();
+    return EXIT_SUCCESS;
+}
+
 int handle_stdin()
 {
     
@@ -97,14 +320,28 @@ int handle_stdin()
         return EXIT_SUCCESS;
     }
 
-    if (send(client_socket, outbuf, strlen(outbuf), 0) < 0)
+    if (renaming && strcmp(outbuf, "bye") != 0)
+        return send_new_username();
+
+    int is_bye = strcmp(outbuf, "bye") == 0;
+    int sent;
+
+    if (legacy)
+        sent = send(client_socket, outbuf, strlen(outbuf), 0);
+    else if (is_bye)
+        sent = send_frame(MSG_BYE, NULL, 0);
+    else
+        sent = send_frame(MSG_CHAT, outbuf, strlen(outbuf));
+
+    if (sent < 0)
     {
         fprintf(stderr, "Error: Failed to send message to server. %s.\n", strerror(errno));
         return EXIT_FAILURE;
     }
 
-    if (strcmp(outbuf, "bye") == 0)
+    if (is_bye)
     {
+        flush_output();
         printf("Goodbye.\n");
         return EXIT_FAILURE;
     }
@@ -115,15 +352,572 @@ int handle_stdin()
     return EXIT_SUCCESS;
 }
 
+// reads as much of stdin as fits in script_in
+int read_script()
+{
+    ssize_t bytes_read = read(STDIN_FILENO, script_in + script_in_len, SCRIPT_BUFLEN - script_in_len);
+
+    if (bytes_read < 0)
+    {
+        if (errno == EINTR)
+            return EXIT_SUCCESS;
+        fprintf(stderr, "Error: Failed to read input. %s.\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (bytes_read == 0)
+    {
+        script_eof = 1;
+        return EXIT_SUCCESS;
+    }
+
+    // script_in is empty while skipping, so the new data starts at the front
+    if (script_skipping)
+    {
+        char *nl = memchr(script_in, '\n', bytes_read);
+        if (nl == NULL)
+            return EXIT_SUCCESS;
+        script_skipping = 0;
+        bytes_read -= nl + 1 - script_in;
+        memmove(script_in, nl + 1, bytes_read);
+    }
+    script_in_len += bytes_read;
+
+    // a line longer than the whole buffer can never be sent
+    if (script_in_len == SCRIPT_BUFLEN && memchr(script_in, '\n', script_in_len) == NULL)
+    {
+        fprintf(stderr, ERR_MSG_LONG, MAX_MSG_LEN);
+        script_in_len = 0;
+        script_skipping = 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+// finds the next line in buf, or the rest of the input once stdin is done
+// returns its length without the newline, or -1 if there is no full line yet
+ssize_t next_script_line(const char *buf, size_t len, size_t *consumed)
+{
+    char *nl = memchr(buf, '\n', len);
+
+    if (nl != NULL)
+    {
+        *consumed = nl - buf + 1;
+        return nl - buf;
+    }
+    if (script_eof && len > 0)
+    {
+        *consumed = len;
+        return len;
+    }
+    return -1;
+}
+
+// takes the username from the first non-empty line of the script
+int read_script_username(char *uname)
+{
+    while (1)
+    {
+        size_t consumed;
+        ssize_t len = next_script_line(script_in, script_in_len, &consumed);
+
+        if (len > 0)
+        {
+            if (len > MAX_NAME_LEN)
+            {
+                fprintf(stderr, ERR_UNAME_LONG, MAX_NAME_LEN);
+                return EXIT_FAILURE;
+            }
+            memcpy(uname, script_in, len);
+            uname[len] = '\0';
+        }
+        if (len >= 0)
+        {
+            memmove(script_in, script_in + consumed, script_in_len - consumed);
+            script_in_len -= consumed;
+            if (len > 0)
+                return EXIT_SUCCESS;
+            continue;
+        }
+        if (script_eof)
+        {
+            fprintf(stderr, "Error: No username in input.\n");
+            return EXIT_FAILURE;
+        }
+        if (read_script() == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+}
+
+// moves as many lines from script_in to script_out as fit; once the input is
+// used up, bye is queued as if it had been typed
+void queue_script_lines()
+{
+    size_t off = 0;
+    size_t consumed;
+    ssize_t len;
+
+    // the legacy server takes one message per read, so lines go out one at a time
+    while (!script_bye && (legacy ? script_out_len == 0 : script_out_len < SCRIPT_BUFLEN) &&
+           (len = next_script_line(script_in + off, script_in_len - off, &consumed)) >= 0)
+    {
+        const char *line = script_in + off;
+        off += consumed;
+
+        if (len == 0)
+            continue;
+        if (len > MAX_MSG_LEN)
+        {
+            fprintf(stderr, ERR_MSG_LONG, MAX_MSG_LEN);
+            continue;
+        }
+
+        script_bye = len == 3 && memcmp(line, "bye", 3) == 0;
+        if (legacy)
+        {
+            memcpy(script_out + script_out_len, line, len);
+            script_out_len += len;
+        }
+        else if (script_bye)
+        {
+            proto_write_header(script_out + script_out_len, MSG_BYE, 0);
+            script_out_len += PROTO_HEADER_LEN;
+        }
+        else
+        {
+            proto_write_header(script_out + script_out_len, MSG_CHAT, len);
+            memcpy(script_out + script_out_len + PROTO_HEADER_LEN, line, len);
+            script_out_len += PROTO_HEADER_LEN + len;
+        }
+    }
+
+    if (off > 0)
+    {
+        memmove(script_in, script_in + off, script_in_len - off);
+        script_in_len -= off;
+    }
+
+    if (script_eof && script_in_len == 0 && !script_bye && script_out_len == 0)
+    {
+        script_bye = 1;
+        if (legacy)
+        {
+            memcpy(script_out, "bye", 3);
+            script_out_len = 3;
+        }
+        else
+        {
+            proto_write_header(script_out, MSG_BYE, 0);
+            script_out_len = PROTO_HEADER_LEN;
+        }
+    }
+}
+
+// tells the server the client is still there
+int send_pong()
+{
+    if (send_frame(MSG_PONG, "", 0) < 0)
+    {
+        fprintf(stderr, "Error: Failed to send message to server. %s.\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// asks the server for a shared ring, or tells it there is room in the ring again
+int send_ring()
+{
+    if (send_frame(MSG_RING, "", 0) < 0)
+    {
+        fprintf(stderr, "Error: Failed to send message to server. %s.\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// sends as much of script_out as the socket takes without blocking, so
+// incoming messages are still read while a big script goes out
+int flush_script()
+{
+    while (script_out_off < script_out_len)
+    {
+        ssize_t sent = send(client_socket, script_out + script_out_off,
+                            script_out_len - script_out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return EXIT_SUCCESS;
+            fprintf(stderr, "Error: Failed to send message to server. %s.\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        script_out_off += sent;
+    }
+
+    script_out_len = script_out_off = 0;
+    if (script_bye)
+    {
+        flush_output();
+        printf("Goodbye.\n");
+        return EXIT_FAILURE;
+    }
+    if (pong_pending)
+    {
+        pong_pending = 0;
+        if (send_pong() == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+    if (ring_ack_pending)
+    {
+        ring_ack_pending = 0;
+        return send_ring();
+    }
+    return EXIT_SUCCESS;
+}
+
+// queues and sends lines until the socket is full or there is nothing left to
+// send before more input comes in
+int pump_script()
+{
+    size_t consumed;
+
+    do
+    {
+        queue_script_lines();
+        if (flush_script() == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    } while (script_out_len == 0 &&
+             (next_script_line(script_in, script_in_len, &consumed) >= 0 || script_eof));
+
+    return EXIT_SUCCESS;
+}
+
+// reads whatever the socket has into recvbuf, growing it if a frame needs more room
+int recv_frames(int flags)
+{
+    if (recvbuf_cap - recvbuf_len < BUFLEN)
+    {
+        size_t cap = recvbuf_cap ? recvbuf_cap * 2 : 4 * BUFLEN;
+        char *tmp = realloc(recvbuf, cap);
+        if (tmp == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        recvbuf = tmp;
+        recvbuf_cap = cap;
+    }
+    if (local_path == NULL)
+    {
+        int bytes_recvd = recv(client_socket, recvbuf + recvbuf_len, recvbuf_cap - recvbuf_len, flags);
+        if (bytes_recvd > 0)
+            recvbuf_len += bytes_recvd;
+        return bytes_recvd;
+    }
+
+    // the shared ring comes as file descriptors along with the frames
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(passed_fds))];
+    } control;
+    struct iovec iov = {recvbuf + recvbuf_len, recvbuf_cap - recvbuf_len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    int bytes_recvd = recvmsg(client_socket, &msg, flags | MSG_CMSG_CLOEXEC);
+    if (bytes_recvd < 0)
+        return bytes_recvd;
+    recvbuf_len += bytes_recvd;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (num_passed < 2)
+                passed_fds[num_passed++] = fd;
+            else
+                close(fd);
+        }
+    }
+    return bytes_recvd;
+}
+
+void close_passed_fds()
+{
+    while (num_passed > 0)
+        close(passed_fds[--num_passed]);
+}
+
+void unmap_ring()
+{
+    if (ring == NULL)
+        return;
+    munmap(ring, sizeof(struct proto_ring) + ring_size);
+    close(ring_event);
+    ring = NULL;
+    ring_event = -1;
+}
+
+// maps the shared ring the server sent, whose size is the payload of the frame;
+// a ring that does not work out is left alone and the socket keeps working
+int map_ring(struct frame *f)
+{
+    uint32_t size;
+    struct stat st;
+
+    // frames coming out of a ring never set up another one
+    if (draining_ring || f->len != sizeof(size) || num_passed != 2)
+    {
+        close_passed_fds();
+        return EXIT_SUCCESS;
+    }
+    memcpy(&size, f->payload, sizeof(size));
+    size = ntohl(size);
+    size_t map_len = sizeof(struct proto_ring) + size;
+    if (size == 0 || (size & (size - 1)) != 0 || size > RING_MAX_SIZE ||
+        fstat(passed_fds[0], &st) < 0 || (size_t)st.st_size < map_len)
+    {
+        fprintf(stderr, "\nWarning: Received an invalid ring from the server.\n");
+        close_passed_fds();
+        return EXIT_SUCCESS;
+    }
+
+    char *buf = realloc(ringbuf, size);
+    void *mem = buf == NULL ? MAP_FAILED
+                            : mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, passed_fds[0], 0);
+    if (mem == MAP_FAILED)
+    {
+        fprintf(stderr, "\nWarning: Failed to map the ring from the server. %s.\n", strerror(errno));
+        if (buf != NULL)
+            ringbuf = buf;
+        close_passed_fds();
+        return EXIT_SUCCESS;
+    }
+    ringbuf = buf;
+
+    // whatever was left in an earlier ring was read before this frame
+    unmap_ring();
+    ring = mem;
+    ring_size = size;
+    close(passed_fds[0]);
+    ring_event = passed_fds[1];
+    num_passed = 0;
+    return EXIT_SUCCESS;
+}
+
+int handle_frame(struct frame *f)
+{
+    switch (f->type)
+    {
+    case MSG_BYE:
+        flush_output();
+        printf("\nServer initiated shutdown.\n");
+        return EXIT_FAILURE;
+    case MSG_CHAT:
+    case MSG_JOIN:
+    case MSG_LEAVE:
+    case MSG_WELCOME:
+    case MSG_INFO:
+        show_message(f->payload, f->len);
+        break;
+    case MSG_NAME_TAKEN:
+        // nobody is there to pick another name in scripted mode
+        if (scripted)
+        {
+            flush_output();
+            fprintf(stderr, "Error: Username '%s' is taken.\n", username);
+            return EXIT_FAILURE;
+        }
+        show_message(f->payload, f->len);
+        renaming = 1;
+        break;
+    case MSG_PING:
+        if (scripted && script_out_len > 0)
+            pong_pending = 1;
+        else
+            return send_pong();
+        break;
+    case MSG_RING:
+        return map_ring(f);
+    default:
+        // ignore anything newer than this client
+        break;
+    }
+    return EXIT_SUCCESS;
+}
+
+// replaces a compressed frame with the one it stands for, returns -1 if it is not valid
+int inflate_frame(struct frame *f)
+{
+    uint32_t len;
+
+    if (f->len < sizeof(len))
+        return -1;
+    memcpy(&len, f->payload, sizeof(len));
+    len = ntohl(len);
+    if (len > PROTO_MAX_PAYLOAD)
+        return -1;
+
+    if (!inflater_ready)
+    {
+        memset(&inflater, 0, sizeof(inflater));
+        // raw deflate, without a zlib header or checksum
+        if (inflateInit2(&inflater, -MAX_WBITS) != Z_OK)
+            return -1;
+        inflater_ready = 1;
+    }
+    else
+        inflateReset(&inflater);
+
+    if (inflated_cap < (size_t)len + 1)
+    {
+        char *tmp = realloc(inflated, (size_t)len + 1);
+        if (tmp == NULL)
+            return -1;
+        inflated = tmp;
+        inflated_cap = (size_t)len + 1;
+    }
+
+    inflater.next_in = (Bytef *)f->payload + sizeof(len);
+    inflater.avail_in = f->len - sizeof(len);
+    inflater.next_out = (Bytef *)inflated;
+    inflater.avail_out = len;
+    if (inflate(&inflater, Z_FINISH) != Z_STREAM_END || inflater.total_out != len)
+        return -1;
+
+    f->type &= ~MSG_COMPRESSED;
+    f->payload = inflated;
+    f->len = len;
+    return 0;
+}
+
+// handles every complete frame in buf and keeps the partial one (if any)
+int process_frames(char *buf, size_t *len)
+{
+    struct frame f;
+    ssize_t used;
+    size_t off = 0;
+
+    while ((used = proto_parse_frame(buf + off, *len - off, PROTO_MAX_PAYLOAD, &f)) > 0)
+    {
+        off += used;
+        if ((f.type & MSG_COMPRESSED) && inflate_frame(&f) < 0)
+        {
+            used = -1;
+            break;
+        }
+        if (handle_frame(&f) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+
+    if (used < 0)
+    {
+        fprintf(stderr, "\nError: Received an invalid message from the server.\n");
+        return EXIT_FAILURE;
+    }
+
+    memmove(buf, buf + off, *len - off);
+    *len -= off;
+    return EXIT_SUCCESS;
+}
+
+// handles every frame the server put in the shared ring since last time; the
+// server only puts whole frames in it
+int drain_ring()
+{
+    if (ring == NULL)
+        return EXIT_SUCCESS;
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t len = atomic_load_explicit(&ring->tail, memory_order_acquire) - head;
+    if (len == 0)
+        return EXIT_SUCCESS;
+    if (len > ring_size)
+    {
+        fprintf(stderr, "\nError: Received an invalid message from the server.\n");
+        return EXIT_FAILURE;
+    }
+
+    // copy the frames out, so the server can reuse the room while they are handled
+    char *data = proto_ring_data(ring);
+    uint32_t offset = head & (ring_size - 1);
+    uint32_t first = len < ring_size - offset ? len : ring_size - offset;
+    memcpy(ringbuf, data + offset, first);
+    memcpy(ringbuf + first, data, len - first);
+    atomic_store(&ring->head, head + len);
+
+    // the server waits to be told about the room if the ring was full
+    if (atomic_load(&ring->writer_waiting) && atomic_exchange(&ring->writer_waiting, 0))
+    {
+        if (scripted && script_out_len > 0)
+            ring_ack_pending = 1;
+        else if (send_ring() == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+
+    size_t left = len;
+    draining_ring = 1;
+    int retval = process_frames(ringbuf, &left);
+    draining_ring = 0;
+    if (retval == EXIT_SUCCESS && left > 0)
+    {
+        fprintf(stderr, "\nError: Received an invalid message from the server.\n");
+        return EXIT_FAILURE;
+    }
+    return retval;
+}
+
 int handle_client_socket()
 {
     int bytes_recvd;
+
+    if (!legacy)
+    {
+        // drain the socket, there may be many frames (or half of one) per read
+        while (1)
+        {
+            bytes_recvd = recv_frames(MSG_DONTWAIT);
+            if (bytes_recvd < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                fprintf(stderr, "Warning: Failed to receive incoming message. %s.\n", strerror(errno));
+                break;
+            }
+            // frames the server put in the shared ring before it sent these
+            // go first
+            if (drain_ring() == EXIT_FAILURE)
+                return EXIT_FAILURE;
+            if (bytes_recvd == 0)
+            {
+                flush_output();
+                fprintf(stderr, "\nConnection to server has been lost.\n");
+                return EXIT_FAILURE;
+            }
+            if (process_frames(recvbuf, &recvbuf_len) == EXIT_FAILURE)
+                return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
     if ((bytes_recvd = recv(client_socket, inbuf, BUFLEN, 0)) < 0)
     {
         fprintf(stderr, "Warning: Failed to receive incoming message. %s.\n", strerror(errno));
+        return EXIT_SUCCESS;
     }
     else if (bytes_recvd == 0)
     {
+        flush_output();
         fprintf(stderr, "\nConnection to server has been lost.\n");
         return EXIT_FAILURE;
     }
@@ -131,12 +925,12 @@ int handle_client_socket()
     inbuf[bytes_recvd] = '\0';
 
     if (strcmp(inbuf, "bye") == 0) {
+        flush_output();
         printf("\nServer initiated shutdown.\n");
         return EXIT_FAILURE;
     }
 
-    printf("\n%s\n", inbuf);
-    print_header();
+    show_message(inbuf, bytes_recvd);
 
     return EXIT_SUCCESS;
 }
@@ -153,52 +947,101 @@ int main(int argc, char *argv[])
     
     int retval = EXIT_SUCCESS;
 
-    if (argc != 3)
+    int opt;
+    while ((opt = getopt(argc, argv, "LU:S")) != -1)
+    {
+        if (opt == 'L')
+        {
+            legacy = 1;
+        }
+        else if (opt == 'U')
+        {
+            local_path = optarg;
+        }
+        else if (opt == 'S')
+        {
+            want_ring = 1;
+        }
+        else
+        {
+            fprintf(stderr, ERR_USAGE, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // a unix socket takes the place of the address, and shared memory only
+    // works through one
+    if (argc - optind != (local_path == NULL ? 2 : 0) || (want_ring && local_path == NULL))
     {
         fprintf(stderr, ERR_USAGE, argv[0]);
         return EXIT_FAILURE;
     }
+    argv += optind - 1;
 
     struct sockaddr_in server_addr;
     socklen_t addrlen = sizeof(struct sockaddr_in);
+    struct sockaddr_un local_addr;
 
     memset(&server_addr, 0, addrlen);
+    memset(&local_addr, 0, sizeof(local_addr));
 
-    // if successful, inet_pton() returns 1
-    if (inet_pton(AF_INET, fixAddress(argv[1]), &server_addr.sin_addr) != 1)
+    if (local_path != NULL)
     {
-        fprintf(stderr, ERR_INVALID_IP, fixAddress(argv[1]));
-        return EXIT_FAILURE;
+        if (strlen(local_path) >= sizeof(local_addr.sun_path))
+        {
+            fprintf(stderr, "Error: Socket path '%s' is too long.\n", local_path);
+            return EXIT_FAILURE;
+        }
+        local_addr.sun_family = AF_UNIX;
+        strcpy(local_addr.sun_path, local_path);
     }
+    else
+    {
+        // if successful, inet_pton() returns 1
+        if (inet_pton(AF_INET, fixAddress(argv[1]), &server_addr.sin_addr) != 1)
+        {
+            fprintf(stderr, ERR_INVALID_IP, fixAddress(argv[1]));
+            return EXIT_FAILURE;
+        }
 
-    int *_port = malloc(sizeof(int));
+        int *_port = malloc(sizeof(int));
 
-    if (parse_int(argv[2], _port, "port number") == false)
-    {
-        return EXIT_FAILURE;
-    }
+        if (parse_int(argv[2], _port, "port number") == false)
+        {
+            return EXIT_FAILURE;
+        }
 
-    // dereference
-    int port = *_port;
-    free(_port);
+        // dereference
+        int port = *_port;
+        free(_port);
 
 
-    if (port < PORT_RANGE_MIN || port > PORT_RANGE_MAX)
-    {
-        fprintf(stderr, ERR_PORT_RANGE);
-        return EXIT_FAILURE;
-    }
+        if (port < PORT_RANGE_MIN || port > PORT_RANGE_MAX)
+        {
+            fprintf(stderr, ERR_PORT_RANGE);
+            return EXIT_FAILURE;
+        }
 
-    // configure server options
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
+        // configure server options
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+    }
 
-    readUsername(username);
+    // with input from a pipe or file, the username is the first line of it
+    scripted = !isatty(STDIN_FILENO);
+    collapse = isatty(STDOUT_FILENO);
+    if (scripted)
+    {
+        if (read_script_username(username) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+    else
+        readUsername(username);
 
     printf("Hello, %s. Let's try to connect to the server.\n", username);
 
-    // Create a reliable, stream socket using TCP.
-    if ((client_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    // Create a reliable, stream socket using TCP, or a unix socket.
+    if ((client_socket = socket(local_path == NULL ? AF_INET : AF_UNIX, SOCK_STREAM, 0)) < 0)
     {
         fprintf(stderr, "Error: Failed to create socket. %s.\n",
                 strerror(errno));
@@ -206,7 +1049,8 @@ int main(int argc, char *argv[])
         goto EXIT;
     }
 
-    if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in)) < 0)
+    if ((local_path == NULL ? connect(client_socket, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in))
+                            : connect(client_socket, (struct sockaddr *)&local_addr, sizeof(local_addr))) < 0)
     {
         fprintf(stderr, "Error: Failed to connect to server. %s.\n",
                 strerror(errno));
@@ -220,28 +1064,73 @@ int main(int argc, char *argv[])
 
     int ONLINE = 1;
 
-    if ((bytes_recvd = recv(client_socket, inbuf, BUFLEN, 0)) < 0)
+    struct frame welcome;
+    ssize_t welcome_len = 0;
+
+    do
     {
-        fprintf(stderr, "Error: Failed to receive message from server. %s.\n",
-                strerror(errno));
-        retval = EXIT_FAILURE;
-        goto EXIT;
+        if (legacy)
+            bytes_recvd = recv(client_socket, inbuf, BUFLEN, 0);
+        else
+            bytes_recvd = recv_frames(0);
+
+        if (bytes_recvd < 0)
+        {
+            fprintf(stderr, "Error: Failed to receive message from server. %s.\n",
+                    strerror(errno));
+            retval = EXIT_FAILURE;
+            goto EXIT;
+        }
+        else if (bytes_recvd == 0)
+        {
+            fprintf(stderr, "All connections are busy. Try again later.\n");
+            retval = EXIT_FAILURE;
+            goto EXIT;
+        }
+
+        // the welcome frame may take more than one read
+        if (!legacy)
+            welcome_len = proto_parse_frame(recvbuf, recvbuf_len, PROTO_MAX_PAYLOAD, &welcome);
+    } while (!legacy && welcome_len == 0);
+
+    // Receive welcome message from the server
+    if (legacy)
+    {
+        inbuf[bytes_recvd] = '\0';
+        printf("\n%s\n\n", inbuf);
     }
-    else if (bytes_recvd == 0)
+    else
     {
-        fprintf(stderr, "All connections are busy. Try again later.\n");
-        retval = EXIT_FAILURE;
-        goto EXIT;
+        if (welcome_len < 0 || welcome.type != MSG_WELCOME)
+        {
+            fprintf(stderr, "Error: Unexpected welcome from server. Try -L for older servers.\n");
+            retval = EXIT_FAILURE;
+            goto EXIT;
+        }
+        printf("\n%.*s\n\n", (int)welcome.len, welcome.payload);
+        // anything after the welcome is handled once we are logged in
+        memmove(recvbuf, recvbuf + welcome_len, recvbuf_len - welcome_len);
+        recvbuf_len -= welcome_len;
     }
 
-    // Receive welcome message from the server
-    inbuf[bytes_recvd] = '\0';
-    printf("\n%s\n\n", inbuf);
-
     // Send username
     strcpy(outbuf, username);
 
-    if (send(client_socket, outbuf, strlen(outbuf), 0) < 0)
+    int sent;
+    if (legacy)
+        sent = send(client_socket, outbuf, strlen(outbuf), 0);
+    else
+    {
+        sent = send_frame(MSG_NAME, outbuf, strlen(outbuf));
+        // ask for compressed frames, servers that do not know how ignore this
+        if (sent >= 0)
+            sent = send_frame(MSG_HELLO, PROTO_CODEC_DEFLATE, strlen(PROTO_CODEC_DEFLATE));
+        // the server switches to the ring once the messages before it are out
+        if (sent >= 0 && want_ring)
+            sent = send_frame(MSG_RING, "", 0);
+    }
+
+    if (sent < 0)
     {
         fprintf(stderr, "Error: Failed to send username to server. %s.\n", strerror(errno));
         retval = EXIT_FAILURE;
@@ -252,6 +1141,12 @@ int main(int argc, char *argv[])
 
     print_header();
 
+    if (!legacy && recvbuf_len > 0 && process_frames(recvbuf, &recvbuf_len) == EXIT_FAILURE)
+    {
+        retval = EXIT_FAILURE;
+        goto EXIT;
+    }
+
     // printf("Debug: %i | ", port);
     // printf("Parse success\n");
 
@@ -275,8 +1170,12 @@ int main(int argc, char *argv[])
     {
         FD_ZERO(&read_sockset);
         FD_ZERO(&write_sockset);
-        FD_SET(STDIN_FILENO, &read_sockset);
+        // scripted input is only read while there is room to keep it
+        if (!scripted || (!script_eof && !script_bye && script_in_len < SCRIPT_BUFLEN))
+            FD_SET(STDIN_FILENO, &read_sockset);
         FD_SET(client_socket, &read_sockset);
+        if (scripted && script_out_len > script_out_off)
+            FD_SET(client_socket, &write_sockset);
 
         // printf("Size of outbuf is %li\n", strlen(outbuf));
         fflush(stdout);
@@ -288,14 +1187,59 @@ int main(int argc, char *argv[])
         FD_SET(STDIN_FILENO, &except_sockset);
         FD_SET(client_socket, &except_sockset);
 
-        if (select(max_socket + 1, &read_sockset, &write_sockset, &except_sockset, NULL) <= 0 && errno != EINTR)
+        // messages that came in are shown once their frame is due
+        struct timeval frame_timeout;
+        struct timeval *timeout = NULL;
+        if (output_pending())
+        {
+            long wait_ms = last_frame_ms + OUTPUT_FRAME_MS - now_ms();
+            if (wait_ms <= 0)
+            {
+                flush_output();
+            }
+            else
+            {
+                frame_timeout.tv_sec = 0;
+                frame_timeout.tv_usec = wait_ms * 1000;
+                timeout = &frame_timeout;
+            }
+        }
+
+        // the server signals the eventfd once it sees the client waiting, so
+        // frames that came in before that are read right away
+        struct timeval no_wait = {0, 0};
+        if (ring != NULL)
+        {
+            FD_SET(ring_event, &read_sockset);
+            if (ring_event > max_socket)
+                max_socket = ring_event;
+            atomic_store(&ring->reader_waiting, 1);
+            if (atomic_load(&ring->tail) != atomic_load(&ring->head))
+                timeout = &no_wait;
+        }
+
+        if (select(max_socket + 1, &read_sockset, &write_sockset, &except_sockset, timeout) < 0 && errno != EINTR)
         {
             fprintf(stderr, "Error: select() failed. %s.\n", strerror(errno));
             retval = EXIT_FAILURE;
             goto EXIT;
         }
 
-        if (ONLINE && FD_ISSET(STDIN_FILENO, &read_sockset))
+        if (ONLINE && scripted)
+        {
+            if (FD_ISSET(STDIN_FILENO, &read_sockset) && read_script() == EXIT_FAILURE)
+            {
+                retval = EXIT_FAILURE;
+                goto EXIT;
+            }
+            if (pump_script() == EXIT_FAILURE)
+            {
+                // bye has gone out
+                retval = script_bye && script_out_len == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                goto EXIT;
+            }
+        }
+        else if (ONLINE && FD_ISSET(STDIN_FILENO, &read_sockset))
         {
             if (handle_stdin() == EXIT_FAILURE)
             {
@@ -304,6 +1248,22 @@ int main(int argc, char *argv[])
             }
         }
 
+        if (ONLINE && ring != NULL)
+        {
+            uint64_t signals;
+            atomic_store(&ring->reader_waiting, 0);
+            if (FD_ISSET(ring_event, &read_sockset) && read(ring_event, &signals, sizeof(signals)) < 0 &&
+                errno != EAGAIN && errno != EINTR)
+            {
+                fprintf(stderr, "Warning: Failed to read ring notification. %s.\n", strerror(errno));
+            }
+            if (drain_ring() == EXIT_FAILURE)
+            {
+                retval = EXIT_FAILURE;
+                goto EXIT;
+            }
+        }
+
         if (ONLINE && FD_ISSET(client_socket, &read_sockset))
         {
             if (handle_client_socket() == EXIT_FAILURE)
@@ -323,10 +1283,19 @@ int main(int argc, char *argv[])
     goto EXIT;
 
 EXIT:
+    flush_output();
     if (fcntl(client_socket, F_GETFD) >= 0)
     {
         close(client_socket);
     }
 
+    free(recvbuf);
+    unmap_ring();
+    free(ringbuf);
+    close_passed_fds();
+    if (inflater_ready)
+        inflateEnd(&inflater);
+    free(inflated);
+
     return retval;
 }
@@ -9,284 +9,4827 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "cluster.h"
+#include "handoff.h"
+#include "journal.h"
+#include "log.h"
+#include "message.h"
+#include "metrics.h"
+#include "pool.h"
+#include "proto.h"
+#include "timer.h"
+#include "uring.h"
 #include "util.h"
 
-// Max number of concurrent clients.
-#define MAX_CONNECTIONS 3
+// Initial size of the connection table. The table doubles in size whenever
+// it fills up, so there is no fixed cap on the number of concurrent clients.
+#define INITIAL_CONNECTIONS 64
+// Max number of events returned by a single call to epoll_wait().
+#define MAX_EVENTS 256
+// Tags stored in the epoll event data to identify the server socket, the
+// worker's wake-up eventfd, and the Unix socket local clients connect to.
+// Client sockets are tagged with their index into the connection table.
+#define SERVER_SOCKET_TAG UINT64_MAX
+#define WAKE_TAG          (UINT64_MAX - 1)
+#define LOCAL_SOCKET_TAG  (UINT64_MAX - 2)
+// Max number of worker threads, each with its own listener and event loop.
+#define MAX_WORKERS 256
+// Default limit on the number of bytes waiting to be sent to one client.
+#define DEFAULT_QUEUE_LIMIT 65536
+// Default number of bytes of memory the recent chat lines of a room may take
+// up. New members of the room are sent these lines when they join.
+#define DEFAULT_HISTORY_LIMIT 16384
+// Sequence number of messages that are delivered to every member of a room,
+// no matter when they joined.
+#define SEQ_ALWAYS UINT64_MAX
+// Under the backpressure policy a queue may grow past its limit while the
+// senders are being paused, but never beyond this multiple of the limit.
+#define QUEUE_HARD_LIMIT_FACTOR 4
+// Seconds a client may hold up the senders under the backpressure policy
+// before it is disconnected.
+#define BACKPRESSURE_TIMEOUT 5
+// Seconds a new connection has to send its user name before it is dropped.
+#define LOGIN_TIMEOUT 30
+// Pings a client may leave unanswered before it is taken for dead, when there
+// is a ping interval but no idle timeout.
+#define PING_MISSES 3
+// Version of the state handed over to a new process on a hot restart. A new
+// process that reads another version is not handed anything.
+#define HANDOFF_VERSION 1
+// Milliseconds a new process has to get ready to take over, and the workers
+// have to stop their io_uring from taking in anything more.
+#define HANDOFF_START_TIMEOUT   5000
+#define HANDOFF_QUIESCE_TIMEOUT 1000
+// Initial number of messages a send queue can hold before its ring grows.
+#define INITIAL_QUEUE_CAPACITY 8
+// Max number of iovecs handed to a single writev() call.
+#define MAX_SEND_IOVECS 64
+// Number of bytes read from a client socket at a time. A single read may
+// hold many frames.
+#define READ_BUFFER_SIZE 65536
+// Bytes a client may send in one pass of the event loop before the other
+// clients get their turn.
+#define READ_BUDGET 65536
+// Longest frame a client may send.
+#define MAX_FRAME_LEN (PROTO_HEADER_LEN + MAX_MSG_LEN)
+// Number of submission queue entries in each worker's io_uring.
+#define URING_ENTRIES 1024
+// Size and number of the buffers the kernel receives into under io_uring.
+// A buffer must fit in the back of readbuf, and the number of buffers must
+// be a power of 2.
+#define URING_BUF_SIZE 8192
+#define URING_NUM_BUFS 256
+#define URING_BUF_GROUP 0
+// Max number of iovecs handed to a single sendmsg() on the io_uring. Only one
+// send per client is in flight at a time, so each one takes as much of the
+// queue as the kernel allows.
+#define URING_MAX_IOVECS 1024
+// Sends covering at most this many messages come from the send pool.
+#define URING_POOLED_MSGS 8
+// Sends of at least this many bytes are made without copying the data into
+// the kernel. Below that, setting up the zero-copy send costs more than the
+// copy it saves.
+#define URING_ZC_THRESHOLD 16384
+// Kinds of requests on the io_uring, stored in the low byte of their user
+// data. Client requests also carry the index of the client in the upper 32
+// bits and the generation of its slot in the bits in between. Sends carry a
+// pointer to their struct uring_send instead, whose low bits are always 0.
+#define UD_ACCEPT    1
+#define UD_WAKE      2
+#define UD_RECV      3
+#define UD_CANCEL    4
+#define UD_ACCEPT_LOCAL 5
+#define UD_TYPE_MASK 0x0f
+// Send buffer asked for on the socket of a local client. The kernel caps it
+// at net.core.wmem_max.
+#define LOCAL_SNDBUF_SIZE (4 * 1024 * 1024)
+// Size of the ring in shared memory a local client may be sent its frames
+// through. It is a power of 2, and takes the longest message sent to active
+// clients many times over.
+#define SHARED_RING_SIZE (256 * 1024)
 
-int server_socket = -1, num_connections = 0;
-int client_sockets[MAX_CONNECTIONS];
+// Size of a CPU cache line. Entries of the connection table are aligned to it.
+#define CACHE_LINE_SIZE 64
 
-char inbuf[MAX_MSG_LEN + 1];
-char outbuf[BUFLEN + 1];
-char *usernames[MAX_CONNECTIONS];
+// Flags kept for each client in the connection table.
+#define CLIENT_PAUSED  0x01 // Not read from until congestion clears.
+#define CLIENT_CLOSING 0x02 // Waiting to be disconnected.
+#define CLIENT_LEGACY  0x04 // Speaks the unframed legacy protocol.
+#define CLIENT_DEFLATE 0x40 // Is sent compressed frames.
+// Asked for compressed frames, which start once its send queue is empty.
+#define CLIENT_WANTS_DEFLATE 0x80
+// Flags only used by the io_uring engine.
+#define CLIENT_RECEIVING 0x08 // A multishot receive is armed.
+#define CLIENT_SENDING   0x10 // A send is in flight.
+#define CLIENT_FLUSH     0x20 // Has messages to submit at the end of the loop.
+// Not read from until its turn comes again, or until its rate limits allow.
+#define CLIENT_THROTTLED 0x100
+#define CLIENT_LOCAL     0x200 // Connected through the Unix socket.
+#define CLIENT_RING      0x400 // Is sent frames through a shared ring.
+// Asked for a shared ring, which it is switched to once its send queue is
+// empty.
+#define CLIENT_WANTS_RING 0x800
 
-struct sockaddr_in server_addr;
-socklen_t addrlen = sizeof(struct sockaddr_in);
+#define USAGE "Usage: %s [-L] [-w workers] [-q queue limit] " \
+              "[-p drop|disconnect|block] [-l error|warning|info|debug] " \
+              "[-B binary log file] [-e epoll|uring] [-H history limit] " \
+              "[-J journal directory] [-A admin socket] " \
+              "[-m message rate] [-b byte rate] [-i idle timeout] " \
+              "[-P ping interval] [-C cluster port] " \
+              "[-N host:port,...] [-U local socket] <port number>\n"
 
-volatile sig_atomic_t running = true;
+/**
+ * What to do when a client does not read its messages fast enough and its
+ * send queue fills up.
+ */
+enum slow_policy_t {
+    POLICY_DROP_OLDEST, // Discard the oldest queued messages.
+    POLICY_DISCONNECT,  // Disconnect the client.
+    POLICY_BACKPRESSURE // Stop reading from senders until the queue drains.
+};
+
+/**
+ * How the workers wait for and perform I/O.
+ */
+enum engine_t {
+    ENGINE_EPOLL, // Readiness events from epoll, then recv() and writev().
+    ENGINE_URING  // Completions from io_uring, with the I/O done by the kernel.
+};
+
+/**
+ * Stages a connection goes through before it joins the chat room. Only
+ * active clients are sent the messages broadcast by other users.
+ */
+enum client_state_t {
+    STATE_WELCOMED,      // The welcome message is still being sent.
+    STATE_AWAITING_NAME, // The welcome message is sent, the name is not in.
+    STATE_RENAMING,      // The name sent was taken, another one is awaited.
+    STATE_ACTIVE         // Logged in and part of the chat room.
+};
+
+/**
+ * Bounded queue of messages waiting to be sent to a client, kept as a ring of
+ * references to shared messages. It is drained when the client's socket
+ * becomes writable.
+ */
+struct send_queue {
+    struct message **ring;
+    unsigned capacity, head, count;
+    unsigned in_flight; // Messages at the front handed to the kernel.
+    size_t offset; // Bytes of the head message already sent.
+    size_t bytes;  // Bytes not yet sent.
+    bool congested;
+    time_t congested_since;
+};
+
+/**
+ * Start of a frame that has been received only in part. It is kept until the
+ * rest of the frame arrives.
+ */
+struct recv_buffer {
+    char *data;
+    size_t len;
+};
+
+/**
+ * Tokens a client spends on what it sends. The bucket refills at the rate
+ * limit and holds at most one second's worth. A message bigger than that is
+ * let through once the bucket is full, and puts it into debt.
+ */
+struct token_bucket {
+    double tokens;
+    uint64_t updated; // Monotonic time of the last refill, in nanoseconds.
+};
+
+/**
+ * Entry in the connection table with the state needed on every event and on
+ * every broadcast. It fits in a single cache line, so scanning the table for
+ * recipients touches one line per client.
+ */
+struct connection {
+    _Alignas(CACHE_LINE_SIZE) int fd;
+    unsigned short flags;
+    unsigned char state; // One of client_state_t.
+    struct send_queue queue;
+};
+
+_Static_assert(sizeof(struct connection) <= CACHE_LINE_SIZE,
+               "struct connection must fit in a cache line");
+
+/**
+ * State of a connection that is only needed now and then. The address of
+ * the peer is looked up once, when the connection is accepted, so log lines
+ * never have to ask the kernel for it.
+ */
+struct connection_info {
+    char username[MAX_NAME_LEN + 1]; // Empty until the user has logged in.
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    char peer[INET_ADDRSTRLEN + 8]; // "[ip:port]"
+    struct recv_buffer recv_buffer;
+    time_t connected_at;
+    // Times of the last data received from the client and of the last ping
+    // sent to it, in milliseconds of monotonic time.
+    uint64_t last_active, last_ping;
+    unsigned long messages_received;
+    unsigned long bytes_received;
+    // Bumped whenever the slot is given to a new connection, so io_uring
+    // completions meant for an earlier connection can be told apart.
+    unsigned generation;
+    // Room the user is in, or -1, and its place in the worker's array of
+    // members of that room.
+    int room, room_pos;
+    // Buckets the messages and bytes the client sends are taken out of,
+    // when there are rate limits, and the data received after they ran out,
+    // which is handled once they have refilled.
+    struct token_bucket message_tokens, byte_tokens;
+    char *held;
+    size_t held_len;
+    // When a throttled client may be read from again, in nanoseconds of
+    // monotonic time, and whether it went over a rate limit rather than
+    // just using up its turn.
+    uint64_t resume_at;
+    bool rate_limited;
+    // Pass of the event loop the client was last read in, and the bytes read
+    // from it in that pass.
+    unsigned long pass;
+    size_t pass_bytes;
+    // Ring in shared memory a local client is sent its frames through, and
+    // the eventfd that wakes it up, or NULL and -1.
+    struct proto_ring *shared_ring;
+    int ring_event;
+};
+
+/**
+ * Send submitted to the io_uring. It holds a reference to every message it
+ * covers, so the data stays put until the kernel is done with it, even if
+ * the client is disconnected in the meantime. Sends in flight are linked
+ * into a list, so the ones the kernel never completes can be freed.
+ */
+struct uring_send {
+    int index;
+    unsigned generation;
+    bool zero_copy;
+    bool done; // The result has been handled. Only the buffers are in use.
+    int num_msgs;
+    struct message **msgs; // Stored right after the iovecs.
+    struct msghdr hdr;
+    struct uring_send *prev, *next;
+    struct iovec iov[];
+};
+
+/**
+ * State of a client handed over to a new process of the server on a hot
+ * restart. It is followed by what the client sent that has not been handled
+ * yet, then by what it has not been sent yet, in the form it takes messages
+ * in. Times are of the monotonic clock, which both processes share.
+ */
+struct handoff_client {
+    int worker;
+    unsigned short flags;
+    unsigned char state; // One of client_state_t.
+    char username[MAX_NAME_LEN + 1];
+    char room[MAX_NAME_LEN + 1];
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    time_t connected_at;
+    uint64_t last_active, last_ping;
+    unsigned long messages_received, bytes_received;
+    struct token_bucket message_tokens, byte_tokens;
+    size_t input_len, output_len;
+};
+
+/**
+ * Chat line in the history of a room, handed over to a new process when
+ * there is no journal to recover it from. The text follows.
+ */
+struct handoff_line {
+    char room[MAX_NAME_LEN + 1];
+    unsigned char type;
+};
+
+/**
+ * Client set aside to be handed over to a new process, or taken over from
+ * the previous one, with its socket and the data that goes along with it.
+ * A client taken over is registered in its room before the workers start,
+ * with the sequence number of the next chat line in the room at the time.
+ */
+struct parked_client {
+    struct handoff_client state;
+    int fd;
+    char *data; // The input, then the output.
+    int room;
+    uint64_t joined;
+};
+
+// Max number of chat rooms. Rooms are never removed, so a room id relayed to
+// another worker always refers to the same room.
+#define MAX_ROOMS 4096
+// Room every user is put in after logging in, and goes back to on "/leave".
+#define LOBBY_ROOM 0
+#define LOBBY_NAME "lobby"
+// Room of inbox nodes that carry a message to a single user.
+#define ROOM_DIRECT -1
+// Worker of users connected to another node of the cluster. Their entry in
+// the index of user names holds the slot of the node instead of a slot of a
+// connection table.
+#define WORKER_REMOTE -1
+// Initial number of members a room can hold on a worker before its array of
+// members grows.
+#define INITIAL_ROOM_CAPACITY 8
+
+#define WELCOME_BANNER "*** Welcome to CS 392 Chat Server v1.0 ***"
+#define NO_USERS_MSG   "\n\nNo other users are in the chat room."
+#define USERS_MSG      "\n\nConnected users: ["
+// Number of names in each page of the reply to "/who" or "/rooms".
+#define WHO_PAGE_SIZE 50
+
+/**
+ * Chat room shared by all workers. Messages sent in a room only reach its
+ * members. The workers that have members in the room are kept in a bitmap,
+ * so a message is only relayed to workers with someone to deliver it to.
+ *
+ * The most recent chat lines are kept in a ring of references to the same
+ * messages that were broadcast, so users joining the room can catch up.
+ * Chat lines are numbered in the order they are added to the history. A
+ * member remembers the number of the next line when it joined, so a line it
+ * was already sent with the history is not delivered again when it is
+ * relayed from another worker.
+ */
+struct room {
+    char name[MAX_NAME_LEN + 1];
+    atomic_int num_members;
+    _Atomic uint64_t workers[MAX_WORKERS / 64];
+    // Guards the history and next_seq, and orders joining the room with
+    // adding lines to the history.
+    pthread_mutex_t lock;
+    struct message **history;
+    unsigned history_head, history_count;
+    size_t history_bytes; // Memory taken up by the messages in the history.
+    uint64_t next_seq;
+};
+
+/**
+ * Members of a room on one worker, kept as a dense array of slots in the
+ * connection table, along with the sequence number of the next chat line when
+ * each of them joined. Delivering a message to the room only visits its
+ * members, no matter how many other clients are connected.
+ */
+struct room_members {
+    int *slots;
+    uint64_t *joined;
+    int count, capacity;
+};
+
+/**
+ * Entry in the index of user names, telling where the user is connected. The
+ * generation tells the connection apart from later ones in the same slot.
+ */
+struct user_entry {
+    char name[MAX_NAME_LEN + 1];
+    int worker;
+    int index;
+    unsigned generation;
+};
+
+/**
+ * Node in a worker's inbox, carrying a reference to a message broadcast by a
+ * client on another worker, the room it was sent to, and its sequence number.
+ * A message sent to a single user has room ROOM_DIRECT, and the slot and
+ * generation of the user's connection instead.
+ */
+struct inbox_node {
+    _Atomic(struct inbox_node *) next;
+    struct pool *pool; // Pool of the worker that relayed the message.
+    struct message *msg;
+    int room;
+    uint64_t seq;
+    int index;
+    unsigned generation;
+};
+
+/**
+ * Lock-free multi-producer, single-consumer FIFO queue. Any worker may push
+ * onto it, but only the owning worker pops from it. Nodes pushed by the same
+ * thread come out in the order they went in, which preserves the ordering of
+ * messages from each sender.
+ */
+struct inbox {
+    _Atomic(struct inbox_node *) tail;
+    struct inbox_node *head;
+    struct inbox_node stub;
+};
+
+/**
+ * State of a worker that other workers need to reach. Everything else the
+ * worker touches lives in thread-local variables below.
+ */
+struct worker {
+    int id;
+    pthread_t thread;
+    int server_socket;
+    int wake_fd;
+    // Set while a wake-up is outstanding, so producers write to wake_fd only
+    // once per batch of inbox messages.
+    atomic_bool wake_pending;
+    struct inbox inbox;
+    // Pools of the messages the worker creates and of the nodes it relays
+    // them in. They outlive the worker, since the messages may be kept in
+    // the history of a room and the nodes may sit in another worker's inbox.
+    struct message_cache messages;
+    struct pool inbox_nodes;
+    // Clients handed over to a new process, or taken over from the previous
+    // one, on a hot restart.
+    struct parked_client *parked;
+    int num_parked, parked_capacity;
+    int retval;
+};
+
+struct worker *workers = NULL;
+int num_workers = 1;
+
+// When set, clients are spoken to in the unframed legacy protocol.
+bool legacy_protocol = false;
+// Number of clients on any worker that asked for compressed frames. While
+// there are none, messages are not compressed.
+atomic_int num_deflate_clients = 0;
+// Messages and bytes per second each client may send, or 0 for no limit.
+unsigned long message_rate = 0, byte_rate = 0;
+// Milliseconds a logged in client may stay quiet before it is disconnected,
+// and before it is pinged, or 0 for never.
+uint64_t idle_timeout = 0, ping_interval = 0;
+size_t queue_limit = DEFAULT_QUEUE_LIMIT;
+// Memory the history of each room may take up, and the number of messages
+// its ring can hold. Every message takes up more than sizeof(struct message),
+// so the ring never fills up before the limit is reached.
+size_t history_limit = DEFAULT_HISTORY_LIMIT;
+unsigned history_capacity = 0;
+// Directory of the journal the chat lines are written to, or NULL.
+char *journal_dir = NULL;
+// Path of the Unix socket the metrics are served on, or NULL.
+char *admin_socket_path = NULL;
+// Port the other nodes of the cluster link to, or 0, and the comma-separated
+// list of nodes to link to, or NULL. The server is clustered if either is
+// set.
+int cluster_port = 0;
+char *cluster_peers = NULL;
+bool clustered = false;
+// Nodes relaying messages from other nodes of the cluster to the workers.
+// The thread of the cluster owns them.
+struct pool remote_nodes;
+// Path of the Unix socket clients on the same host may connect to, or NULL,
+// and the socket itself, which all workers accept from. Local clients are
+// numbered in the order they connect, in place of a port.
+char *local_socket_path = NULL;
+int local_socket = -1;
+atomic_int num_local_clients = 0;
+// Number of shared rings ever set up, which tells their names apart.
+atomic_uint num_shared_rings = 0;
+enum slow_policy_t slow_policy = POLICY_DISCONNECT;
+enum engine_t engine = ENGINE_EPOLL;
+// Set if the kernel can send from the pages of the messages without copying.
+bool uring_zero_copy = false;
+// Number of clients on any worker whose send queue is over its limit under
+// the backpressure policy. Senders are not read from while this is non-zero.
+atomic_int num_congested = 0;
+
+// Per-worker state. Each worker thread runs its own event loop over its own
+// connection table, so none of this needs to be locked.
+_Thread_local struct worker *self = NULL;
+_Thread_local int server_socket = -1, epoll_fd = -1, spare_fd = -1;
+// Connection table, split into the state that is hot and the state that is
+// cold. Both are indexed by the slot of the client.
+_Thread_local struct connection *connections = NULL;
+_Thread_local struct connection_info *conn_info = NULL;
+// Capacity of the connection table and the number of slots ever handed out.
+// Only the first num_slots entries need to be scanned.
+_Thread_local int max_connections = 0, num_slots = 0;
+// Stack of indices that have been released by disconnected clients.
+_Thread_local int *free_slots = NULL, num_free_slots = 0;
+// Stacks of clients waiting to be disconnected and clients paused by
+// backpressure.
+_Thread_local int *closing_slots = NULL, num_closing_slots = 0;
+_Thread_local int *paused_slots = NULL, num_paused_slots = 0;
+// Clients set aside until their turn comes again or their rate limits allow,
+// in the order they were set aside, and the current pass of the event loop.
+_Thread_local int *throttled_slots = NULL, num_throttled_slots = 0;
+_Thread_local unsigned long loop_pass = 0;
+// Number of this worker's clients that are congested.
+_Thread_local int num_local_congested = 0;
+// Timer of every slot, for logging in and for going idle, in a wheel that
+// tells the event loop how long it may wait. The time of the current pass
+// of the event loop is used for everything that only needs a rough time.
+_Thread_local struct timer *timers = NULL;
+_Thread_local struct timer_wheel wheel;
+_Thread_local uint64_t loop_ms = 0;
+// State of the io_uring engine. A worker falls back to epoll if its ring
+// cannot be set up, so use_uring tells which engine the worker really runs.
+_Thread_local bool use_uring = false;
+// Set while an accept is armed on the io_uring, on the server socket and on
+// the Unix socket.
+_Thread_local bool accepting = false, accepting_local = false;
+_Thread_local struct uring ring;
+_Thread_local struct uring_buf_ring recv_bufs;
+// Stack of clients with messages to submit at the end of the loop.
+_Thread_local int *flush_slots = NULL, num_flush_slots = 0;
+_Thread_local struct uring_send *sends_in_flight = NULL;
+// Pools of the buffers holding frames received in part and of the sends
+// small enough to be recycled.
+_Thread_local struct pool recv_pool, send_pool;
+// Members of each room on this worker, indexed by room id. The array grows
+// when a client joins a room past its end.
+_Thread_local struct room_members *local_rooms = NULL;
+_Thread_local int num_local_rooms = 0;
+
+_Thread_local char inbuf[MAX_MSG_LEN + 1];
+// Frames are read into the back of readbuf. The front has room for the start
+// of a frame left over from the previous read, so it can be moved in front of
+// the new data.
+_Thread_local char readbuf[MAX_FRAME_LEN + READ_BUFFER_SIZE];
+_Thread_local char outbuf[BUFLEN + 1];
+
+_Thread_local struct sockaddr_in server_addr;
+_Thread_local socklen_t addrlen = sizeof(struct sockaddr_in);
+
+// Names of the users connected to any worker, kept in sorted order. The
+// number of entries is num_connections, and roster_chars is the total length
+// of the names. The welcome message listing them is rendered only when it is
+// needed after the roster has changed, and shared by every new connection
+// until the next change. Each entry holds a copy of the name, so the roster
+// does not depend on where the connection tables of the workers are. All of
+// it is guarded by roster_lock.
+char (*roster)[MAX_NAME_LEN + 1] = NULL;
+int num_connections = 0, roster_capacity = 0;
+size_t roster_chars = 0;
+struct message *cached_welcome = NULL;
+pthread_mutex_t roster_lock = PTHREAD_MUTEX_INITIALIZER;
+// Open-addressing hash table from user name to connection, with linear
+// probing. It has a power of two entries, at most half of them used, and
+// empty entries have an empty name. Names are unique, so it holds exactly
+// the names in the roster, and is guarded by roster_lock as well.
+struct user_entry *users = NULL;
+unsigned users_capacity = 0;
+
+// Chat rooms, indexed by room id. A room is never moved or freed while the
+// server runs, so a worker holding a room id may use the room without taking
+// rooms_lock, which only guards looking up and creating rooms.
+struct room *rooms[MAX_ROOMS];
+int num_rooms = 0;
+pthread_mutex_t rooms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Cleared to stop the server. Every worker reads it while the signal handler
+// or another thread clears it, so it has to be atomic, and lock-free for the
+// handler to set it.
+_Static_assert(ATOMIC_BOOL_LOCK_FREE == 2, "atomic_bool must be lock-free");
+atomic_bool running = true;
+// Set by SIGUSR2 until the main thread starts a new process to take over.
+volatile sig_atomic_t restart_requested = false;
+// Set once the new process is ready, before the workers are stopped. The
+// workers then hand their clients over instead of saying goodbye, after
+// waiting until none of them takes in anything more.
+atomic_bool restarting = false;
+atomic_int num_quiet_workers = 0;
+// Arguments the server was started with, to start the new process with, and
+// the socket leading to that process.
+char **server_argv = NULL;
+int handoff_fd = -1;
+
+/**
+ * Signal handler. SIGUSR2 asks for a hot restart, and any other signal for
+ * shutting down.
+ */
+void catch_signal(int sig) {
+    if (sig == SIGUSR2) {
+        restart_requested = true;
+    } else {
+        atomic_store(&running, false);
+    }
+}
+
+/**
+ * Initializes an empty inbox. The stub node keeps the queue non-empty, so
+ * producers never have to touch the head.
+ */
+void inbox_init(struct inbox *q) {
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->tail, &q->stub);
+    q->head = &q->stub;
+}
+
+/**
+ * Appends a node to the inbox. Safe to call from any thread.
+ */
+void inbox_push(struct inbox *q, struct inbox_node *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    struct inbox_node *prev = atomic_exchange(&q->tail, node);
+    atomic_store(&prev->next, node);
+}
+
+/**
+ * Removes the oldest node from the inbox. Must only be called by the owning
+ * worker. Returns NULL if the inbox is empty, or if a producer is half-way
+ * through a push; that producer will wake the worker again once it is done.
+ */
+struct inbox_node *inbox_pop(struct inbox *q) {
+    struct inbox_node *head = q->head;
+    struct inbox_node *next = atomic_load(&head->next);
+    if (head == &q->stub) {
+        if (!next) {
+            return NULL;
+        }
+        q->head = next;
+        head = next;
+        next = atomic_load(&head->next);
+    }
+    if (next) {
+        q->head = next;
+        return head;
+    }
+    if (head != atomic_load(&q->tail)) {
+        return NULL;
+    }
+    // head is the last real node. Put the stub back behind it so head can be
+    // handed out without leaving the queue empty.
+    inbox_push(q, &q->stub);
+    next = atomic_load(&head->next);
+    if (next) {
+        q->head = next;
+        return head;
+    }
+    return NULL;
+}
+
+/**
+ * Wakes a worker blocked in epoll_wait() so it drains its inbox.
+ */
+void wake_worker(struct worker *w) {
+    if (!atomic_exchange(&w->wake_pending, true)) {
+        uint64_t one = 1;
+        if (write(w->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            log_printf(LOG_WARNING, "Warning: Failed to wake worker %d. %s.",
+                       w->id, strerror(errno));
+        }
+    }
+}
+
+/**
+ * Marks a client to be disconnected once the current event has been handled.
+ * Disconnecting right away would broadcast a message in the middle of
+ * another broadcast.
+ */
+void close_client_later(int index) {
+    if (!(connections[index].flags & CLIENT_CLOSING)) {
+        connections[index].flags |= CLIENT_CLOSING;
+        closing_slots[num_closing_slots++] = index;
+    }
+}
+
+/**
+ * Wakes the workers that may have senders paused by backpressure.
+ */
+void release_backpressure() {
+    for (int i = 0; i < num_workers; i++) {
+        if (&workers[i] != self) {
+            wake_worker(&workers[i]);
+        }
+    }
+}
+
+/**
+ * Updates the congestion state of a client's send queue. Under the
+ * backpressure policy, a queue becomes congested when it goes over the limit
+ * and stops being congested when it has drained to half the limit.
+ */
+void update_congestion(struct send_queue *q) {
+    if (!q->congested && q->bytes > queue_limit) {
+        q->congested = true;
+        q->congested_since = time(NULL);
+        num_local_congested++;
+        atomic_fetch_add(&num_congested, 1);
+    } else if (q->congested && q->bytes <= queue_limit / 2) {
+        q->congested = false;
+        num_local_congested--;
+        if (atomic_fetch_sub(&num_congested, 1) == 1) {
+            release_backpressure();
+        }
+    }
+}
+
+/**
+ * Returns the form messages take on the wire to a client.
+ */
+enum message_encoding_t client_encoding(int index) {
+    unsigned short flags = connections[index].flags;
+    if (flags & CLIENT_LEGACY) {
+        return MESSAGE_RAW;
+    }
+    return flags & CLIENT_DEFLATE ? MESSAGE_DEFLATE : MESSAGE_FRAMED;
+}
+
+/**
+ * Lets go of the shared ring of a client, if it has one. The client keeps
+ * its own mapping, so it can still read what is left in the ring.
+ */
+void close_shared_ring(int index) {
+    struct connection_info *info = &conn_info[index];
+    if (info->shared_ring) {
+        munmap(info->shared_ring,
+               sizeof(struct proto_ring) + SHARED_RING_SIZE);
+        close(info->ring_event);
+        info->shared_ring = NULL;
+        info->ring_event = -1;
+    }
+    connections[index].flags &= ~(CLIENT_RING | CLIENT_WANTS_RING);
+}
+
+/**
+ * Switches a client that asked for a shared ring over to one. The client is
+ * told about the ring with a MSG_RING frame, which carries the shared memory
+ * and the eventfd, so it is sent right away rather than queued, and nothing
+ * else may be queued for the client. If the socket has no room for it, the
+ * client stays on the socket until the next message.
+ */
+void open_shared_ring(int index) {
+    size_t size = sizeof(struct proto_ring) + SHARED_RING_SIZE;
+    struct proto_ring *r = MAP_FAILED;
+    int event_fd = -1;
+    // The memory is only reached through its descriptor, so its name is
+    // removed as soon as it is created.
+    char name[64];
+    sprintf(name, "/chatserver.%d.%u", (int)getpid(),
+            atomic_fetch_add(&num_shared_rings, 1));
+    int mem_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (mem_fd < 0) {
+        goto FAIL;
+    }
+    shm_unlink(name);
+    if (ftruncate(mem_fd, size) < 0 ||
+            (r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd,
+                      0)) == MAP_FAILED ||
+            (event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        goto FAIL;
+    }
+
+    char frame[PROTO_HEADER_LEN + sizeof(uint32_t)];
+    uint32_t ring_size = htonl(SHARED_RING_SIZE);
+    proto_write_header(frame, MSG_RING, sizeof(uint32_t));
+    memcpy(frame + PROTO_HEADER_LEN, &ring_size, sizeof(uint32_t));
+    int fds[2] = { mem_fd, event_fd };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { frame, sizeof(frame) };
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(struct msghdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t n;
+    do {
+        n = sendmsg(connections[index].fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        munmap(r, size);
+        close(mem_fd);
+        close(event_fd);
+        return;
+    }
+    if (n != sizeof(frame)) {
+        // Part of a frame has gone out, so the stream is corrupted.
+        if (n >= 0) {
+            close_client_later(index);
+            errno = EPIPE;
+        }
+        goto FAIL;
+    }
+    metrics_count(METRIC_BYTES_OUT, n);
+    metrics_count(METRIC_MESSAGES_OUT, 1);
+    close(mem_fd);
+    conn_info[index].shared_ring = r;
+    conn_info[index].ring_event = event_fd;
+    // Frames in shared memory are only ever copied, so there is nothing to
+    // save by compressing them.
+    unsigned short *flags = &connections[index].flags;
+    if (*flags & (CLIENT_DEFLATE | CLIENT_WANTS_DEFLATE)) {
+        *flags &= ~(CLIENT_DEFLATE | CLIENT_WANTS_DEFLATE);
+        atomic_fetch_sub(&num_deflate_clients, 1);
+    }
+    *flags &= ~CLIENT_WANTS_RING;
+    *flags |= CLIENT_RING;
+    log_printf(LOG_INFO, "Sending to %s through shared memory.",
+               conn_info[index].peer);
+    return;
+
+FAIL:
+    log_printf(LOG_WARNING, "Warning: Failed to set up shared memory for %s. "
+               "%s.", conn_info[index].peer, strerror(errno));
+    connections[index].flags &= ~CLIENT_WANTS_RING;
+    if (r != MAP_FAILED) {
+        munmap(r, size);
+    }
+    if (mem_fd >= 0) {
+        close(mem_fd);
+    }
+    if (event_fd >= 0) {
+        close(event_fd);
+    }
+}
+
+/**
+ * Starts sending compressed frames to a client that asked for them, or
+ * frames through a shared ring, once nothing is queued for it. Every message
+ * in a send queue is then counted and sent in the same form.
+ */
+void update_encoding(int index) {
+    if (connections[index].queue.count > 0) {
+        return;
+    }
+    if (connections[index].flags & CLIENT_WANTS_DEFLATE) {
+        connections[index].flags &= ~CLIENT_WANTS_DEFLATE;
+        connections[index].flags |= CLIENT_DEFLATE;
+    }
+    if (connections[index].flags & CLIENT_WANTS_RING) {
+        open_shared_ring(index);
+    }
+}
+
+/**
+ * Removes the message at the front of a client's send queue and drops the
+ * queue's reference to it.
+ */
+void pop_send_queue(struct send_queue *q) {
+    message_unref(q->ring[q->head]);
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    metrics_adjust(METRIC_QUEUED_MESSAGES, -1);
+}
+
+/**
+ * Appends a message to the back of a client's send queue, growing the ring if
+ * it is full. The queue takes over the caller's reference.
+ * Returns true on success, false if memory could not be allocated.
+ */
+bool push_send_queue(struct send_queue *q, struct message *msg) {
+    if (q->count == q->capacity) {
+        unsigned new_capacity = q->capacity ? q->capacity * 2
+                                            : INITIAL_QUEUE_CAPACITY;
+        struct message **new_ring =
+            malloc(new_capacity * sizeof(struct message *));
+        if (!new_ring) {
+            return false;
+        }
+        // Unwrap the ring, so the oldest message ends up at index 0.
+        for (unsigned i = 0; i < q->count; i++) {
+            new_ring[i] = q->ring[(q->head + i) % q->capacity];
+        }
+        free(q->ring);
+        q->ring = new_ring;
+        q->capacity = new_capacity;
+        q->head = 0;
+    }
+    q->ring[(q->head + q->count) % q->capacity] = msg;
+    q->count++;
+    metrics_adjust(METRIC_QUEUED_MESSAGES, 1);
+    return true;
+}
+
+/**
+ * Drops all the messages waiting to be sent to a client. The ring itself is
+ * kept for the next client to use the slot.
+ */
+void clear_send_queue(int index) {
+    struct send_queue *q = &connections[index].queue;
+    while (q->count > 0) {
+        pop_send_queue(q);
+    }
+    metrics_adjust(METRIC_QUEUED_BYTES, -(int64_t)q->bytes);
+    q->offset = q->bytes = 0;
+    q->in_flight = 0;
+    update_congestion(q);
+}
+
+/**
+ * Retires the messages at the front of a client's send queue that went out
+ * completely, after bytes_sent more bytes of the queue have been sent.
+ */
+void retire_sent(int index, size_t bytes_sent) {
+    struct send_queue *q = &connections[index].queue;
+    enum message_encoding_t encoding = client_encoding(index);
+    q->bytes -= bytes_sent;
+    metrics_adjust(METRIC_QUEUED_BYTES, -(int64_t)bytes_sent);
+    metrics_count(METRIC_BYTES_OUT, bytes_sent);
+    size_t remaining = q->offset + bytes_sent;
+    while (q->count > 0 &&
+           remaining >= message_len(q->ring[q->head], encoding)) {
+        remaining -= message_len(q->ring[q->head], encoding);
+        pop_send_queue(q);
+        metrics_count(METRIC_MESSAGES_OUT, 1);
+    }
+    q->offset = remaining;
+}
+
+/**
+ * Updates the state of a client after some of its send queue has been sent.
+ */
+void finish_flush(int index) {
+    struct send_queue *q = &connections[index].queue;
+    if (connections[index].state == STATE_WELCOMED && q->count == 0) {
+        connections[index].state = STATE_AWAITING_NAME;
+    }
+    // The welcome message may be larger than the queue limit, but a client
+    // that is logging in never holds up the senders.
+    if (connections[index].state == STATE_ACTIVE) {
+        update_congestion(q);
+    }
+}
+
+/**
+ * Marks a client to have its send queue submitted to the io_uring at the end
+ * of the loop, so all the messages queued for it in the meantime go out in a
+ * single send.
+ */
+void schedule_flush(int index) {
+    if (!(connections[index].flags & CLIENT_FLUSH)) {
+        connections[index].flags |= CLIENT_FLUSH;
+        flush_slots[num_flush_slots++] = index;
+    }
+}
+
+/**
+ * Copies a framed message into the shared ring of a client, and wakes the
+ * client up if it is waiting for one.
+ * Returns true on success, false if the ring has no room for the message.
+ */
+bool put_shared_ring(int index, struct message *msg) {
+    struct proto_ring *r = conn_info[index].shared_ring;
+    char *data = proto_ring_data(r);
+    size_t len = message_len(msg, MESSAGE_FRAMED);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    // A client that messes with the head only ever finds its ring full.
+    uint32_t used = tail - atomic_load(&r->head);
+    if (used > SHARED_RING_SIZE || len > SHARED_RING_SIZE - used) {
+        return false;
+    }
+    struct iovec iov[MESSAGE_MAX_IOV];
+    int num_iov = message_iov(msg, MESSAGE_FRAMED, 0, iov);
+    for (int i = 0; i < num_iov; i++) {
+        size_t offset = tail & (SHARED_RING_SIZE - 1);
+        size_t first = iov[i].iov_len < SHARED_RING_SIZE - offset
+                     ? iov[i].iov_len : SHARED_RING_SIZE - offset;
+        memcpy(data + offset, iov[i].iov_base, first);
+        memcpy(data, (char *)iov[i].iov_base + first, iov[i].iov_len - first);
+        tail += iov[i].iov_len;
+    }
+    atomic_store(&r->tail, tail);
+    if (atomic_load(&r->reader_waiting) &&
+            atomic_exchange(&r->reader_waiting, 0)) {
+        uint64_t one = 1;
+        if (write(conn_info[index].ring_event, &one, sizeof(one)) == -1 &&
+                errno != EAGAIN) {
+            log_printf(LOG_WARNING, "Warning: Failed to wake up %s. %s.",
+                       conn_info[index].peer, strerror(errno));
+        }
+    }
+    return true;
+}
+
+/**
+ * Copies as many of a client's queued messages into its shared ring as fit.
+ * If the ring fills up, the client is asked to say when it has made room. A
+ * message too long for the ring sends the client back to its socket.
+ * Returns false if the rest of the queue has to go out through the socket.
+ */
+bool flush_shared_ring(int index) {
+    struct send_queue *q = &connections[index].queue;
+    struct proto_ring *r = conn_info[index].shared_ring;
+    while (q->count > 0) {
+        struct message *msg = q->ring[q->head];
+        size_t len = message_len(msg, MESSAGE_FRAMED);
+        if (len > SHARED_RING_SIZE) {
+            log_printf(LOG_INFO, "Sending to %s through its socket again.",
+                       conn_info[index].peer);
+            close_shared_ring(index);
+            return false;
+        }
+        if (put_shared_ring(index, msg)) {
+            retire_sent(index, len);
+        } else if (atomic_load(&r->writer_waiting)) {
+            break;
+        } else {
+            // The client may have made room before it could see the flag,
+            // so look again once it is set.
+            atomic_store(&r->writer_waiting, 1);
+        }
+    }
+    finish_flush(index);
+    return true;
+}
+
+/**
+ * Sends as much of a client's queued messages as the socket accepts without
+ * blocking. Up to MAX_SEND_IOVECS pieces of queued messages are handed to the
+ * kernel in a single writev() call. Messages for a client with a shared ring
+ * are copied into the ring instead.
+ */
+void flush_send_queue(int index) {
+    if ((connections[index].flags & CLIENT_RING) &&
+            flush_shared_ring(index)) {
+        return;
+    }
+    struct send_queue *q = &connections[index].queue;
+    enum message_encoding_t encoding = client_encoding(index);
+    struct iovec iov[MAX_SEND_IOVECS];
+    while (q->count > 0) {
+        int num_iov = 0;
+        size_t offset = q->offset;
+        for (unsigned i = 0; i < q->count &&
+             num_iov <= MAX_SEND_IOVECS - MESSAGE_MAX_IOV; i++) {
+            struct message *msg = q->ring[(q->head + i) % q->capacity];
+            num_iov += message_iov(msg, encoding, offset, iov + num_iov);
+            offset = 0;
+        }
+        ssize_t bytes_sent = writev(connections[index].fd, iov, num_iov);
+        if (bytes_sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_printf(LOG_WARNING, "Warning: Failed to send queued "
+                           "message. %s.", strerror(errno));
+                metrics_count(METRIC_SEND_ERRORS, 1);
+                // The socket is broken, so nothing queued will ever arrive.
+                clear_send_queue(index);
+            }
+            break;
+        }
+        retire_sent(index, bytes_sent);
+        if (q->count > 0 && q->offset > 0) {
+            break; // The socket did not take everything, so it is full.
+        }
+    }
+    finish_flush(index);
+}
+
+/**
+ * Returns the number of bytes queued for a client that have not been handed
+ * to the kernel yet. Like the bytes accepted by writev(), the messages of a
+ * send in flight on the io_uring no longer count against the queue limit.
+ */
+size_t queued_bytes(int index) {
+    struct send_queue *q = &connections[index].queue;
+    enum message_encoding_t encoding = client_encoding(index);
+    size_t bytes = q->bytes;
+    if (q->in_flight > 0) {
+        bytes += q->offset;
+        for (unsigned i = 0; i < q->in_flight; i++) {
+            bytes -= message_len(q->ring[(q->head + i) % q->capacity],
+                                 encoding);
+        }
+    }
+    return bytes;
+}
+
+/**
+ * Drops the references a send holds and frees it.
+ */
+void free_send(struct uring_send *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        sends_in_flight = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    for (int i = 0; i < s->num_msgs; i++) {
+        message_unref(s->msgs[i]);
+    }
+    if (s->num_msgs <= URING_POOLED_MSGS) {
+        pool_put(&send_pool, s);
+    } else {
+        free(s);
+    }
+}
+
+/**
+ * Hands as much of a client's send queue to the kernel as fits in a single
+ * sendmsg(). Large sends are made without copying the messages.
+ */
+void submit_send(int index) {
+    struct send_queue *q = &connections[index].queue;
+    enum message_encoding_t encoding = client_encoding(index);
+    unsigned n = q->count < URING_MAX_IOVECS / MESSAGE_MAX_IOV
+               ? q->count : URING_MAX_IOVECS / MESSAGE_MAX_IOV;
+    // Whether the send is pooled follows from the number of messages, so
+    // free_send() knows where it came from.
+    struct uring_send *s = n <= URING_POOLED_MSGS ? pool_get(&send_pool)
+        : malloc(sizeof(struct uring_send) + n * (MESSAGE_MAX_IOV *
+                 sizeof(struct iovec) + sizeof(struct message *)));
+    if (!s) {
+        log_printf(LOG_WARNING, "Warning: Failed to send queued message. %s.",
+                   strerror(errno));
+        metrics_count(METRIC_SEND_ERRORS, 1);
+        return;
+    }
+    s->msgs = (struct message **)(s->iov + n * MESSAGE_MAX_IOV);
+    int num_iov = 0;
+    size_t offset = q->offset, len = 0;
+    for (unsigned i = 0; i < n; i++) {
+        struct message *msg = q->ring[(q->head + i) % q->capacity];
+        num_iov += message_iov(msg, encoding, offset, s->iov + num_iov);
+        len += message_len(msg, encoding) - offset;
+        s->msgs[i] = message_ref(msg);
+        offset = 0;
+    }
+    s->num_msgs = n;
+    s->index = index;
+    s->generation = conn_info[index].generation;
+    // Unix sockets cannot send without copying.
+    s->zero_copy = uring_zero_copy && len >= URING_ZC_THRESHOLD &&
+                   !(connections[index].flags & CLIENT_LOCAL);
+    s->done = false;
+    memset(&s->hdr, 0, sizeof(struct msghdr));
+    s->hdr.msg_iov = s->iov;
+    s->hdr.msg_iovlen = num_iov;
+    s->prev = NULL;
+    s->next = sends_in_flight;
+    if (sends_in_flight) {
+        sends_in_flight->prev = s;
+    }
+    sends_in_flight = s;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (!sqe) {
+        log_printf(LOG_WARNING, "Warning: Failed to send queued message. "
+                   "The submission queue is full.");
+        metrics_count(METRIC_SEND_ERRORS, 1);
+        free_send(s);
+        return;
+    }
+    uring_prep_sendmsg(sqe, connections[index].fd, &s->hdr, s->zero_copy,
+                       (uint64_t)(uintptr_t)s);
+    q->in_flight = n;
+    connections[index].flags |= CLIENT_SENDING;
+}
+
+/**
+ * Sends a message to a client without blocking. Whatever the socket does not
+ * accept right away stays queued, sharing the message with every other
+ * client it was sent to, and is sent when the socket becomes writable. If
+ * the queue is full, the slow consumer policy decides what happens. Under
+ * io_uring, the message is always queued and goes out with the rest of the
+ * queue at the end of the loop.
+ */
+void send_message(int index, struct message *msg) {
+    struct send_queue *q = &connections[index].queue;
+    if (connections[index].flags & CLIENT_CLOSING) {
+        return;
+    }
+    update_encoding(index);
+    enum message_encoding_t encoding = client_encoding(index);
+    // A message only this caller holds may still be compressed. Messages
+    // sent to many clients are compressed before they are shared.
+    if (encoding == MESSAGE_DEFLATE &&
+            atomic_load_explicit(&msg->refs, memory_order_acquire) == 1) {
+        message_compress(msg);
+    }
+    size_t len = message_len(msg, encoding);
+    size_t bytes_sent = 0;
+    // If nothing is queued, try to send the message right away. A client
+    // with a shared ring is sent it with a copy into the ring, under either
+    // engine.
+    if (q->count == 0 && (connections[index].flags & CLIENT_RING)) {
+        if (put_shared_ring(index, msg)) {
+            metrics_count(METRIC_BYTES_OUT, len);
+            metrics_count(METRIC_MESSAGES_OUT, 1);
+            return;
+        }
+    } else if (q->count == 0 && !use_uring) {
+        struct iovec iov[MESSAGE_MAX_IOV];
+        int num_iov = message_iov(msg, encoding, 0, iov);
+        ssize_t n = writev(connections[index].fd, iov, num_iov);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_printf(LOG_WARNING,
+                           "Warning: Failed to broadcast message. %s.",
+                           strerror(errno));
+                metrics_count(METRIC_SEND_ERRORS, 1);
+                return;
+            }
+            n = 0;
+        }
+        metrics_count(METRIC_BYTES_OUT, n);
+        if (n == len) {
+            metrics_count(METRIC_MESSAGES_OUT, 1);
+            return;
+        }
+        bytes_sent = n;
+    }
+
+    // Only active clients are subject to the slow consumer policy. The one
+    // message sent to a client that is logging in is the welcome message.
+    // While a send is in flight on the io_uring, it is not known yet how
+    // much of the queue the client has taken, so the queue is given the
+    // same slack as under backpressure.
+    size_t queued = queued_bytes(index);
+    bool sending = connections[index].flags & CLIENT_SENDING;
+    size_t limit = sending ? queue_limit * QUEUE_HARD_LIMIT_FACTOR
+                           : queue_limit;
+    if (queued + len - bytes_sent > limit &&
+            connections[index].state == STATE_ACTIVE) {
+        if (slow_policy == POLICY_DISCONNECT ||
+                (slow_policy == POLICY_BACKPRESSURE &&
+                 queued + len > queue_limit * QUEUE_HARD_LIMIT_FACTOR)) {
+            log_printf(LOG_INFO, "User '%s' is not keeping up. Disconnecting.",
+                       conn_info[index].username);
+            metrics_count(METRIC_SLOW_DISCONNECTS, 1);
+            close_client_later(index);
+            return;
+        }
+        if (slow_policy == POLICY_DROP_OLDEST) {
+            // Drop whole messages from the front. A message that has been
+            // partially sent must be finished, or the stream is corrupted,
+            // and messages handed to the kernel can no longer be taken back,
+            // so drop the messages behind those and move those up.
+            unsigned kept = q->in_flight ? q->in_flight : q->offset > 0;
+            unsigned dropped = 0;
+            while (kept + dropped < q->count && queued + len > limit) {
+                struct message *old =
+                    q->ring[(q->head + kept + dropped) % q->capacity];
+                q->bytes -= message_len(old, encoding);
+                queued -= message_len(old, encoding);
+                metrics_adjust(METRIC_QUEUED_BYTES,
+                               -(int64_t)message_len(old, encoding));
+                message_unref(old);
+                dropped++;
+            }
+            for (unsigned i = kept; i > 0 && dropped > 0; i--) {
+                q->ring[(q->head + i - 1 + dropped) % q->capacity] =
+                    q->ring[(q->head + i - 1) % q->capacity];
+            }
+            q->head = (q->head + dropped) % q->capacity;
+            q->count -= dropped;
+            metrics_adjust(METRIC_QUEUED_MESSAGES, -(int64_t)dropped);
+            metrics_count(METRIC_QUEUE_DROPS, dropped);
+        }
+    }
+
+    if (!push_send_queue(q, message_ref(msg))) {
+        message_unref(msg);
+        log_printf(LOG_WARNING, "Warning: Failed to queue message. %s.",
+                   strerror(errno));
+        metrics_count(METRIC_QUEUE_DROPS, 1);
+        return;
+    }
+    if (q->count == 1) {
+        q->offset = bytes_sent;
+    }
+    q->bytes += len - bytes_sent;
+    metrics_adjust(METRIC_QUEUED_BYTES, len - bytes_sent);
+    // The congestion of a client with a send in flight is updated once the
+    // send completes.
+    if (slow_policy == POLICY_BACKPRESSURE && !sending) {
+        update_congestion(q);
+    }
+    // The shared ring was full. If the message does not fit in it at all,
+    // the queue goes out through the socket from now on, and with epoll the
+    // socket will not report being writable until it has been written to.
+    if (connections[index].flags & CLIENT_RING) {
+        if (flush_shared_ring(index)) {
+            return;
+        }
+        if (!use_uring) {
+            flush_send_queue(index);
+            return;
+        }
+    }
+    if (use_uring) {
+        schedule_flush(index);
+        // A queue that is filling up is sent right away, so a busy loop
+        // does not push the client over its limit before the end. Once
+        // the worker has stopped, the queue is left for a new process.
+        if (atomic_load(&running) && q->bytes >= queue_limit / 2 &&
+                !(connections[index].flags & CLIENT_SENDING)) {
+            submit_send(index);
+            uring_submit(&ring);
+        }
+    }
+}
+
+/**
+ * Appends a message to a client's send queue without trying to send it, so a
+ * batch of messages can go out together in the next flush. The slow consumer
+ * policy is left to the caller.
+ * Returns true on success, false if memory could not be allocated.
+ */
+bool queue_message(int index, struct message *msg) {
+    struct send_queue *q = &connections[index].queue;
+    update_encoding(index);
+    if (!push_send_queue(q, message_ref(msg))) {
+        message_unref(msg);
+        return false;
+    }
+    size_t len = message_len(msg, client_encoding(index));
+    q->bytes += len;
+    metrics_adjust(METRIC_QUEUED_BYTES, len);
+    return true;
+}
+
+/**
+ * Sends the messages queued for a client with queue_message(). With epoll,
+ * as much as the socket takes is sent right away. Under io_uring, the queue
+ * is submitted at the end of the loop.
+ */
+void flush_queued(int index) {
+    if (!use_uring) {
+        flush_send_queue(index);
+        return;
+    }
+    schedule_flush(index);
+    if (slow_policy == POLICY_BACKPRESSURE &&
+            !(connections[index].flags & CLIENT_SENDING)) {
+        update_congestion(&connections[index].queue);
+    }
+}
+
+/**
+ * Returns true if name is a valid room name: 1 to MAX_NAME_LEN letters,
+ * digits, dashes, underscores, or dots.
+ */
+bool is_room_name(const char *name, size_t len) {
+    if (len == 0 || len > MAX_NAME_LEN) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-' &&
+                name[i] != '_' && name[i] != '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Returns the id of the room with the given name, creating the room if it
+ * does not exist yet. Returns -1 if there are too many rooms or memory could
+ * not be allocated.
+ */
+int open_room(const char *name, size_t len) {
+    int room = -1;
+    pthread_mutex_lock(&rooms_lock);
+    for (int i = 0; i < num_rooms; i++) {
+        if (strlen(rooms[i]->name) == len &&
+                memcmp(rooms[i]->name, name, len) == 0) {
+            room = i;
+            goto EXIT;
+        }
+    }
+    if (num_rooms == MAX_ROOMS) {
+        errno = ENOSPC;
+        goto EXIT;
+    }
+    struct room *r = malloc(sizeof(struct room));
+    if (!r) {
+        goto EXIT;
+    }
+    r->history = NULL;
+    if (history_capacity > 0 &&
+            !(r->history =
+                  malloc(history_capacity * sizeof(struct message *)))) {
+        free(r);
+        goto EXIT;
+    }
+    memcpy(r->name, name, len);
+    r->name[len] = '\0';
+    atomic_init(&r->num_members, 0);
+    for (int i = 0; i < MAX_WORKERS / 64; i++) {
+        atomic_init(&r->workers[i], 0);
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    r->history_head = r->history_count = 0;
+    r->history_bytes = 0;
+    r->next_seq = 0;
+    room = num_rooms;
+    rooms[num_rooms++] = r;
+EXIT:
+    pthread_mutex_unlock(&rooms_lock);
+    return room;
+}
+
+/**
+ * Takes a client out of the room it is in, if any. The last member to leave
+ * the room on this worker takes the worker out of the room's bitmap.
+ */
+void leave_room(int index) {
+    int room = conn_info[index].room;
+    if (room == -1) {
+        return;
+    }
+    // Move the last member into the hole, so the array stays dense.
+    struct room_members *m = &local_rooms[room];
+    int pos = conn_info[index].room_pos, last = m->slots[--m->count];
+    m->slots[pos] = last;
+    m->joined[pos] = m->joined[m->count];
+    conn_info[last].room_pos = pos;
+    if (m->count == 0) {
+        atomic_fetch_and(&rooms[room]->workers[self->id / 64],
+                         ~((uint64_t)1 << (self->id % 64)));
+    }
+    atomic_fetch_sub(&rooms[room]->num_members, 1);
+    conn_info[index].room = -1;
+}
+
+/**
+ * Returns the memory taken up by a message.
+ */
+size_t message_size(const struct message *msg) {
+    return sizeof(struct message) + msg->header_len + msg->body_len;
+}
+
+/**
+ * Adds a chat line to the history of a room, dropping the oldest lines until
+ * the history fits in history_limit again. The history shares the message
+ * with the broadcast. Returns the sequence number of the line, or
+ * SEQ_ALWAYS if it is too large to keep. The caller must hold the room's
+ * lock.
+ */
+uint64_t record_history(struct room *r, struct message *msg) {
+    while (r->history_count > 0 &&
+           (r->history_count == history_capacity ||
+            r->history_bytes + message_size(msg) > history_limit)) {
+        struct message *old = r->history[r->history_head];
+        r->history_bytes -= message_size(old);
+        message_unref(old);
+        r->history_head = (r->history_head + 1) % history_capacity;
+        r->history_count--;
+    }
+    if (message_size(msg) > history_limit) {
+        return SEQ_ALWAYS;
+    }
+    r->history[(r->history_head + r->history_count) % history_capacity] =
+        message_ref(msg);
+    r->history_count++;
+    r->history_bytes += message_size(msg);
+    return r->next_seq++;
+}
+
+/**
+ * Adds a chat line recovered from the journal to the history of its room,
+ * creating the room if needed.
+ */
+void recover_line(const char *room_name, size_t room_len, unsigned char type,
+                  const char *payload, size_t len) {
+    if (type != MSG_CHAT || !is_room_name(room_name, room_len) ||
+            len > BUFLEN) {
+        return;
+    }
+    int room = open_room(room_name, room_len);
+    struct message *msg = message_create(type, NULL, 0, payload, len);
+    if (room == -1 || !msg) {
+        message_unref(msg);
+        return;
+    }
+    pthread_mutex_lock(&rooms[room]->lock);
+    record_history(rooms[room], msg);
+    pthread_mutex_unlock(&rooms[room]->lock);
+    message_unref(msg);
+}
+
+/**
+ * Makes sure the array of members of a room on this worker has room for one
+ * more member.
+ * Returns true on success, false if memory could not be allocated.
+ */
+bool reserve_member(int room) {
+    if (room >= num_local_rooms) {
+        int new_num = num_local_rooms ? num_local_rooms : 1;
+        while (new_num <= room) {
+            new_num *= 2;
+        }
+        struct room_members *new_rooms =
+            realloc(local_rooms, new_num * sizeof(struct room_members));
+        if (!new_rooms) {
+            return false;
+        }
+        memset(new_rooms + num_local_rooms, 0,
+               (new_num - num_local_rooms) * sizeof(struct room_members));
+        local_rooms = new_rooms;
+        num_local_rooms = new_num;
+    }
+    struct room_members *m = &local_rooms[room];
+    if (m->count == m->capacity) {
+        int new_capacity = m->capacity ? m->capacity * 2
+                                       : INITIAL_ROOM_CAPACITY;
+        int *new_slots = realloc(m->slots, new_capacity * sizeof(int));
+        if (!new_slots) {
+            return false;
+        }
+        m->slots = new_slots;
+        uint64_t *new_joined =
+            realloc(m->joined, new_capacity * sizeof(uint64_t));
+        if (!new_joined) {
+            return false;
+        }
+        m->joined = new_joined;
+        m->capacity = new_capacity;
+    }
+    return true;
+}
+
+/**
+ * Moves a client from the room it is in, if any, to the given room, and
+ * queues up the room's history for it. The first member to join the room on
+ * this worker adds the worker to the room's bitmap.
+ * Returns true on success, false if memory could not be allocated, in which
+ * case the client stays where it was.
+ */
+bool join_room(int index, int room) {
+    if (!reserve_member(room)) {
+        return false;
+    }
+    struct room_members *m = &local_rooms[room];
+    leave_room(index);
+    conn_info[index].room = room;
+    conn_info[index].room_pos = m->count;
+    m->slots[m->count] = index;
+
+    // Becoming a member and taking the history happen together, so every
+    // chat line is either in the history or delivered to the new member, and
+    // never both.
+    struct room *r = rooms[room];
+    pthread_mutex_lock(&r->lock);
+    m->joined[m->count++] = r->next_seq;
+    if (m->count == 1) {
+        atomic_fetch_or(&r->workers[self->id / 64],
+                        (uint64_t)1 << (self->id % 64));
+    }
+    bool replayed = r->history_count > 0;
+    for (unsigned i = 0; i < r->history_count; i++) {
+        if (!queue_message(index, r->history[(r->history_head + i) %
+                                             history_capacity])) {
+            log_printf(LOG_WARNING, "Warning: Failed to send history of room "
+                       "'%s'. %s.", r->name, strerror(errno));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+    atomic_fetch_add(&r->num_members, 1);
+    // The whole history goes out in as few writes as the socket allows.
+    if (replayed) {
+        flush_queued(index);
+    }
+    return true;
+}
+
+/**
+ * Sends a message to the members of a room on this worker except skip_index.
+ * To send the message to all local members, pass -1 for skip_index. Members
+ * that joined after the message with sequence number seq was added to the
+ * history already have it.
+ */
+void deliver_message(int skip_index, int room, uint64_t seq,
+                     struct message *msg) {
+    if (room < 0 || room >= num_local_rooms) {
+        return;
+    }
+    uint64_t start = metrics_now();
+    struct room_members *m = &local_rooms[room];
+    for (int i = 0; i < m->count; i++) {
+        if (m->slots[i] != skip_index && m->joined[i] <= seq) {
+            send_message(m->slots[i], msg);
+        }
+    }
+    metrics_record(METRIC_FANOUT_TIME, start);
+}
+
+/**
+ * Sends a message to the client in the given slot, unless the connection the
+ * message was meant for, told apart by its generation, is gone.
+ */
+void deliver_direct(int index, unsigned generation, struct message *msg) {
+    if (index < num_slots && connections[index].fd != -1 &&
+            conn_info[index].generation == generation &&
+            connections[index].state == STATE_ACTIVE) {
+        send_message(index, msg);
+    }
+}
+
+/**
+ * Hands a reference to a message to another worker through its inbox. For a
+ * message to a single user, room is ROOM_DIRECT, and index and generation
+ * tell the worker which of its connections the message is for.
+ */
+void relay_message(int worker, int room, uint64_t seq, int index,
+                   unsigned generation, struct message *msg) {
+    // Messages from other nodes of the cluster are relayed by the thread of
+    // the cluster, which is no worker.
+    struct pool *pool = self ? &self->inbox_nodes : &remote_nodes;
+    struct inbox_node *node = pool_get(pool);
+    if (!node) {
+        log_printf(LOG_WARNING, "Warning: Failed to relay message to "
+                   "worker %d. %s.", worker, strerror(errno));
+        return;
+    }
+    node->pool = pool;
+    node->msg = message_ref(msg);
+    node->room = room;
+    node->seq = seq;
+    node->index = index;
+    node->generation = generation;
+    inbox_push(&workers[worker].inbox, node);
+    wake_worker(&workers[worker]);
+}
+
+/**
+ * Broadcasts a message to the members of a room except skip_index.
+ * To send the message to all members, pass -1 for skip_index.
+ * Members on this worker are sent the message directly. Every other worker
+ * with members in the room gets a reference to the same message in its inbox,
+ * so the message is never copied. A message from another node of the
+ * cluster is broadcast by the thread of the cluster, which relays it to
+ * every worker with members in the room.
+ */
+void broadcast_message(int skip_index, int room, struct message *msg) {
+    // Chat lines are added to the history and the journal. The workers to
+    // relay them to are looked up at the same time, so a client joining the
+    // room on another worker either finds the line in the history or is
+    // relayed it, and the journal has the lines of a room in history order.
+    struct room *r = rooms[room];
+    uint64_t seq = SEQ_ALWAYS;
+    uint64_t relay_to[MAX_WORKERS / 64];
+    // Compress the message once for every client that takes compressed
+    // frames, before anyone else gets to see it.
+    if (atomic_load_explicit(&num_deflate_clients, memory_order_relaxed) > 0 &&
+            atomic_load_explicit(&msg->refs, memory_order_acquire) == 1) {
+        message_compress(msg);
+    }
+    bool recorded = msg->type == MSG_CHAT &&
+                    (history_capacity > 0 || journal_dir);
+    if (recorded) {
+        pthread_mutex_lock(&r->lock);
+        if (history_capacity > 0) {
+            seq = record_history(r, msg);
+        }
+        if (journal_dir) {
+            journal_append(r->name, msg);
+        }
+    }
+    // The other nodes get the lines of a room in history order as well.
+    // Messages from other nodes are not sent on, since every node is linked
+    // to every other one.
+    if (clustered && self) {
+        cluster_publish_line(r->name, msg);
+    }
+    for (int i = 0; i < MAX_WORKERS / 64; i++) {
+        relay_to[i] = atomic_load(&r->workers[i]);
+    }
+    if (recorded) {
+        pthread_mutex_unlock(&r->lock);
+    }
+    if (self) {
+        deliver_message(skip_index, room, seq, msg);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        if (&workers[i] != self &&
+                (relay_to[i / 64] & ((uint64_t)1 << (i % 64)))) {
+            relay_message(i, room, seq, -1, 0, msg);
+        }
+    }
+}
+
+/**
+ * Broadcasts the contents of the buffer as a message of the given type to the
+ * members of a room except skip_index. To send the message to all members,
+ * pass -1 for skip_index.
+ */
+void broadcast_buffer(int skip_index, int room, unsigned char type,
+                      char *buf) {
+    struct message *msg = message_from_string(type, buf);
+    if (!msg) {
+        log_printf(LOG_WARNING, "Warning: Failed to broadcast message. %s.",
+                   strerror(errno));
+        return;
+    }
+    broadcast_message(skip_index, room, msg);
+    message_unref(msg);
+}
+
+/**
+ * Sends the contents of the buffer to a single client as a message of the
+ * given type.
+ */
+void send_buffer(int index, unsigned char type, const char *buf) {
+    struct message *msg = message_from_string(type, buf);
+    if (!msg) {
+        log_printf(LOG_WARNING, "Warning: Failed to send message. %s.",
+                   strerror(errno));
+        return;
+    }
+    send_message(index, msg);
+    message_unref(msg);
+}
+
+/**
+ * Delivers the messages relayed by other workers to the local clients.
+ */
+void handle_inbox() {
+    uint64_t count;
+    if (read(self->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        log_printf(LOG_WARNING, "Warning: Failed to read wake-up event. %s.",
+                   strerror(errno));
+    }
+    // Clear the flag before draining, so a message pushed from now on
+    // triggers another wake-up.
+    atomic_store(&self->wake_pending, false);
+    struct inbox_node *node;
+    while ((node = inbox_pop(&self->inbox))) {
+        if (node->room == ROOM_DIRECT) {
+            deliver_direct(node->index, node->generation, node->msg);
+        } else {
+            deliver_message(-1, node->room, node->seq, node->msg);
+        }
+        message_unref(node->msg);
+        pool_put(node->pool, node);
+    }
+}
+
+/**
+ * Returns the index of the name in the roster if it is there. Otherwise,
+ * returns the index where it would have to be inserted to keep the roster
+ * sorted. The caller must hold roster_lock.
+ */
+int roster_find(const char *name) {
+    int lo = 0, hi = num_connections;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(roster[mid], name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Hashes a user name with FNV-1a.
+ */
+unsigned hash_name(const char *name) {
+    unsigned h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Returns the position of the name in the index of user names if it is
+ * there. Otherwise, returns the position of the empty entry where it would
+ * go. The index must not be empty. The caller must hold roster_lock.
+ */
+unsigned find_user(const char *name) {
+    unsigned mask = users_capacity - 1;
+    unsigned i = hash_name(name) & mask;
+    while (users[i].name[0] != '\0' && strcmp(users[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/**
+ * Doubles the size of the index of user names, moving every entry to its
+ * place in the new table. Returns true on success, false if memory could not
+ * be allocated. The caller must hold roster_lock.
+ */
+bool grow_users() {
+    unsigned old_capacity = users_capacity;
+    struct user_entry *old_users = users;
+    unsigned new_capacity = old_capacity ? old_capacity * 2
+                                         : 2 * INITIAL_CONNECTIONS;
+    struct user_entry *new_users =
+        calloc(new_capacity, sizeof(struct user_entry));
+    if (!new_users) {
+        return false;
+    }
+    users = new_users;
+    users_capacity = new_capacity;
+    for (unsigned i = 0; i < old_capacity; i++) {
+        if (old_users[i].name[0] != '\0') {
+            users[find_user(old_users[i].name)] = old_users[i];
+        }
+    }
+    free(old_users);
+    return true;
+}
+
+/**
+ * Empties the entry at position i of the index of user names. The entries
+ * after it in the same run are moved back into the gap where they can be,
+ * so every entry can still be found from its home position without leaving
+ * markers behind. The caller must hold roster_lock.
+ */
+void remove_user(unsigned i) {
+    unsigned mask = users_capacity - 1;
+    for (unsigned j = (i + 1) & mask; users[j].name[0] != '\0';
+         j = (j + 1) & mask) {
+        unsigned home = hash_name(users[j].name) & mask;
+        // The entry may move back only if the gap is between its home and
+        // where it is now.
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            users[i] = users[j];
+            i = j;
+        }
+    }
+    users[i].name[0] = '\0';
+}
+
+/**
+ * Adds a user name to the roster and the index of user names shared by all
+ * workers, keeping the roster sorted. The user is connected to the given
+ * slot and generation of the connection table of the given worker, or to
+ * the node in slot index of the cluster if worker is WORKER_REMOTE. A user
+ * of another node may take over the name from a node that has not been
+ * seen to let go of it yet, since the other node checked it was free.
+ * Returns true on success, false on failure with errno set to EEXIST if the
+ * name is taken, or ENOMEM if memory could not be allocated.
+ */
+bool roster_add(const char *name, int worker, int index,
+                unsigned generation) {
+    bool added = true;
+    pthread_mutex_lock(&roster_lock);
+    struct user_entry *taken = users_capacity > 0 ? &users[find_user(name)]
+                                                  : NULL;
+    if (taken && taken->name[0] != '\0') {
+        bool taken_over = worker == WORKER_REMOTE &&
+                          taken->worker == WORKER_REMOTE;
+        if (taken_over) {
+            taken->index = index;
+        }
+        pthread_mutex_unlock(&roster_lock);
+        errno = EEXIST;
+        return taken_over;
+    }
+    if ((num_connections + 1) * 2 > users_capacity && !grow_users()) {
+        added = false;
+    }
+    if (added && num_connections == roster_capacity) {
+        int new_capacity = roster_capacity ? roster_capacity * 2
+                                           : INITIAL_CONNECTIONS;
+        char (*new_roster)[MAX_NAME_LEN + 1] =
+            realloc(roster, new_capacity * sizeof(*roster));
+        if (new_roster) {
+            roster = new_roster;
+            roster_capacity = new_capacity;
+        } else {
+            added = false;
+        }
+    }
+    if (added) {
+        struct user_entry *u = &users[find_user(name)];
+        strcpy(u->name, name);
+        u->worker = worker;
+        u->index = index;
+        u->generation = generation;
+        int i = roster_find(name);
+        memmove(&roster[i + 1], &roster[i],
+                (num_connections - i) * sizeof(*roster));
+        strcpy(roster[i], name);
+        num_connections++;
+        roster_chars += strlen(name);
+        message_unref(cached_welcome);
+        cached_welcome = NULL;
+        // Telling the other nodes under the lock keeps them in step with the
+        // order the name was taken and let go of in.
+        if (clustered && worker != WORKER_REMOTE) {
+            cluster_publish_user(name, true);
+        }
+    }
+    pthread_mutex_unlock(&roster_lock);
+    return added;
+}
+
+/**
+ * Removes a user name from the roster and the index of user names shared by
+ * all workers. The user is on the node in the given slot of the cluster, or
+ * on this node if node is -1. Nothing is removed if the name belongs to a
+ * user anywhere else by now.
+ */
+void roster_remove(const char *name, int node) {
+    pthread_mutex_lock(&roster_lock);
+    int i = roster_find(name);
+    struct user_entry *u = users_capacity > 0 ? &users[find_user(name)]
+                                              : NULL;
+    if (i < num_connections && strcmp(roster[i], name) == 0 &&
+            (node < 0 ? u->worker != WORKER_REMOTE
+                      : u->worker == WORKER_REMOTE && u->index == node)) {
+        remove_user(find_user(name));
+        memmove(&roster[i], &roster[i + 1],
+                (num_connections - i - 1) * sizeof(*roster));
+        num_connections--;
+        roster_chars -= strlen(name);
+        message_unref(cached_welcome);
+        cached_welcome = NULL;
+        if (clustered && node < 0) {
+            cluster_publish_user(name, false);
+        }
+    }
+    pthread_mutex_unlock(&roster_lock);
+}
+
+/**
+ * Copies the names in roster[first] to roster[last - 1], separated by commas,
+ * to dst. Returns a pointer to the end of the copied text. The caller must
+ * hold roster_lock.
+ */
+char *render_names(char *dst, int first, int last) {
+    for (int i = first; i < last; i++) {
+        if (i > first) {
+            *dst++ = ',';
+            *dst++ = ' ';
+        }
+        size_t len = strlen(roster[i]);
+        memcpy(dst, roster[i], len);
+        dst += len;
+    }
+    return dst;
+}
+
+/**
+ * Returns a message that contains a welcome message as well as the list of
+ * all users currently connected to the server, or NULL if memory could not
+ * be allocated. The message is only rendered again after the roster has
+ * changed. The caller must drop its reference when done with it.
+ */
+struct message *get_welcome_msg() {
+    struct message *msg = NULL;
+    // The roster is changed by every worker, so hold the lock until the user
+    // names have been copied into the message.
+    pthread_mutex_lock(&roster_lock);
+    if (!cached_welcome) {
+        size_t len = strlen(WELCOME_BANNER);
+        if (num_connections == 0) {
+            len += strlen(NO_USERS_MSG);
+        } else {
+            // +2 for each ", " separator, +1 for the closing bracket.
+            len += strlen(USERS_MSG) + roster_chars +
+                   2 * (num_connections - 1) + 1;
+        }
+        cached_welcome = message_create(MSG_WELCOME, NULL, 0, NULL, len);
+        if (cached_welcome) {
+            char *p = cached_welcome->body;
+            p = stpcpy(p, WELCOME_BANNER);
+            if (num_connections == 0) {
+                memcpy(p, NO_USERS_MSG, strlen(NO_USERS_MSG));
+            } else {
+                p = stpcpy(p, USERS_MSG);
+                p = render_names(p, 0, num_connections);
+                *p = ']';
+            }
+        }
+    }
+    if (cached_welcome) {
+        msg = message_ref(cached_welcome);
+    }
+    pthread_mutex_unlock(&roster_lock);
+    return msg;
+}
+
+/**
+ * Sends a client one page of the sorted list of connected users, in reply
+ * to "/who [page]". Only the names on the page are looked at, so asking is
+ * cheap no matter how many users are connected.
+ */
+void send_who_page(int index, int page) {
+    pthread_mutex_lock(&roster_lock);
+    int num_pages = (num_connections + WHO_PAGE_SIZE - 1) / WHO_PAGE_SIZE;
+    if (page < 1 || page > num_pages) {
+        page = 1;
+    }
+    int first = (page - 1) * WHO_PAGE_SIZE;
+    int last = first + WHO_PAGE_SIZE < num_connections
+             ? first + WHO_PAGE_SIZE : num_connections;
+    // +2 for each ", " separator, +1 for the closing bracket.
+    size_t names_len = 1;
+    for (int i = first; i < last; i++) {
+        names_len += strlen(roster[i]) + (i > first ? 2 : 0);
+    }
+    int header_len = sprintf(outbuf, "Users %d-%d of %d (page %d of %d): [",
+                             first + 1, last, num_connections, page,
+                             num_pages);
+    struct message *msg =
+        message_create(MSG_INFO, outbuf, header_len, NULL, names_len);
+    if (msg) {
+        *render_names(msg->body, first, last) = ']';
+    }
+    pthread_mutex_unlock(&roster_lock);
+    if (!msg) {
+        log_printf(LOG_WARNING, "Warning: Failed to send user list. %s.",
+                   strerror(errno));
+        return;
+    }
+    send_message(index, msg);
+    message_unref(msg);
+}
+
+/**
+ * Grows the connection table to twice its size. New slots are marked unused.
+ * Returns true on success, false if memory could not be allocated.
+ */
+bool grow_connection_table() {
+    int new_max = max_connections ? max_connections * 2 : INITIAL_CONNECTIONS;
+    // realloc() does not keep the alignment, so the hot part of the table is
+    // copied over by hand.
+    struct connection *new_connections =
+        aligned_alloc(CACHE_LINE_SIZE, new_max * sizeof(struct connection));
+    if (!new_connections) {
+        return false;
+    }
+    if (connections) {
+        memcpy(new_connections, connections,
+               max_connections * sizeof(struct connection));
+        free(connections);
+    }
+    connections = new_connections;
+    struct connection_info *new_info =
+        realloc(conn_info, new_max * sizeof(struct connection_info));
+    if (!new_info) {
+        return false;
+    }
+    conn_info = new_info;
+    // The stacks of slots can never hold more indices than there are slots.
+    int *new_free_slots = realloc(free_slots, new_max * sizeof(int));
+    if (!new_free_slots) {
+        return false;
+    }
+    free_slots = new_free_slots;
+    int *new_closing_slots = realloc(closing_slots, new_max * sizeof(int));
+    if (!new_closing_slots) {
+        return false;
+    }
+    closing_slots = new_closing_slots;
+    int *new_paused_slots = realloc(paused_slots, new_max * sizeof(int));
+    if (!new_paused_slots) {
+        return false;
+    }
+    paused_slots = new_paused_slots;
+    int *new_throttled_slots = realloc(throttled_slots, new_max * sizeof(int));
+    if (!new_throttled_slots) {
+        return false;
+    }
+    throttled_slots = new_throttled_slots;
+    int *new_flush_slots = realloc(flush_slots, new_max * sizeof(int));
+    if (!new_flush_slots) {
+        return false;
+    }
+    flush_slots = new_flush_slots;
+    struct timer *new_timers = realloc(timers,
+                                       new_max * sizeof(struct timer));
+    if (!new_timers) {
+        return false;
+    }
+    timers = new_timers;
+    timer_wheel_attach(&wheel, timers);
+    for (int i = max_connections; i < new_max; i++) {
+        memset(&connections[i], 0, sizeof(struct connection));
+        memset(&conn_info[i], 0, sizeof(struct connection_info));
+        connections[i].fd = -1;
+        conn_info[i].ring_event = -1;
+        timer_clear(&timers[i]);
+    }
+    // The table is the pool of connections, one slot per client.
+    metrics_pool(METRIC_POOL_CONNECTIONS, (int64_t)(new_max - max_connections) *
+                 (sizeof(struct connection) + sizeof(struct connection_info) +
+                  sizeof(struct timer) + 5 * sizeof(int)), 0);
+    max_connections = new_max;
+    return true;
+}
+
+/**
+ * Returns the index of an unused slot in the connection table, growing the
+ * table if necessary. Returns -1 if the table could not be grown.
+ */
+int allocate_slot() {
+    if (num_free_slots > 0) {
+        metrics_pool(METRIC_POOL_CONNECTIONS, 0, 1);
+        return free_slots[--num_free_slots];
+    }
+    if (num_slots == max_connections && !grow_connection_table()) {
+        return -1;
+    }
+    metrics_pool(METRIC_POOL_CONNECTIONS, 0, 1);
+    return num_slots++;
+}
+
+/**
+ * Puts a slot that is no longer used back on the stack of free slots.
+ */
+void release_slot(int index) {
+    free_slots[num_free_slots++] = index;
+    metrics_pool(METRIC_POOL_CONNECTIONS, 0, -1);
+}
+
+/**
+ * Registers fd with the epoll instance for the given edge-triggered events.
+ * The tag is handed back in the event data when one of the events occurs.
+ */
+int watch_socket(int fd, uint64_t tag, uint32_t events) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = events | EPOLLET;
+    event.data.u64 = tag;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * Returns the user data of the io_uring requests that receive from a client.
+ */
+uint64_t recv_user_data(int index) {
+    return (uint64_t)index << 32 |
+           (uint64_t)(conn_info[index].generation & 0xffffff) << 8 | UD_RECV;
+}
+
+/**
+ * Starts receiving from a client through the io_uring. Every read completes
+ * with one of the worker's receive buffers, until the receive is cancelled
+ * or runs out of buffers.
+ * Returns true on success, false if the ring has no room for the request.
+ */
+bool arm_recv(int index) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (!sqe) {
+        return false;
+    }
+    uring_prep_recv_multishot(sqe, connections[index].fd, URING_BUF_GROUP,
+                              recv_user_data(index));
+    connections[index].flags |= CLIENT_RECEIVING;
+    return true;
+}
+
+/**
+ * Starts the login of a new connection. It has LOGIN_TIMEOUT seconds to send
+ * its user name.
+ */
+void start_login(int index) {
+    connections[index].state = STATE_WELCOMED;
+    conn_info[index].last_active = conn_info[index].last_ping = loop_ms;
+    timer_set(&wheel, index, loop_ms + LOGIN_TIMEOUT * 1000);
+}
+
+/**
+ * Sets the timer of a logged in client to go off when the client is next due
+ * to be pinged or to be disconnected for being idle, if either is turned on.
+ * Legacy clients cannot be pinged.
+ */
+void schedule_idle_check(int index) {
+    struct connection_info *info = &conn_info[index];
+    uint64_t due = UINT64_MAX;
+    if (idle_timeout > 0) {
+        due = info->last_active + idle_timeout;
+    }
+    if (ping_interval > 0 && !(connections[index].flags & CLIENT_LEGACY)) {
+        uint64_t last = info->last_active > info->last_ping
+                        ? info->last_active : info->last_ping;
+        if (last + ping_interval < due) {
+            due = last + ping_interval;
+        }
+    }
+    if (due == UINT64_MAX) {
+        timer_cancel(&wheel, index);
+    } else {
+        timer_set(&wheel, index, due);
+    }
+}
+
+/**
+ * Puts the buffer of a frame received in part back into the pool, if the
+ * client holds one.
+ */
+void release_recv_buffer(struct recv_buffer *rb) {
+    if (rb->data) {
+        pool_put(&recv_pool, rb->data);
+        rb->data = NULL;
+    }
+    rb->len = 0;
+}
+
+/**
+ * Disconnects a client from the server, freeing up resources to be used by
+ * another potential client.
+ */
+void disconnect_client(int index) {
+    log_printf(LOG_INFO, "Host %s disconnected.", conn_info[index].peer);
+
+    // Only users in a chat room are missed, and only by the others in it.
+    if (connections[index].state == STATE_ACTIVE) {
+        sprintf(outbuf, "User [%s] left the chat room.",
+                conn_info[index].username);
+        broadcast_buffer(index, conn_info[index].room, MSG_LEAVE, outbuf);
+        leave_room(index);
+    }
+    timer_cancel(&wheel, index);
+
+    // Close the socket and mark the array index as -1 for reuse. Closing the
+    // socket also removes it from the epoll instance. Requests on the
+    // io_uring hold on to the socket, so shut it down to end them. Anything
+    // still queued for the client is thrown away.
+    if (use_uring) {
+        shutdown(connections[index].fd, SHUT_RDWR);
+    }
+    close(connections[index].fd);
+    connections[index].fd = -1;
+    clear_send_queue(index);
+    metrics_adjust(METRIC_CONNECTIONS, -1);
+    release_recv_buffer(&conn_info[index].recv_buffer);
+    free(conn_info[index].held);
+    conn_info[index].held = NULL;
+    conn_info[index].held_len = 0;
+    if (connections[index].flags & (CLIENT_DEFLATE | CLIENT_WANTS_DEFLATE)) {
+        atomic_fetch_sub(&num_deflate_clients, 1);
+    }
+    close_shared_ring(index);
+    if (conn_info[index].rate_limited) {
+        conn_info[index].rate_limited = false;
+        metrics_adjust(METRIC_THROTTLED_CLIENTS, -1);
+    }
+    // The slot may still be on the stack of clients to flush, or in the list
+    // of throttled clients.
+    connections[index].flags &= CLIENT_FLUSH | CLIENT_THROTTLED;
+    // Clear the user name for reuse. Removing the name from the roster keeps
+    // track of the number of connections.
+    if (conn_info[index].username[0] != '\0') {
+        roster_remove(conn_info[index].username, -1);
+        conn_info[index].username[0] = '\0';
+    }
+    release_slot(index);
+}
+
+/**
+ * Refuses a pending connection on the given listener when the process has run
+ * out of file descriptors. The spare descriptor is released just long enough
+ * to accept and close the connection, so it does not sit in the listen queue
+ * forever.
+ */
+void refuse_connection(int listener) {
+    close(spare_fd);
+    int new_socket;
+    if (listener == local_socket) {
+        if ((new_socket = accept(listener, NULL, NULL)) >= 0) {
+            log_printf(LOG_INFO, "Connection from [local] refused.");
+        }
+    } else if ((new_socket = accept(listener,
+                                    (struct sockaddr *)&server_addr,
+                                    &addrlen)) >= 0) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &server_addr.sin_addr, ip, sizeof(ip));
+        log_printf(LOG_INFO, "Connection from [%s:%d] refused.", ip,
+                   ntohs(server_addr.sin_port));
+    }
+    if (new_socket >= 0) {
+        metrics_count(METRIC_REFUSALS, 1);
+        close(new_socket);
+    }
+    spare_fd = open("/dev/null", O_RDONLY);
+}
+
+/**
+ * Performs the tasks required to add a newly accepted client to the system.
+ * The client is sent the welcome message and then has to send its user name,
+ * without ever blocking the server. Until then, it is not part of the chat
+ * room. A local client, connected through the Unix socket, has no address,
+ * and is known by the order it connected in instead.
+ */
+void add_client(int new_socket, bool local) {
+    char ip[INET_ADDRSTRLEN];
+    char connection_str[INET_ADDRSTRLEN + 8];
+    int port;
+    if (local) {
+        strcpy(ip, "local");
+        port = atomic_fetch_add(&num_local_clients, 1) + 1;
+    } else {
+        inet_ntop(AF_INET, &server_addr.sin_addr, ip, sizeof(ip));
+        port = ntohs(server_addr.sin_port);
+    }
+    sprintf(connection_str, "[%s:%d]", ip, port);
+    // Log information about the client's connection.
+    log_printf(LOG_INFO, "New connection from %s.", connection_str);
+
+    // Reserve a slot in the connection table. If the table cannot grow,
+    // refuse the connection.
+    int index = allocate_slot();
+    if (index == -1) {
+        log_printf(LOG_INFO, "Connection from %s refused.", connection_str);
+        metrics_count(METRIC_REFUSALS, 1);
+        close(new_socket);
+        return;
+    }
+
+    // The socket must never block the server. With epoll, watch it for
+    // incoming messages and for room to send queued messages. With io_uring,
+    // the kernel does the waiting, and the socket is left blocking so the
+    // kernel waits for it instead of failing with EAGAIN.
+    // Chat lines are small and must go out right away, rather than wait for
+    // the client to acknowledge the previous one. A Unix socket charges every
+    // write against its buffer at the size of a whole packet, so a burst of
+    // chat lines would fill the default buffer long before a TCP socket's.
+    if (local) {
+        int size = LOCAL_SNDBUF_SIZE;
+        setsockopt(new_socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    } else {
+        int one = 1;
+        setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    connections[index].fd = new_socket;
+    conn_info[index].generation++;
+    bool watched;
+    if (use_uring) {
+        watched = arm_recv(index);
+    } else {
+        watched = fcntl(new_socket, F_SETFL,
+                        fcntl(new_socket, F_GETFL) | O_NONBLOCK) >= 0 &&
+                  watch_socket(new_socket, index, EPOLLIN | EPOLLOUT) == 0;
+    }
+    if (!watched) {
+        log_printf(LOG_WARNING, "Warning: Failed to watch socket for %s. %s.",
+                   connection_str, strerror(errno));
+        connections[index].fd = -1;
+        release_slot(index);
+        close(new_socket);
+        return;
+    }
+    metrics_count(METRIC_ACCEPTS, 1);
+    metrics_adjust(METRIC_CONNECTIONS, 1);
+    // Remember who the peer is for as long as the connection lasts.
+    struct connection_info *info = &conn_info[index];
+    strcpy(info->ip, ip);
+    info->port = port;
+    strcpy(info->peer, connection_str);
+    info->connected_at = time(NULL);
+    info->messages_received = info->bytes_received = 0;
+    info->room = -1;
+    // A slot still in the list of throttled clients is let go of on the next
+    // pass of the event loop.
+    info->resume_at = 0;
+    info->message_tokens.tokens = message_rate;
+    info->byte_tokens.tokens = byte_rate;
+    info->message_tokens.updated = info->byte_tokens.updated = metrics_now();
+    if (legacy_protocol) {
+        connections[index].flags |= CLIENT_LEGACY;
+    }
+    if (local) {
+        connections[index].flags |= CLIENT_LOCAL;
+    }
+    start_login(index);
+
+    // Send a welcome message to the new connection. Whatever does not fit in
+    // the socket is sent when it becomes writable.
+    struct message *welcome = get_welcome_msg();
+    if (!welcome) {
+        log_printf(LOG_WARNING, "Warning: Failed to send welcome message. %s.",
+                   strerror(errno));
+        close_client_later(index);
+        return;
+    }
+    send_message(index, welcome);
+    message_unref(welcome);
+    if (connections[index].queue.count == 0) {
+        connections[index].state = STATE_AWAITING_NAME;
+    }
+}
+
+/**
+ * Adds a client that sent its user name to the chat room and lets the other
+ * users know. If the name is taken, the client is told so and may send
+ * another one. Returns false if the client was disconnected.
+ */
+bool login_client(int index, const char *name, size_t len) {
+    // A client sending an empty name is treated as having hung up.
+    if (len == 0) {
+        disconnect_client(index);
+        return false;
+    }
+    // The client never sends longer names, so a longer one is cut short to
+    // fit in place.
+    if (len > MAX_NAME_LEN) {
+        len = MAX_NAME_LEN;
+    }
+    memcpy(conn_info[index].username, name, len);
+    conn_info[index].username[len] = '\0';
+    if (!roster_add(conn_info[index].username, self->id, index,
+                    conn_info[index].generation)) {
+        // The client may try another name until its login times out.
+        if (errno == EEXIST) {
+            log_printf(LOG_INFO, "User name '%s' asked for by %s is taken.",
+                       conn_info[index].username, conn_info[index].peer);
+            sprintf(outbuf, "User name [%s] is taken. Choose another one.",
+                    conn_info[index].username);
+            conn_info[index].username[0] = '\0';
+            connections[index].state = STATE_RENAMING;
+            send_buffer(index, MSG_NAME_TAKEN, outbuf);
+            return true;
+        }
+        log_printf(LOG_WARNING, "Warning: Failed to add user for %s. %s.",
+                   conn_info[index].peer, strerror(errno));
+        conn_info[index].username[0] = '\0';
+        disconnect_client(index);
+        return false;
+    }
+    if (!join_room(index, LOBBY_ROOM)) {
+        log_printf(LOG_WARNING, "Warning: Failed to add user for %s. %s.",
+                   conn_info[index].peer, strerror(errno));
+        disconnect_client(index);
+        return false;
+    }
+    log_printf(LOG_INFO, "Associated user name '%s' with %s.",
+               conn_info[index].username, conn_info[index].peer);
+    connections[index].state = STATE_ACTIVE;
+    schedule_idle_check(index);
+    sprintf(outbuf, "User [%s] joined the chat room.",
+            conn_info[index].username);
+    broadcast_buffer(index, LOBBY_ROOM, MSG_JOIN, outbuf);
+    return true;
+}
+
+/**
+ * Handles incoming connections on the server socket or the Unix socket.
+ * Both are edge-triggered, so all pending connections are accepted before
+ * returning.
+ */
+int handle_server_socket(int listener) {
+    bool local = listener == local_socket;
+    while (atomic_load(&running)) {
+        // Try to accept incoming connection.
+        int new_socket = local ? accept(listener, NULL, NULL)
+                               : accept(listener,
+                                        (struct sockaddr *)&server_addr,
+                                        &addrlen);
+        if (new_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break; // No more pending connections.
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                // Not a failure, just a limitation.
+                refuse_connection(listener);
+                continue;
+            }
+            fprintf(stderr,
+                    "Error: Failed to accept incoming connection. %s.\n",
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        add_client(new_socket, local);
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Disconnects the clients that were marked for closing while handling an
+ * event. Disconnecting a client broadcasts a message, which may mark more
+ * clients, so keep going until there are none left.
+ */
+void close_pending_clients() {
+    while (num_closing_slots > 0) {
+        int index = closing_slots[--num_closing_slots];
+        disconnect_client(index);
+    }
+}
+
+/**
+ * Returns true if the text of a chat message is the given command, alone or
+ * followed by a space and its argument.
+ */
+bool is_command(const char *text, size_t len, const char *command) {
+    size_t command_len = strlen(command);
+    return len >= command_len && strncmp(text, command, command_len) == 0 &&
+           (len == command_len || text[command_len] == ' ');
+}
+
+/**
+ * Parses the page number given to a command such as "/who" that starts at
+ * text[start]. The text is not null-terminated. Returns 0 if there is no
+ * page number.
+ */
+int parse_page(const char *text, size_t len, size_t start) {
+    int page = 0;
+    for (size_t i = start; i < len && text[i] >= '0' && text[i] <= '9' &&
+         page < INT_MAX / 10 - 1; i++) {
+        page = page * 10 + (text[i] - '0');
+    }
+    return page;
+}
+
+/**
+ * Sends a client one page of the list of rooms that have users in them, with
+ * the number of users in each, in reply to "/rooms [page]".
+ */
+void send_room_page(int index, int page) {
+    // Room names are never changed, so only the count needs the lock.
+    pthread_mutex_lock(&rooms_lock);
+    int count = num_rooms;
+    pthread_mutex_unlock(&rooms_lock);
+    int num_listed = 0;
+    for (int i = 0; i < count; i++) {
+        num_listed += atomic_load(&rooms[i]->num_members) > 0;
+    }
+    int num_pages = (num_listed + WHO_PAGE_SIZE - 1) / WHO_PAGE_SIZE;
+    if (page < 1 || page > num_pages) {
+        page = 1;
+    }
+    int first = (page - 1) * WHO_PAGE_SIZE;
+    char *p = outbuf + sprintf(outbuf, "Rooms (page %d of %d): [", page,
+                               num_pages ? num_pages : 1);
+    // Each entry is at most the name, the count, and the separator.
+    char *list = malloc(WHO_PAGE_SIZE * (MAX_NAME_LEN + 16) + 1);
+    if (!list) {
+        log_printf(LOG_WARNING, "Warning: Failed to send room list. %s.",
+                   strerror(errno));
+        return;
+    }
+    char *q = list;
+    for (int i = 0, n = 0; i < count && n < first + WHO_PAGE_SIZE; i++) {
+        int members = atomic_load(&rooms[i]->num_members);
+        if (members > 0 && n++ >= first) {
+            q += sprintf(q, "%s%s (%d)", q > list ? ", " : "", rooms[i]->name,
+                         members);
+        }
+    }
+    *q++ = ']';
+    struct message *msg =
+        message_create(MSG_INFO, outbuf, p - outbuf, list, q - list);
+    free(list);
+    if (!msg) {
+        log_printf(LOG_WARNING, "Warning: Failed to send room list. %s.",
+                   strerror(errno));
+        return;
+    }
+    send_message(index, msg);
+    message_unref(msg);
+}
+
+/**
+ * Moves a user to the room with the given name, creating the room if needed,
+ * in reply to "/join <room>" or "/leave". The users in the room left behind
+ * and in the room joined are told.
+ */
+void change_room(int index, const char *name, size_t len) {
+    if (!is_room_name(name, len)) {
+        sprintf(outbuf, "Room names are 1 to %d letters, digits, '-', '_', "
+                "or '.'.", MAX_NAME_LEN);
+        send_buffer(index, MSG_INFO, outbuf);
+        return;
+    }
+    int old_room = conn_info[index].room;
+    int room = open_room(name, len);
+    if (room == old_room) {
+        sprintf(outbuf, "You are already in room [%s].", rooms[room]->name);
+        send_buffer(index, MSG_INFO, outbuf);
+        return;
+    }
+    if (room == -1 || !join_room(index, room)) {
+        log_printf(LOG_WARNING, "Warning: Failed to move user '%s' to room "
+                   "'%.*s'. %s.", conn_info[index].username, (int)len, name,
+                   strerror(errno));
+        send_buffer(index, MSG_INFO, "Failed to join the room.");
+        return;
+    }
+    log_printf(LOG_INFO, "User '%s' moved from room '%s' to room '%s'.",
+               conn_info[index].username, rooms[old_room]->name,
+               rooms[room]->name);
+    sprintf(outbuf, "User [%s] left the chat room.",
+            conn_info[index].username);
+    broadcast_buffer(index, old_room, MSG_LEAVE, outbuf);
+    sprintf(outbuf, "User [%s] joined the chat room.",
+            conn_info[index].username);
+    broadcast_buffer(index, room, MSG_JOIN, outbuf);
+    int others = atomic_load(&rooms[room]->num_members) - 1;
+    sprintf(outbuf, "You are now in room [%s] with %d other user%s.",
+            rooms[room]->name, others, others == 1 ? "" : "s");
+    send_buffer(index, MSG_INFO, outbuf);
+}
+
+/**
+ * Sends a chat line to a single user, in reply to "/msg <user> <text>". The
+ * user is looked up in the index of user names, and the line is handed
+ * straight to the connection, or to the worker it is on, so the cost does
+ * not depend on how many users are connected. Private lines are kept out of
+ * the history and the journal.
+ */
+void send_private(int index, const char *args, size_t len) {
+    size_t name_len = 0;
+    while (name_len < len && args[name_len] != ' ') {
+        name_len++;
+    }
+    size_t skip = name_len < len ? name_len + 1 : len;
+    const char *text = args + skip;
+    size_t text_len = len - skip;
+    if (name_len == 0 || name_len > MAX_NAME_LEN || text_len == 0) {
+        send_buffer(index, MSG_INFO, "Usage: /msg <user> <message>");
+        return;
+    }
+    char name[MAX_NAME_LEN + 1];
+    memcpy(name, args, name_len);
+    name[name_len] = '\0';
+    struct user_entry to;
+    to.name[0] = '\0';
+    pthread_mutex_lock(&roster_lock);
+    if (users_capacity > 0) {
+        to = users[find_user(name)];
+    }
+    pthread_mutex_unlock(&roster_lock);
+    if (to.name[0] == '\0') {
+        sprintf(outbuf, "User [%s] is not connected.", name);
+        send_buffer(index, MSG_INFO, outbuf);
+        return;
+    }
+    int header_len = sprintf(outbuf, "[%s] (private): ",
+                             conn_info[index].username);
+    struct message *msg =
+        message_create(MSG_CHAT, outbuf, header_len, text, text_len);
+    if (!msg) {
+        log_printf(LOG_WARNING, "Warning: Failed to send private message. "
+                   "%s.", strerror(errno));
+        return;
+    }
+    if (to.worker == self->id) {
+        deliver_direct(to.index, to.generation, msg);
+    } else if (to.worker == WORKER_REMOTE) {
+        cluster_publish_direct(to.name, msg);
+    } else {
+        // The other worker cannot compress the message while this one still
+        // holds it, so compress it here in case the recipient takes
+        // compressed frames.
+        if (atomic_load_explicit(&num_deflate_clients,
+                                 memory_order_relaxed) > 0) {
+            message_compress(msg);
+        }
+        relay_message(to.worker, ROOM_DIRECT, SEQ_ALWAYS, to.index,
+                      to.generation, msg);
+    }
+    message_unref(msg);
+}
+
+/**
+ * Picks the codec to compress the frames sent to a client with, from the
+ * comma-separated list of codecs it can decode, and tells the client which
+ * one it is, in reply to MSG_HELLO. The frames already queued for the client
+ * go out as they are, and compressed frames start once its queue is empty.
+ * A client cannot go back to plain frames.
+ */
+void negotiate_codec(int index, const char *codecs, size_t len) {
+    bool deflate = false;
+    size_t codec_len = strlen(PROTO_CODEC_DEFLATE);
+    for (size_t start = 0; start < len;) {
+        const char *comma = memchr(codecs + start, ',', len - start);
+        size_t end = comma ? (size_t)(comma - codecs) : len;
+        if (end - start == codec_len &&
+                memcmp(codecs + start, PROTO_CODEC_DEFLATE, codec_len) == 0) {
+            deflate = true;
+        }
+        start = end + 1;
+    }
+    // Frames in a shared ring are never compressed.
+    unsigned short *flags = &connections[index].flags;
+    if (deflate && !(*flags & (CLIENT_DEFLATE | CLIENT_WANTS_DEFLATE |
+                               CLIENT_RING | CLIENT_WANTS_RING))) {
+        *flags |= CLIENT_WANTS_DEFLATE;
+        atomic_fetch_add(&num_deflate_clients, 1);
+    }
+    send_buffer(index, MSG_HELLO,
+                *flags & (CLIENT_DEFLATE | CLIENT_WANTS_DEFLATE)
+                ? PROTO_CODEC_DEFLATE : "");
+}
+
+/**
+ * Handles MSG_RING from a client. A client that has a shared ring made room
+ * in it, so the messages queued for it are copied in. A local client is
+ * switched over to a shared ring once nothing is queued for it. The ring only
+ * works on the same host, so anyone else is ignored.
+ */
+void handle_ring_request(int index) {
+    unsigned short flags = connections[index].flags;
+    if (flags & CLIENT_RING) {
+        flush_queued(index);
+    } else if ((flags & CLIENT_LOCAL) && !(flags & CLIENT_LEGACY)) {
+        connections[index].flags |= CLIENT_WANTS_RING;
+        update_encoding(index);
+    }
+}
+
+/**
+ * Adds the tokens earned since the last refill to a bucket, up to one
+ * second's worth.
+ */
+void refill_bucket(struct token_bucket *b, unsigned long rate, uint64_t now) {
+    b->tokens += (double)(now - b->updated) * rate / 1e9;
+    if (b->tokens > rate) {
+        b->tokens = rate;
+    }
+    b->updated = now;
+}
+
+/**
+ * Stops reading from a client until the given time. Under io_uring, the
+ * receive is cancelled, and whatever the kernel has already received still
+ * completes and is handled.
+ */
+void throttle_client(int index, uint64_t resume_at, bool rate_limited) {
+    struct connection_info *info = &conn_info[index];
+    if (rate_limited && !info->rate_limited) {
+        info->rate_limited = true;
+        metrics_count(METRIC_THROTTLES, 1);
+        metrics_adjust(METRIC_THROTTLED_CLIENTS, 1);
+    }
+    // Data the kernel received before the receive was cancelled may still
+    // come in under io_uring.
+    if (connections[index].flags & CLIENT_THROTTLED) {
+        if (resume_at > info->resume_at) {
+            info->resume_at = resume_at;
+        }
+        return;
+    }
+    if (!rate_limited) {
+        metrics_count(METRIC_YIELDS, 1);
+    }
+    connections[index].flags |= CLIENT_THROTTLED;
+    info->resume_at = resume_at;
+    throttled_slots[num_throttled_slots++] = index;
+    if (connections[index].flags & CLIENT_RECEIVING) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+        if (sqe) {
+            uring_prep_cancel(sqe, recv_user_data(index), UD_CANCEL);
+        }
+    }
+}
+
+/**
+ * Takes a message of the given size out of the buckets of a client, if there
+ * are rate limits. If the buckets do not hold enough, the client is
+ * throttled until they will.
+ * Returns false if the client is throttled.
+ */
+bool take_tokens(int index, size_t bytes) {
+    if (message_rate == 0 && byte_rate == 0) {
+        return true;
+    }
+    struct connection_info *info = &conn_info[index];
+    uint64_t now = metrics_now();
+    uint64_t resume_at = now;
+    if (message_rate > 0) {
+        refill_bucket(&info->message_tokens, message_rate, now);
+        if (info->message_tokens.tokens < 1) {
+            resume_at = now + (uint64_t)((1 - info->message_tokens.tokens) *
+                                         1e9 / message_rate) + 1;
+        }
+    }
+    if (byte_rate > 0) {
+        refill_bucket(&info->byte_tokens, byte_rate, now);
+        double needed = bytes < byte_rate ? bytes : byte_rate;
+        if (info->byte_tokens.tokens < needed) {
+            uint64_t refilled = now + (uint64_t)((needed -
+                                                  info->byte_tokens.tokens) *
+                                                 1e9 / byte_rate) + 1;
+            if (refilled > resume_at) {
+                resume_at = refilled;
+            }
+        }
+    }
+    if (resume_at > now) {
+        throttle_client(index, resume_at, true);
+        return false;
+    }
+    info->message_tokens.tokens -= 1;
+    info->byte_tokens.tokens -= bytes;
+    return true;
+}
+
+/**
+ * Keeps data received from a throttled client, to be handled in order once
+ * the client may be read from again.
+ * Returns false if the client was disconnected for lack of memory.
+ */
+bool hold_input(int index, const char *data, size_t len) {
+    struct connection_info *info = &conn_info[index];
+    char *held = realloc(info->held, info->held_len + len);
+    if (!held) {
+        log_printf(LOG_WARNING, "Warning: Failed to hold back messages from "
+                   "%s. %s.", info->peer, strerror(errno));
+        disconnect_client(index);
+        return false;
+    }
+    memcpy(held + info->held_len, data, len);
+    info->held = held;
+    info->held_len += len;
+    return true;
+}
+
+/**
+ * Handles a message received from a client. If the message is "bye", the
+ * client disconnected. If it is "/who", the client is sent a page of the
+ * list of connected users, and "/rooms" does the same for the rooms.
+ * "/join <room>" moves the user to another room, "/leave" moves it back to
+ * the lobby, and "/msg <user> <text>" sends a line to one user only.
+ * Otherwise, the message is broadcast to the other users in
+ * the same room. Returns false if the client was disconnected.
+ */
+bool handle_message(int index, unsigned char type, const char *text,
+                    size_t len) {
+    log_printf(LOG_DEBUG, "Received from '%s' at %s: %.*s",
+               conn_info[index].username, conn_info[index].peer, (int)len,
+               text);
+    if (type == MSG_BYE) {
+        disconnect_client(index);
+        return false;
+    }
+    if (type != MSG_CHAT) {
+        return true; // Nothing else is expected from a logged in client.
+    }
+    // The text is not null-terminated, so commands are parsed here.
+    if (is_command(text, len, "/who")) {
+        send_who_page(index, parse_page(text, len, 5));
+        return true;
+    }
+    if (is_command(text, len, "/rooms")) {
+        send_room_page(index, parse_page(text, len, 7));
+        return true;
+    }
+    if (is_command(text, len, "/join")) {
+        size_t start = len > 6 ? 6 : len;
+        change_room(index, text + start, len - start);
+        return true;
+    }
+    if (is_command(text, len, "/leave")) {
+        change_room(index, LOBBY_NAME, strlen(LOBBY_NAME));
+        return true;
+    }
+    if (is_command(text, len, "/msg")) {
+        size_t start = len > 5 ? 5 : len;
+        send_private(index, text + start, len - start);
+        return true;
+    }
+    // Build the message once. Every recipient shares it, so the "[name]: "
+    // header and the text are never copied or formatted again.
+    int header_len = sprintf(outbuf, "[%s]: ", conn_info[index].username);
+    struct message *msg =
+        message_create(MSG_CHAT, outbuf, header_len, text, len);
+    if (!msg) {
+        log_printf(LOG_WARNING, "Warning: Failed to broadcast message. %s.",
+                   strerror(errno));
+        return true;
+    }
+    broadcast_message(index, conn_info[index].room, msg);
+    message_unref(msg);
+    return true;
+}
+
+/**
+ * Handles data received from a client.
+ * Based on the data received, the function either disconnects the client or
+ * broadcasts the client's messages to all other clients on the system.
+ * Returns false if the client was disconnected.
+ */
+bool handle_input(int index, char *data, size_t len) {
+    struct connection_info *info = &conn_info[index];
+
+    if (connections[index].flags & CLIENT_LEGACY) {
+        // Legacy clients send one message per recv() of at most MAX_MSG_LEN
+        // bytes. Longer input is split up the same way recv() would.
+        while (len > 0) {
+            size_t n = len < MAX_MSG_LEN ? len : MAX_MSG_LEN;
+            if (data != inbuf) {
+                memcpy(inbuf, data, n);
+            }
+            inbuf[n] = '\0';
+            data += n;
+            len -= n;
+            // The first message of a legacy client is its user name.
+            if (connections[index].state != STATE_ACTIVE) {
+                if (!login_client(index, inbuf, n)) {
+                    return false;
+                }
+                continue;
+            }
+            if (!take_tokens(index, n)) {
+                return hold_input(index, data - n, len + n);
+            }
+            unsigned char type = strcmp(inbuf, "bye") == 0 ? MSG_BYE
+                                                           : MSG_CHAT;
+            info->messages_received++;
+            metrics_count(METRIC_MESSAGES_IN, 1);
+            if (!handle_message(index, type, inbuf, n)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Put the start of a frame left over from the previous read in front of
+    // the new data, then handle every complete frame. The data has to be in
+    // the back of readbuf for the leftover to fit in front of it.
+    struct recv_buffer *rb = &info->recv_buffer;
+    char *start = data;
+    if (rb->len > 0) {
+        if (data != readbuf + MAX_FRAME_LEN) {
+            memcpy(readbuf + MAX_FRAME_LEN, data, len);
+            data = readbuf + MAX_FRAME_LEN;
+        }
+        start = data - rb->len;
+        memcpy(start, rb->data, rb->len);
+    }
+    size_t avail = rb->len + len;
+    rb->len = 0;
+    struct frame frame;
+    ssize_t frame_len;
+    while ((frame_len = proto_parse_frame(start, avail, MAX_MSG_LEN,
+                                          &frame)) > 0) {
+        // A client that is logging in must send its user name before
+        // anything else, but may say which codecs it can decode, or ask for
+        // a shared ring, at any time. A client whose name was taken may have
+        // sent chat lines before it heard, and they are dropped.
+        if (frame.type == MSG_HELLO) {
+            negotiate_codec(index, frame.payload, frame.len);
+        } else if (frame.type == MSG_RING) {
+            handle_ring_request(index);
+        } else if (frame.type == MSG_PONG) {
+            // All that matters is that something came in, which has been
+            // noted already.
+        } else if (connections[index].state != STATE_ACTIVE) {
+            if (frame.type == MSG_NAME) {
+                if (!login_client(index, frame.payload, frame.len)) {
+                    return false;
+                }
+            } else if (frame.type == MSG_BYE) {
+                disconnect_client(index);
+                return false;
+            } else if (connections[index].state != STATE_RENAMING ||
+                       frame.type != MSG_CHAT) {
+                frame_len = -1;
+                break;
+            }
+        } else {
+            if (!take_tokens(index, frame_len)) {
+                release_recv_buffer(rb);
+                return hold_input(index, start, avail);
+            }
+            info->messages_received++;
+            metrics_count(METRIC_MESSAGES_IN, 1);
+            if (!handle_message(index, frame.type, frame.payload,
+                                frame.len)) {
+                return false;
+            }
+        }
+        start += frame_len;
+        avail -= frame_len;
+    }
+    if (frame_len < 0) {
+        log_printf(LOG_WARNING, "Warning: Invalid frame from %s.",
+                   info->peer);
+        disconnect_client(index);
+        return false;
+    }
+    // Keep the start of the next frame until the rest of it arrives. Only
+    // clients in the middle of a frame hold on to a buffer.
+    if (avail == 0) {
+        release_recv_buffer(rb);
+    } else {
+        if (!rb->data && !(rb->data = pool_get(&recv_pool))) {
+            log_printf(LOG_WARNING, "Warning: Failed to buffer message "
+                       "from %s. %s.", info->peer, strerror(errno));
+            disconnect_client(index);
+            return false;
+        }
+        memcpy(rb->data, start, avail);
+        rb->len = avail;
+    }
+    return true;
+}
+
+/**
+ * Handles the data held back from a client while it was throttled. If its
+ * buckets run out again, the rest is held back again.
+ * Returns false if the client was disconnected.
+ */
+bool handle_held_input(int index) {
+    char *held = conn_info[index].held;
+    size_t len = conn_info[index].held_len;
+    if (!held) {
+        return true;
+    }
+    conn_info[index].held = NULL;
+    conn_info[index].held_len = 0;
+    bool connected = handle_input(index, held, len);
+    free(held);
+    return connected;
+}
+
+/**
+ * Counts bytes read from a client against its turn in this pass of the event
+ * loop. A client that has read READ_BUDGET bytes is set aside until the next
+ * pass, so a client that never stops sending cannot keep the others waiting.
+ * Returns false if the client is not to be read from for now.
+ */
+bool spend_turn(int index, size_t bytes) {
+    struct connection_info *info = &conn_info[index];
+    if (info->pass != loop_pass) {
+        info->pass = loop_pass;
+        info->pass_bytes = 0;
+    }
+    info->pass_bytes += bytes;
+    if (info->pass_bytes >= READ_BUDGET) {
+        throttle_client(index, metrics_now(), false);
+    }
+    return !(connections[index].flags & CLIENT_THROTTLED);
+}
+
+/**
+ * Reads the data waiting in a client's socket and handles it.
+ */
+void handle_client_socket(int index) {
+    if (connections[index].flags &
+            (CLIENT_PAUSED | CLIENT_CLOSING | CLIENT_THROTTLED)) {
+        return;
+    }
+
+    // Read the incoming messages and use the number of bytes read to
+    // check if the client disconnected. The socket is edge-triggered, so
+    // keep reading until there is nothing left.
+    while (atomic_load(&running)) {
+        // Under backpressure, leave the messages in the socket until every
+        // client has caught up. The client is read from again once the
+        // congestion clears.
+        if (slow_policy == POLICY_BACKPRESSURE &&
+                atomic_load(&num_congested) > 0) {
+            connections[index].flags |= CLIENT_PAUSED;
+            paused_slots[num_paused_slots++] = index;
+            return;
+        }
+        // Legacy clients send one message per recv(). Framed clients may
+        // send any number of frames per recv().
+        bool framed = !(connections[index].flags & CLIENT_LEGACY);
+        char *data = framed ? readbuf + MAX_FRAME_LEN : inbuf;
+        int bytes_recvd = recv(connections[index].fd, data,
+                               framed ? READ_BUFFER_SIZE : MAX_MSG_LEN,
+                               MSG_DONTWAIT);
+        if (bytes_recvd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_printf(LOG_WARNING, "Warning: Failed to receive incoming "
+                           "message from %s. %s.", conn_info[index].peer,
+                           strerror(errno));
+                // The socket is edge-triggered and will not be reported
+                // again, so let the client go.
+                disconnect_client(index);
+            }
+            return;
+        } else if (bytes_recvd == 0) {
+            // The client disconnected.
+            disconnect_client(index);
+            return;
+        }
+        conn_info[index].bytes_received += bytes_recvd;
+        conn_info[index].last_active = loop_ms;
+        metrics_count(METRIC_BYTES_IN, bytes_recvd);
+        if (!handle_input(index, data, bytes_recvd) ||
+                !spend_turn(index, bytes_recvd)) {
+            return;
+        }
+    }
+}
+
+/**
+ * Disconnects the clients that have been holding up the senders for longer
+ * than BACKPRESSURE_TIMEOUT seconds.
+ */
+void evict_congested_clients() {
+    time_t now = time(NULL);
+    for (int i = 0; i < num_slots; i++) {
+        if (connections[i].fd != -1 && connections[i].queue.congested &&
+                now - connections[i].queue.congested_since >=
+                BACKPRESSURE_TIMEOUT) {
+            log_printf(LOG_INFO, "User '%s' is not keeping up. Disconnecting.",
+                       conn_info[i].username);
+            metrics_count(METRIC_SLOW_DISCONNECTS, 1);
+            close_client_later(i);
+        }
+    }
+}
+
+/**
+ * Returns the time of the monotonic clock in milliseconds.
+ */
+uint64_t clock_ms() {
+    return metrics_now() / 1000000;
+}
+
+/**
+ * Handles the timer of a client going off. A client that did not log in
+ * within LOGIN_TIMEOUT seconds is disconnected. A logged in client that has
+ * been quiet for the ping interval is pinged, and one that has been quiet
+ * for the idle timeout is disconnected. The time of the last data received
+ * is noted as it comes in, and the timer is only moved when it goes off, so
+ * busy clients cost nothing.
+ */
+void handle_timer(int index) {
+    struct connection_info *info = &conn_info[index];
+    if (connections[index].state != STATE_ACTIVE) {
+        log_printf(LOG_INFO, "Host %s did not log in in time.", info->peer);
+        disconnect_client(index);
+        return;
+    }
+    if (idle_timeout > 0 && loop_ms - info->last_active >= idle_timeout) {
+        log_printf(LOG_INFO, "User '%s' has been idle for too long. "
+                   "Disconnecting.", info->username);
+        metrics_count(METRIC_IDLE_DISCONNECTS, 1);
+        disconnect_client(index);
+        return;
+    }
+    if (ping_interval > 0 && !(connections[index].flags & CLIENT_LEGACY) &&
+            loop_ms - info->last_active >= ping_interval &&
+            loop_ms - info->last_ping >= ping_interval) {
+        info->last_ping = loop_ms;
+        send_buffer(index, MSG_PING, "");
+    }
+    schedule_idle_check(index);
+}
+
+/**
+ * Handles the timers that have gone off.
+ */
+void expire_timers() {
+    int index;
+    while ((index = timer_expired(&wheel, loop_ms)) != -1) {
+        handle_timer(index);
+    }
+}
+
+/**
+ * Returns how many milliseconds the event loop may wait for activity before
+ * it has to check on congested clients or connections that are logging in.
+ * Returns -1 if it may wait indefinitely.
+ */
+int next_timeout() {
+    int timeout = num_local_congested ? 1000 : -1;
+    if (num_throttled_slots > 0) {
+        uint64_t now = metrics_now(), resume_at = UINT64_MAX;
+        for (int i = 0; i < num_throttled_slots; i++) {
+            if (conn_info[throttled_slots[i]].resume_at < resume_at) {
+                resume_at = conn_info[throttled_slots[i]].resume_at;
+            }
+        }
+        int throttle_timeout = resume_at > now
+                               ? (resume_at - now + 999999) / 1000000 : 0;
+        if (timeout == -1 || throttle_timeout < timeout) {
+            timeout = throttle_timeout;
+        }
+    }
+    int timer_timeout_ms = timer_timeout(&wheel, clock_ms());
+    if (timer_timeout_ms != -1 &&
+            (timeout == -1 || timer_timeout_ms < timeout)) {
+        timeout = timer_timeout_ms;
+    }
+    return timeout;
+}
+
+/**
+ * Resumes reading from the clients paused by backpressure, once no client is
+ * congested any more. The sockets are edge-triggered, so the data waiting in
+ * them will not cause another event. Under io_uring, receiving is started
+ * again, unless the cancelled receive has not finished yet; it is restarted
+ * when it does.
+ */
+void resume_paused_clients() {
+    if (num_paused_slots == 0 || atomic_load(&num_congested) > 0) {
+        return;
+    }
+    int num_resumed = num_paused_slots;
+    int *resumed = malloc(num_resumed * sizeof(int));
+    if (!resumed) {
+        return;
+    }
+    memcpy(resumed, paused_slots, num_resumed * sizeof(int));
+    num_paused_slots = 0;
+    for (int i = 0; i < num_resumed; i++) {
+        int index = resumed[i];
+        if (connections[index].flags & CLIENT_PAUSED) {
+            connections[index].flags &= ~CLIENT_PAUSED;
+            if (!use_uring) {
+                handle_client_socket(index);
+            } else if (!(connections[index].flags & CLIENT_RECEIVING) &&
+                       !arm_recv(index)) {
+                close_client_later(index);
+            }
+        }
+    }
+    free(resumed);
+}
+
+/**
+ * Reads from the throttled clients whose time has come, in the order they
+ * were throttled, so clients that were set aside take turns. Under io_uring,
+ * receiving is started again, unless the cancelled receive has not finished
+ * yet; it is restarted when it does. A client that uses up its turn again is
+ * put back at the end of the list.
+ */
+void resume_throttled_clients() {
+    uint64_t now = metrics_now();
+    int num_listed = num_throttled_slots;
+    num_throttled_slots = 0;
+    // Every client resumed goes back into the list at most once, so the
+    // entries not visited yet are never overwritten.
+    for (int i = 0; i < num_listed; i++) {
+        int index = throttled_slots[i];
+        if (connections[index].fd != -1 &&
+                conn_info[index].resume_at > now) {
+            throttled_slots[num_throttled_slots++] = index;
+            continue;
+        }
+        connections[index].flags &= ~CLIENT_THROTTLED;
+        if (conn_info[index].rate_limited) {
+            conn_info[index].rate_limited = false;
+            metrics_adjust(METRIC_THROTTLED_CLIENTS, -1);
+        }
+        if (connections[index].fd == -1 || !handle_held_input(index)) {
+            continue;
+        }
+        if (!use_uring) {
+            handle_client_socket(index);
+        } else if (!(connections[index].flags &
+                     (CLIENT_RECEIVING | CLIENT_PAUSED | CLIENT_THROTTLED)) &&
+                   !arm_recv(index)) {
+            close_client_later(index);
+        }
+    }
+}
+
+/**
+ * Starts accepting connections on the server socket, or on the Unix socket,
+ * through the io_uring.
+ * Returns true on success, false if the ring has no room for the request.
+ */
+bool arm_accept(bool local) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (!sqe) {
+        return false;
+    }
+    if (local) {
+        uring_prep_accept_multishot(sqe, local_socket, UD_ACCEPT_LOCAL);
+        accepting_local = true;
+    } else {
+        uring_prep_accept_multishot(sqe, server_socket, UD_ACCEPT);
+        accepting = true;
+    }
+    return true;
+}
+
+/**
+ * Starts watching the eventfd other workers use to signal new inbox messages
+ * through the io_uring.
+ * Returns true on success, false if the ring has no room for the request.
+ */
+bool arm_wake() {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (!sqe) {
+        return false;
+    }
+    uring_prep_poll_multishot(sqe, self->wake_fd, POLLIN, UD_WAKE);
+    return true;
+}
+
+/**
+ * Stops receiving from a client under backpressure. Whatever the kernel has
+ * already received still completes and is handled.
+ */
+void pause_client(int index) {
+    connections[index].flags |= CLIENT_PAUSED;
+    paused_slots[num_paused_slots++] = index;
+    if (connections[index].flags & CLIENT_RECEIVING) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+        if (sqe) {
+            uring_prep_cancel(sqe, recv_user_data(index), UD_CANCEL);
+        }
+    }
+}
+
+/**
+ * Submits a send for every client that had messages queued since the last
+ * time, unless one is still in flight. The clients are flushed again when
+ * their sends complete. Messages for a client with a shared ring are copied
+ * into the ring instead.
+ */
+void submit_flushes() {
+    while (num_flush_slots > 0) {
+        int index = flush_slots[--num_flush_slots];
+        connections[index].flags &= ~CLIENT_FLUSH;
+        if (connections[index].fd != -1 && connections[index].queue.count > 0
+                && !(connections[index].flags & CLIENT_SENDING) &&
+                (!(connections[index].flags & CLIENT_RING) ||
+                 !flush_shared_ring(index))) {
+            submit_send(index);
+        }
+    }
+}
+
+/**
+ * Handles the completion of a send. A zero-copy send completes twice: first
+ * with its result, then once the kernel no longer needs the messages. A send
+ * cancelled while the clients are handed over has sent nothing, and its
+ * messages stay queued.
+ */
+void handle_send_completion(struct uring_send *s, int res, unsigned flags) {
+    int index = s->index;
+    if (!s->done && connections[index].fd != -1 &&
+            conn_info[index].generation == s->generation) {
+        connections[index].flags &= ~CLIENT_SENDING;
+        connections[index].queue.in_flight = 0;
+        if (res < 0 && res != -ECANCELED) {
+            log_printf(LOG_WARNING, "Warning: Failed to send queued message. "
+                       "%s.", strerror(-res));
+            metrics_count(METRIC_SEND_ERRORS, 1);
+            // The socket is broken, so nothing queued will ever arrive.
+            clear_send_queue(index);
+        } else {
+            retire_sent(index, res > 0 ? res : 0);
+        }
+        finish_flush(index);
+        if (connections[index].queue.count > 0) {
+            schedule_flush(index);
+        }
+    }
+    s->done = true;
+    if (!(flags & IORING_CQE_F_MORE)) {
+        free_send(s);
+    }
+}
+
+/**
+ * Handles the completion of a receive from a client. The buffer the data was
+ * received into is given back to the kernel right after it is handled. While
+ * the clients are handed over, the data is held for the new process instead.
+ */
+void handle_recv_completion(uint64_t user_data, int res, unsigned flags) {
+    int index = user_data >> 32;
+    bool current = (atomic_load(&running) || atomic_load(&restarting)) &&
+                   index < num_slots &&
+                   connections[index].fd != -1 &&
+                   recv_user_data(index) == user_data;
+    // A client waiting to be disconnected is no longer listened to.
+    if (current && (connections[index].flags & CLIENT_CLOSING)) {
+        current = false;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (current && res > 0) {
+            char *data = uring_buf(&recv_bufs, id);
+            conn_info[index].bytes_received += res;
+            conn_info[index].last_active = loop_ms;
+            metrics_count(METRIC_BYTES_IN, res);
+            // Data received after a client was throttled waits its turn
+            // behind the data already held back.
+            if (conn_info[index].held || !atomic_load(&running)) {
+                current = hold_input(index, data, res);
+            } else if ((current = handle_input(index, data, res))) {
+                spend_turn(index, res);
+            }
+        }
+        uring_buf_ring_recycle(&recv_bufs, id);
+    }
+    if (!current) {
+        return; // Meant for a client that is gone or about to be.
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        connections[index].flags &= ~CLIENT_RECEIVING;
+    }
+    if (res == 0) {
+        // The client disconnected. While it is handed over, the new process
+        // finds out for itself, once it has handled what the client sent.
+        if (atomic_load(&running)) {
+            disconnect_client(index);
+        }
+        return;
+    }
+    // Running out of buffers ends the receive, but the client is fine.
+    if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        log_printf(LOG_WARNING, "Warning: Failed to receive incoming message "
+                   "from %s. %s.", conn_info[index].peer, strerror(-res));
+        disconnect_client(index);
+        return;
+    }
+    // Under backpressure, stop receiving until every client has caught up.
+    if (slow_policy == POLICY_BACKPRESSURE &&
+            atomic_load(&num_congested) > 0 &&
+            !(connections[index].flags & CLIENT_PAUSED)) {
+        pause_client(index);
+    }
+    if (atomic_load(&running) && !(connections[index].flags &
+                     (CLIENT_RECEIVING | CLIENT_PAUSED | CLIENT_THROTTLED)) &&
+            !arm_recv(index)) {
+        close_client_later(index);
+    }
+}
+
+/**
+ * Handles the completion of an accept on the server socket, or on the Unix
+ * socket if local is set. A connection
+ * accepted while the clients are handed over is handed over as well.
+ * Returns EXIT_FAILURE if connections can no longer be accepted.
+ */
+int handle_accept_completion(bool local, int res, unsigned flags) {
+    if (res >= 0) {
+        if (!atomic_load(&running) && !atomic_load(&restarting)) {
+            close(res);
+        } else {
+            addrlen = sizeof(struct sockaddr_in);
+            if (!local && getpeername(res, (struct sockaddr *)&server_addr,
+                                      &addrlen) != 0) {
+                memset(&server_addr, 0, sizeof(struct sockaddr_in));
+            }
+            add_client(res, local);
+        }
+    } else if (res == -EMFILE || res == -ENFILE) {
+        // Not a failure, just a limitation.
+        refuse_connection(local ? local_socket : server_socket);
+    } else if (res != -EINTR && res != -ECONNABORTED && res != -ECANCELED) {
+        fprintf(stderr, "Error: Failed to accept incoming connection. %s.\n",
+                strerror(-res));
+        return EXIT_FAILURE;
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        if (local) {
+            accepting_local = false;
+        } else {
+            accepting = false;
+        }
+    }
+    if (!(flags & IORING_CQE_F_MORE) && atomic_load(&running) &&
+            !arm_accept(local)) {
+        fprintf(stderr, "Error: Failed to accept incoming connections. "
+                "The submission queue is full.\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Handles every completion waiting in the io_uring.
+ * Returns EXIT_FAILURE if connections can no longer be accepted.
+ */
+int reap_completions() {
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&ring))) {
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_cqe_seen(&ring);
+        switch (user_data & UD_TYPE_MASK) {
+            case 0:
+                handle_send_completion((struct uring_send *)(uintptr_t)
+                                       user_data, res, flags);
+                break;
+            case UD_ACCEPT:
+            case UD_ACCEPT_LOCAL:
+                if (handle_accept_completion((user_data & UD_TYPE_MASK) ==
+                                             UD_ACCEPT_LOCAL, res, flags) ==
+                        EXIT_FAILURE) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case UD_WAKE:
+                if (atomic_load(&running)) {
+                    handle_inbox();
+                    if (!(flags & IORING_CQE_F_MORE) && !arm_wake()) {
+                        log_printf(LOG_WARNING, "Warning: Failed to watch "
+                                   "for wake-ups. The submission queue is "
+                                   "full.");
+                    }
+                }
+                break;
+            case UD_RECV:
+                handle_recv_completion(user_data, res, flags);
+                break;
+            default:
+                break; // Nothing to do when a cancel completes.
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Returns true if the kernel supports everything the io_uring engine needs.
+ * Also finds out whether zero-copy sends are available.
+ */
+bool probe_uring() {
+    struct uring r;
+    if (!uring_init(&r, 8)) {
+        return false;
+    }
+    // Multishot receives arrived in the same kernel version as zero-copy
+    // sends, so IORING_OP_SEND_ZC stands in for them.
+    const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+                        IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+                        IORING_OP_SEND_ZC };
+    const int zc_ops[] = { IORING_OP_SENDMSG_ZC };
+    bool supported = (r.features & IORING_FEAT_EXT_ARG) &&
+                     uring_probe(&r, ops, sizeof(ops) / sizeof(ops[0]));
+    if (!supported) {
+        errno = ENOSYS;
+    }
+    uring_zero_copy = uring_probe(&r, zc_ops, 1);
+    uring_exit(&r);
+    return supported;
+}
+
+/**
+ * Sets up this worker's io_uring and its receive buffers, and starts
+ * accepting connections and watching for wake-ups through it.
+ * Returns true on success, false on failure with errno set.
+ */
+bool start_uring() {
+    if (!uring_init(&ring, URING_ENTRIES)) {
+        return false;
+    }
+    if (!uring_buf_ring_init(&ring, &recv_bufs, URING_BUF_GROUP,
+                             URING_NUM_BUFS, URING_BUF_SIZE)) {
+        int saved_errno = errno;
+        uring_exit(&ring);
+        errno = saved_errno;
+        return false;
+    }
+    // The requests fit, since the submission queue is still empty.
+    arm_accept(false);
+    if (local_socket >= 0) {
+        arm_accept(true);
+    }
+    arm_wake();
+    return true;
+}
+
+/**
+ * Gives the sends in flight, including the final "bye", up to 100 ms to
+ * complete, then tears down this worker's io_uring. The kernel cancels
+ * whatever is still in flight, and the sends it never completed are freed.
+ */
+void stop_uring() {
+    for (int waited = 0; waited < 100; waited += 10) {
+        submit_flushes();
+        if (!sends_in_flight) {
+            break;
+        }
+        uring_submit_and_wait(&ring, 10);
+        reap_completions();
+    }
+    uring_buf_ring_exit(&ring, &recv_bufs);
+    uring_exit(&ring);
+    while (sends_in_flight) {
+        free_send(sends_in_flight);
+    }
+}
+
+/**
+ * Stops the event loops of all workers.
+ */
+void stop_workers() {
+    atomic_store(&running, false);
+    for (int i = 0; i < num_workers; i++) {
+        uint64_t one = 1;
+        if (workers[i].wake_fd >= 0 &&
+                write(workers[i].wake_fd, &one, sizeof(one)) == -1 &&
+                errno != EAGAIN) {
+            log_printf(LOG_WARNING, "Warning: Failed to wake worker %d. %s.",
+                       i, strerror(errno));
+        }
+    }
+}
+
+/**
+ * Starts a new process of the server to take over from this one, and stops
+ * the workers once it is ready. If the new process does not come up in
+ * time, or reads the state of a client differently, it is killed, and this
+ * process keeps running.
+ */
+void begin_restart() {
+    restart_requested = false;
+    log_printf(LOG_INFO, "Starting a new process to take over.");
+    pid_t pid;
+    int sock = handoff_spawn(server_argv, &pid);
+    if (sock < 0) {
+        log_printf(LOG_WARNING, "Warning: Failed to start new process. %s.",
+                   strerror(errno));
+        return;
+    }
+    uint32_t version[2] = { HANDOFF_VERSION, sizeof(struct handoff_client) };
+    struct handoff_msg m;
+    bool ready = handoff_recv(sock, HANDOFF_START_TIMEOUT, &m);
+    if (ready) {
+        ready = m.kind == HANDOFF_HELLO && m.len == sizeof(version) &&
+                memcmp(m.payload, version, sizeof(version)) == 0;
+        free(m.payload);
+        if (m.fd >= 0) {
+            close(m.fd);
+        }
+        if (!ready) {
+            errno = EPROTO;
+        }
+    }
+    if (!ready) {
+        log_printf(LOG_WARNING, "Warning: New process %d is not ready to take "
+                   "over. %s.", (int)pid, strerror(errno));
+        close(sock);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    log_printf(LOG_INFO, "Handing over to process %d.", (int)pid);
+    handoff_fd = sock;
+    // The links to the other nodes of the cluster go over to the new process
+    // as well. What came in on them so far is relayed to the workers before
+    // they stop, and the rest waits for the new process.
+    if (clustered) {
+        cluster_suspend();
+    }
+    atomic_store(&restarting, true);
+    stop_workers();
+}
+
+/**
+ * Runs the io_uring event loop of a worker until the server shuts down. The
+ * sends for the messages queued while handling a batch of completions are
+ * submitted together with the wait for the next batch, in a single system
+ * call.
+ * Returns EXIT_SUCCESS, or EXIT_FAILURE if the loop failed.
+ */
+int run_uring_loop() {
+    while (atomic_load(&running)) {
+        // SIGUSR2 only ever interrupts the main thread.
+        if (restart_requested && self->id == 0) {
+            begin_restart();
+            continue;
+        }
+        submit_flushes();
+        // Wait indefinitely, unless a congested client or a login has to be
+        // checked on.
+        if (uring_submit_and_wait(&ring, next_timeout()) < 0 &&
+                errno != EINTR && errno != ETIME && errno != EBUSY) {
+            log_printf(LOG_ERROR, "Error: io_uring_enter() failed. %s.",
+                       strerror(errno));
+            return EXIT_FAILURE;
+        }
+        uint64_t start = metrics_now();
+        loop_ms = start / 1000000;
+        loop_pass++;
+        resume_throttled_clients();
+        if (reap_completions() == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+        if (num_local_congested > 0) {
+            evict_congested_clients();
+        }
+        expire_timers();
+        close_pending_clients();
+        resume_paused_clients();
+        metrics_record(METRIC_LOOP_TIME, start);
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Stops everything this worker's io_uring does for the clients before they
+ * are handed over: accepting, receiving, and sending. Data received in the
+ * meantime is held for the new process, and a cancelled send leaves its
+ * messages queued. Gives up after HANDOFF_QUIESCE_TIMEOUT milliseconds.
+ */
+void quiesce_uring() {
+    struct io_uring_sqe *sqe;
+    if (accepting && (sqe = uring_get_sqe(&ring))) {
+        uring_prep_cancel(sqe, UD_ACCEPT, UD_CANCEL);
+    }
+    if (accepting_local && (sqe = uring_get_sqe(&ring))) {
+        uring_prep_cancel(sqe, UD_ACCEPT_LOCAL, UD_CANCEL);
+    }
+    for (struct uring_send *s = sends_in_flight; s; s = s->next) {
+        if (!s->done && (sqe = uring_get_sqe(&ring))) {
+            uring_prep_cancel(sqe, (uint64_t)(uintptr_t)s, UD_CANCEL);
+        }
+    }
+    for (int waited = 0; waited < HANDOFF_QUIESCE_TIMEOUT; waited += 10) {
+        // A connection accepted in the meantime starts receiving, so the
+        // receives are cancelled on every pass.
+        bool busy = accepting || accepting_local;
+        for (int i = 0; i < num_slots; i++) {
+            if (connections[i].fd != -1 &&
+                    (connections[i].flags &
+                     (CLIENT_RECEIVING | CLIENT_CLOSING)) == CLIENT_RECEIVING) {
+                busy = true;
+                if ((sqe = uring_get_sqe(&ring))) {
+                    uring_prep_cancel(sqe, recv_user_data(i), UD_CANCEL);
+                }
+            }
+        }
+        for (struct uring_send *s = sends_in_flight; s; s = s->next) {
+            busy = busy || !s->done;
+        }
+        if (!busy) {
+            return;
+        }
+        uring_submit_and_wait(&ring, 10);
+        reap_completions();
+    }
+    log_printf(LOG_WARNING, "Warning: Worker %d did not stop in time. Some "
+               "clients may miss messages.", self->id);
+}
+
+/**
+ * Sets a client aside to be handed over to the new process, along with what
+ * it sent that has not been handled yet and what it has not been sent yet.
+ * Its socket goes with it, and its slot is let go of without a word to the
+ * client or to the others in its room.
+ * Returns true on success, false if memory could not be allocated.
+ */
+bool park_client(int index, struct parked_client *p) {
+    struct connection_info *info = &conn_info[index];
+    struct send_queue *q = &connections[index].queue;
+    enum message_encoding_t encoding = client_encoding(index);
+    struct handoff_client *h = &p->state;
+    memset(h, 0, sizeof(struct handoff_client));
+    h->worker = self->id;
+    h->flags = connections[index].flags & (CLIENT_LEGACY | CLIENT_DEFLATE |
+                                           CLIENT_WANTS_DEFLATE |
+                                           CLIENT_LOCAL);
+    h->state = connections[index].state;
+    strcpy(h->username, info->username);
+    if (info->room != -1) {
+        strcpy(h->room, rooms[info->room]->name);
+    }
+    strcpy(h->ip, info->ip);
+    h->port = info->port;
+    h->connected_at = info->connected_at;
+    h->last_active = info->last_active;
+    h->last_ping = info->last_ping;
+    h->messages_received = info->messages_received;
+    h->bytes_received = info->bytes_received;
+    h->message_tokens = info->message_tokens;
+    h->byte_tokens = info->byte_tokens;
+    // The start of a frame received in part goes before the data held back,
+    // and the rest of a message sent in part is all that is left of it.
+    h->input_len = info->recv_buffer.len + info->held_len;
+    size_t offset = q->offset;
+    for (unsigned i = 0; i < q->count; i++) {
+        h->output_len += message_len(q->ring[(q->head + i) % q->capacity],
+                                     encoding) - offset;
+        offset = 0;
+    }
+    if (!(p->data = malloc(h->input_len + h->output_len + 1))) {
+        return false;
+    }
+    char *dst = p->data;
+    if (info->recv_buffer.len > 0) {
+        memcpy(dst, info->recv_buffer.data, info->recv_buffer.len);
+        dst += info->recv_buffer.len;
+    }
+    if (info->held_len > 0) {
+        memcpy(dst, info->held, info->held_len);
+        dst += info->held_len;
+    }
+    offset = q->offset;
+    for (unsigned i = 0; i < q->count; i++) {
+        struct iovec iov[MESSAGE_MAX_IOV];
+        int num_iov = message_iov(q->ring[(q->head + i) % q->capacity],
+                                  encoding, offset, iov);
+        for (int j = 0; j < num_iov; j++) {
+            memcpy(dst, iov[j].iov_base, iov[j].iov_len);
+            dst += iov[j].iov_len;
+        }
+        offset = 0;
+    }
+    p->fd = connections[index].fd;
+    connections[index].fd = -1;
+    clear_send_queue(index);
+    // The new process sends everything through the socket. What is in the
+    // shared ring is read by the client before that.
+    close_shared_ring(index);
+    metrics_adjust(METRIC_CONNECTIONS, -1);
+    return true;
+}
+
+/**
+ * Sets aside every client of this worker to be handed over to the new
+ * process. Once no worker takes in anything more, the messages relayed in
+ * the meantime are delivered, so they are handed over as well. A client
+ * waiting to be disconnected is left behind.
+ */
+void park_clients() {
+    if (use_uring) {
+        quiesce_uring();
+    }
+    atomic_fetch_add(&num_quiet_workers, 1);
+    while (atomic_load(&num_quiet_workers) < num_workers) {
+        usleep(1000);
+    }
+    handle_inbox();
+    if (num_slots == 0) {
+        return;
+    }
+    self->parked = malloc(num_slots * sizeof(struct parked_client));
+    if (!self->parked) {
+        log_printf(LOG_WARNING, "Warning: Failed to hand over clients. %s.",
+                   strerror(errno));
+        return;
+    }
+    self->parked_capacity = num_slots;
+    for (int i = 0; i < num_slots; i++) {
+        if (connections[i].fd == -1 ||
+                (connections[i].flags & CLIENT_CLOSING)) {
+            continue;
+        }
+        if (park_client(i, &self->parked[self->num_parked])) {
+            self->num_parked++;
+        } else {
+            log_printf(LOG_WARNING, "Warning: Failed to hand over %s. %s.",
+                       conn_info[i].peer, strerror(errno));
+        }
+    }
+}
+
+/**
+ * Tells the clients of this worker to close before forcefully closing all
+ * the sockets and freeing up memory. On a hot restart, the clients are set
+ * aside for the new process instead, and the server socket is left open for
+ * the main thread to hand over.
+ */
+void cleanup() {
+    bool handing_over = atomic_load(&restarting);
+    if (handing_over) {
+        park_clients();
+    } else {
+        // Another worker may be waiting for this one to go quiet before
+        // handing its clients over.
+        atomic_fetch_add(&num_quiet_workers, 1);
+        // Send "bye" to let all clients close before the server does.
+        struct message *bye = message_from_string(MSG_BYE, "bye");
+        if (bye) {
+            for (int i = 0; i < num_slots; i++) {
+                if (connections[i].fd != -1 &&
+                        connections[i].state == STATE_ACTIVE) {
+                    send_message(i, bye);
+                }
+            }
+            message_unref(bye);
+        }
+    }
+    // Give some time to allow the clients to close first. Otherwise, restarting
+    // the server immediately results in "Address already in use." Under
+    // io_uring, the sends complete in the meantime.
+    if (use_uring) {
+        stop_uring();
+    } else if (!handing_over) {
+        usleep(100000);
+        for (int i = 0; i < num_slots; i++) {
+            if (connections[i].fd != -1) {
+                flush_send_queue(i);
+            }
+        }
+    }
+    // F_GETFD - Return the file descriptor flags.
+    if (!handing_over && fcntl(server_socket, F_GETFD) >= 0) {
+        close(server_socket);
+        self->server_socket = -1;
+    }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    if (spare_fd >= 0) {
+        close(spare_fd);
+    }
+    for (int i = 0; i < num_slots; i++) {
+        // A user handed over to the new process stays on the roster, so the
+        // other nodes of the cluster are never told the user left.
+        bool parked = handing_over && connections[i].fd == -1;
+        if (connections[i].fd != -1) {
+            close(connections[i].fd);
+            clear_send_queue(i);
+        }
+        close_shared_ring(i);
+        free(conn_info[i].held);
+        free(connections[i].queue.ring);
+        if (conn_info[i].username[0] != '\0') {
+            leave_room(i);
+            if (!parked) {
+                roster_remove(conn_info[i].username, -1);
+            }
+        }
+    }
+    pool_destroy(&recv_pool);
+    pool_destroy(&send_pool);
+    message_compress_end();
+    for (int i = 0; i < num_local_rooms; i++) {
+        free(local_rooms[i].slots);
+        free(local_rooms[i].joined);
+    }
+    free(local_rooms);
+    free(connections);
+    free(conn_info);
+    free(free_slots);
+    free(closing_slots);
+    free(paused_slots);
+    free(throttled_slots);
+    free(flush_slots);
+    free(timers);
+}
 
 /**
- * Signal handler.
+ * Creates a server socket that listens for incoming connections on the given
+ * port. When several workers share the port, SO_REUSEPORT lets each of them
+ * have its own listener, and the kernel spreads new connections among them.
+ * Returns the socket, or -1 on failure.
  */
-void catch_signal(int sig) {
-    running = false;
+int create_server_socket(int port) {
+    int fd;
+    if ((fd = socket(AF_INET , SOCK_STREAM , 0)) < 0) {
+        fprintf(stderr, "Error: Failed to create socket. %s.\n",
+                strerror(errno));
+        return -1;
+    }
+
+    int opt = 1;
+    // SO_REUSEADDR tells the kernel that even if this port is busy (in the
+    // TIME_WAIT state), go ahead and reuse it anyway. If it is busy, but with
+    // another state, you will still get an address already in use error. It is
+    // useful if your server has been shut down, and then restarted right away
+    // while sockets are still active on its port.
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) != 0 ||
+            (num_workers > 1 &&
+             setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+                        sizeof(int)) != 0)) {
+        fprintf(stderr, "Error: Failed to set socket options. %s.\n",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    memset(&server_addr, 0, addrlen);         // Zero out structure
+    server_addr.sin_family = AF_INET;         // Internet address family
+    server_addr.sin_addr.s_addr = INADDR_ANY; // Internet address, 32 bits
+    server_addr.sin_port = htons(port);       // Server port, 16 bits
+
+    // Bind to the local address.
+    if (bind(fd, (struct sockaddr *)&server_addr, addrlen) < 0) {
+        fprintf(stderr, "Error: Failed to bind socket to port %d. %s.\n", port,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // Mark the socket so it will listen for incoming connections.
+    if (listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr,
+                "Error: Failed to listen for incoming connections. %s.\n",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // The server socket is non-blocking, so handle_server_socket() can
+    // accept every pending connection in one go.
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        fprintf(stderr, "Error: Failed to set socket options. %s.\n",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 /**
- * Prints a header with date/time information.
+ * Creates the Unix socket clients on the same host may connect to, at the
+ * given path. A socket left behind by an earlier run is replaced, but any
+ * other file at the path is left alone. Like the server socket, it is
+ * non-blocking, and every worker accepts from it.
+ * Returns the socket, or -1 on failure.
  */
-void print_date_time_header(FILE *output) {
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    char s[64];
-    strftime(s, sizeof(s), "%c", tm);
-    fprintf(output, "%s: ", s);
+int create_local_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Local socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        fprintf(stderr, "Error: Failed to create socket. %s.\n",
+                strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) < 0) {
+        fprintf(stderr, "Error: Failed to bind socket to '%s'. %s.\n", path,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN) < 0 ||
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        fprintf(stderr,
+                "Error: Failed to listen for incoming connections. %s.\n",
+                strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
 }
 
 /**
- * Broadcasts the contents of the buffer to all sockets except skip_index.
- * To send the message to all clients, pass -1 for skip_index.
+ * Lets go of a client taken over from the previous process that could not
+ * be given a slot.
  */
-void broadcast_buffer(int skip_index, char *buf) {
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (i != skip_index && client_sockets[i] != -1) {
-            if (send(client_sockets[i], buf, strlen(buf), 0) == -1) {
-                printf("%d\n", client_sockets[i]);
-                print_date_time_header(stderr);
-                fprintf(stderr,
-                    "Warning: Failed to broadcast message. %s.\n",
-                    strerror(errno));
+void drop_parked(struct parked_client *p) {
+    if (p->state.state == STATE_ACTIVE) {
+        roster_remove(p->state.username, -1);
+        atomic_fetch_sub(&rooms[p->room]->num_members, 1);
+    }
+    close(p->fd);
+    free(p->data);
+}
+
+/**
+ * Takes over the clients handed to this worker by the previous process. Each
+ * one gets the slot it was registered with, its place in its room, and what
+ * it had not been sent yet. It is put in the list of throttled clients, so
+ * what it sent that was not handled yet is handled on the first pass of the
+ * event loop, before the worker reads from it again.
+ */
+void adopt_clients() {
+    if (self->num_parked == 0) {
+        return;
+    }
+    while (max_connections < self->num_parked) {
+        if (!grow_connection_table()) {
+            log_printf(LOG_WARNING, "Warning: Failed to take over %d clients. "
+                       "%s.", self->num_parked, strerror(errno));
+            for (int j = 0; j < self->num_parked; j++) {
+                if (self->parked[j].fd != -1) {
+                    drop_parked(&self->parked[j]);
+                }
+            }
+            goto EXIT;
+        }
+    }
+    // The table starts out empty, so client j ends up in slot j.
+    for (int j = 0; j < self->num_parked; j++) {
+        struct parked_client *p = &self->parked[j];
+        struct handoff_client *h = &p->state;
+        int index = allocate_slot();
+        if (p->fd == -1) {
+            continue;
+        }
+        connections[index].fd = p->fd;
+        connections[index].flags = h->flags;
+        connections[index].state = h->state;
+        conn_info[index].generation++;
+        if (h->flags & (CLIENT_DEFLATE | CLIENT_WANTS_DEFLATE)) {
+            atomic_fetch_add(&num_deflate_clients, 1);
+        }
+        metrics_adjust(METRIC_CONNECTIONS, 1);
+        struct connection_info *info = &conn_info[index];
+        strcpy(info->ip, h->ip);
+        info->port = h->port;
+        sprintf(info->peer, "[%s:%d]", h->ip, h->port);
+        info->connected_at = h->connected_at;
+        info->last_active = h->last_active;
+        info->last_ping = h->last_ping;
+        info->messages_received = h->messages_received;
+        info->bytes_received = h->bytes_received;
+        info->message_tokens = h->message_tokens;
+        info->byte_tokens = h->byte_tokens;
+        info->room = -1;
+        info->resume_at = 0;
+
+        if (h->state != STATE_ACTIVE) {
+            if (h->state == STATE_WELCOMED && h->output_len == 0) {
+                connections[index].state = STATE_AWAITING_NAME;
+            }
+            timer_set(&wheel, index, loop_ms + LOGIN_TIMEOUT * 1000);
+        } else if (reserve_member(p->room)) {
+            struct room_members *m = &local_rooms[p->room];
+            strcpy(info->username, h->username);
+            info->room = p->room;
+            info->room_pos = m->count;
+            m->slots[m->count] = index;
+            m->joined[m->count++] = p->joined;
+            schedule_idle_check(index);
+        } else {
+            log_printf(LOG_WARNING, "Warning: Failed to take over user '%s'. "
+                       "%s.", h->username, strerror(errno));
+            roster_remove(h->username, -1);
+            atomic_fetch_sub(&rooms[p->room]->num_members, 1);
+            connections[index].state = STATE_AWAITING_NAME;
+            close_client_later(index);
+        }
+
+        // What the client was not sent yet goes out as it is, in the form
+        // it was meant to go out in.
+        if (h->output_len > 0) {
+            struct message *msg = message_verbatim(p->data + h->input_len,
+                                                   h->output_len);
+            if (!msg || !queue_message(index, msg)) {
+                log_printf(LOG_WARNING, "Warning: Failed to take over "
+                           "messages for %s. %s.", info->peer,
+                           strerror(errno));
+                close_client_later(index);
             }
+            message_unref(msg);
+        }
+        if (h->input_len > 0) {
+            info->held = p->data;
+            info->held_len = h->input_len;
+        } else {
+            free(p->data);
+        }
+
+        // Sockets are left blocking under io_uring, like in add_client().
+        int fd = connections[index].fd;
+        int fl = fcntl(fd, F_GETFL);
+        bool watched = fl >= 0 &&
+            fcntl(fd, F_SETFL, use_uring ? fl & ~O_NONBLOCK
+                                         : fl | O_NONBLOCK) >= 0 &&
+            (use_uring || watch_socket(fd, index, EPOLLIN | EPOLLOUT) == 0);
+        if (!watched) {
+            log_printf(LOG_WARNING, "Warning: Failed to watch socket for %s. "
+                       "%s.", info->peer, strerror(errno));
+            close_client_later(index);
+        }
+        connections[index].flags |= CLIENT_THROTTLED;
+        throttled_slots[num_throttled_slots++] = index;
+        if (connections[index].queue.count > 0) {
+            flush_queued(index);
+        }
+    }
+    // The slots of the clients that were let go of before they got here
+    // are free for others.
+    for (int j = 0; j < self->num_parked; j++) {
+        if (self->parked[j].fd == -1) {
+            release_slot(j);
         }
     }
+
+EXIT:
+    free(self->parked);
+    self->parked = NULL;
+    self->num_parked = self->parked_capacity = 0;
 }
 
 /**
- * String comparator for qsort.
+ * Runs the event loop of a worker until the server shuts down.
+ * The worker's return value is stored in its retval field.
  */
-int str_cmp(const void *a, const void *b) { 
-    return strcmp(*(const char**)a, *(const char**)b);
+void *run_worker(void *arg) {
+    self = arg;
+    self->retval = EXIT_SUCCESS;
+    metrics_attach(self->id);
+    server_socket = self->server_socket;
+    message_cache_init(&self->messages);
+    message_cache = &self->messages;
+    loop_ms = clock_ms();
+    timer_wheel_init(&wheel, loop_ms);
+    pool_init(&self->inbox_nodes, sizeof(struct inbox_node),
+              METRIC_POOL_INBOX_NODES);
+    pool_init(&recv_pool, MAX_FRAME_LEN, METRIC_POOL_RECV_BUFFERS);
+    pool_init(&send_pool, sizeof(struct uring_send) + URING_POOLED_MSGS *
+              (MESSAGE_MAX_IOV * sizeof(struct iovec) +
+               sizeof(struct message *)), METRIC_POOL_SENDS);
+
+    // Allocate the connection table. Every slot starts out with the client
+    // socket set to -1 and the user name empty.
+    if (!grow_connection_table()) {
+        fprintf(stderr, "Error: Failed to allocate connection table. %s.\n",
+                strerror(errno));
+        self->retval = EXIT_FAILURE;
+        goto EXIT;
+    }
+    // Keep a descriptor in reserve so connections can still be accepted (and
+    // refused) after the process runs out of file descriptors.
+    spare_fd = open("/dev/null", O_RDONLY);
+
+    if (engine == ENGINE_URING) {
+        if ((use_uring = start_uring())) {
+            adopt_clients();
+            self->retval = run_uring_loop();
+            goto EXIT;
+        }
+        log_printf(LOG_WARNING, "Warning: Failed to set up io_uring for "
+                   "worker %d. %s. Falling back to epoll.", self->id,
+                   strerror(errno));
+    }
+
+    // Create the epoll instance and watch the server socket and the eventfd
+    // other workers use to signal new inbox messages. Every worker watches
+    // the Unix socket as well, and only one of them is woken up for each
+    // connection.
+    if ((epoll_fd = epoll_create1(0)) < 0) {
+        fprintf(stderr, "Error: Failed to create epoll instance. %s.\n",
+                strerror(errno));
+        self->retval = EXIT_FAILURE;
+        goto EXIT;
+    }
+    if (watch_socket(server_socket, SERVER_SOCKET_TAG, EPOLLIN) < 0 ||
+            watch_socket(self->wake_fd, WAKE_TAG, EPOLLIN) < 0 ||
+            (local_socket >= 0 &&
+             watch_socket(local_socket, LOCAL_SOCKET_TAG,
+                          EPOLLIN | EPOLLEXCLUSIVE) < 0)) {
+        fprintf(stderr, "Error: Failed to watch server socket. %s.\n",
+                strerror(errno));
+        self->retval = EXIT_FAILURE;
+        goto EXIT;
+    }
+    adopt_clients();
+
+    struct epoll_event events[MAX_EVENTS];
+    while (atomic_load(&running)) {
+        // SIGUSR2 only ever interrupts the main thread.
+        if (restart_requested && self->id == 0) {
+            begin_restart();
+            continue;
+        }
+        // Wait for activity on one of the sockets. Wait indefinitely, unless
+        // a congested client or a login has to be checked on.
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS,
+                                    next_timeout());
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_printf(LOG_ERROR, "Error: epoll_wait() failed. %s.",
+                       strerror(errno));
+            self->retval = EXIT_FAILURE;
+            goto EXIT;
+        }
+        uint64_t start = metrics_now();
+        loop_ms = start / 1000000;
+
+        // The clients set aside in the last pass go first.
+        loop_pass++;
+        resume_throttled_clients();
+
+        // Only the sockets with activity are visited. If there is activity
+        // on the server socket, handle the incoming connections. Otherwise,
+        // the event carries the index of the client sending messages.
+        for (int i = 0; atomic_load(&running) && i < num_events; i++) {
+            if (events[i].data.u64 == SERVER_SOCKET_TAG ||
+                    events[i].data.u64 == LOCAL_SOCKET_TAG) {
+                if (handle_server_socket(events[i].data.u64 ==
+                                         SERVER_SOCKET_TAG ? server_socket
+                                                           : local_socket)
+                        == EXIT_FAILURE) {
+                    self->retval = EXIT_FAILURE;
+                    goto EXIT;
+                }
+            } else if (events[i].data.u64 == WAKE_TAG) {
+                handle_inbox();
+            } else if (connections[events[i].data.u64].fd > -1) {
+                int index = events[i].data.u64;
+                if (events[i].events & EPOLLOUT) {
+                    flush_send_queue(index);
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    handle_client_socket(index);
+                }
+            }
+        }
+        if (num_local_congested > 0) {
+            evict_congested_clients();
+        }
+        expire_timers();
+        close_pending_clients();
+        resume_paused_clients();
+        metrics_record(METRIC_LOOP_TIME, start);
+    }
+
+EXIT:
+    if (self->retval == EXIT_FAILURE) {
+        stop_workers();
+    }
+    cleanup();
+    // The messages and nodes of this worker that are still in use are let
+    // go of by other threads from now on.
+    message_cache = NULL;
+    message_cache_detach(&self->messages);
+    pool_detach(&self->inbox_nodes);
+    return NULL;
 }
 
 /**
- * Creates a string in outbuf that contains a welcome message as well as the
- * list of all users currently connected to the server.
+ * Hands the listening sockets, the clients set aside by the workers, the
+ * history of the rooms, and the links to the other nodes of the cluster over
+ * to the new process. The history only goes along when there is no journal
+ * for the new process to recover it from. The sockets of the clients are
+ * closed here either way.
  */
-void create_welcome_msg() {
-    outbuf[0] = '\0'; // Don't forget to start from the beginning!
-    strcat(outbuf, "*** Welcome to CS 392 Chat Server v1.0 ***");
-    if (num_connections == 0) {
-        strcat(outbuf, "\n\nNo other users are in the chat room.");
-        return;
+void hand_off() {
+    bool sent = true;
+    int num_handed = 0;
+    for (int i = 0; sent && i < num_workers; i++) {
+        if (workers[i].server_socket >= 0) {
+            sent = handoff_send(handoff_fd, HANDOFF_LISTENER, &workers[i].id,
+                                sizeof(int), NULL, 0,
+                                workers[i].server_socket);
+        }
+    }
+    if (sent && local_socket >= 0) {
+        sent = handoff_send(handoff_fd, HANDOFF_LOCAL_LISTENER, NULL, 0, NULL,
+                            0, local_socket);
     }
-    char *names[MAX_CONNECTIONS];
-    int j = 0;
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (usernames[i]) {
-            names[j++] = usernames[i];
+    for (int i = 0; i < num_workers; i++) {
+        for (int j = 0; j < workers[i].num_parked; j++) {
+            struct parked_client *p = &workers[i].parked[j];
+            if (sent && (sent = handoff_send(handoff_fd, HANDOFF_CLIENT,
+                                             &p->state,
+                                             sizeof(struct handoff_client),
+                                             p->data, p->state.input_len +
+                                             p->state.output_len, p->fd))) {
+                num_handed++;
+            }
+            close(p->fd);
+            free(p->data);
+        }
+        free(workers[i].parked);
+        workers[i].parked = NULL;
+        workers[i].num_parked = 0;
+    }
+    for (int i = 0; sent && !journal_dir && i < num_rooms; i++) {
+        struct room *r = rooms[i];
+        struct handoff_line line;
+        memset(&line, 0, sizeof(struct handoff_line));
+        strcpy(line.room, r->name);
+        for (unsigned j = 0; sent && j < r->history_count; j++) {
+            struct message *msg =
+                r->history[(r->history_head + j) % history_capacity];
+            if (msg->header_len + msg->body_len > BUFLEN) {
+                continue;
+            }
+            line.type = msg->type;
+            memcpy(outbuf, msg->header, msg->header_len);
+            memcpy(outbuf + msg->header_len, msg->body, msg->body_len);
+            sent = handoff_send(handoff_fd, HANDOFF_HISTORY, &line,
+                                sizeof(struct handoff_line), outbuf,
+                                msg->header_len + msg->body_len, -1);
         }
     }
-    qsort(names, j, sizeof(char *), str_cmp);
-    strcat(outbuf, "\n\nConnected users: [");
-    strcat(outbuf, names[0]);
-    for (int i = 1; i < j; i++) {
-        strcat(outbuf, ", ");
-        strcat(outbuf, names[i]);
+    if (sent && clustered) {
+        sent = cluster_hand_off(handoff_fd);
+    }
+    if (sent) {
+        log_printf(LOG_INFO, "Handed %d clients over to the new process.",
+                   num_handed);
+    } else {
+        log_printf(LOG_ERROR, "Error: Failed to hand over to the new process. "
+                   "%s.", strerror(errno));
     }
-    strcat(outbuf, "]");
 }
 
 /**
- * Tells the clients to close before forcefully closing all the sockets and
- * freeing up memory.
+ * Takes over the listening sockets, the clients, the history of the rooms,
+ * and the links to the other nodes of the cluster from the previous process,
+ * after telling it this process is ready. Each client is set aside for the
+ * worker it was on before.
+ * Returns true on success, false on failure with errno set.
  */
-void cleanup() {
-    // Send "bye" to let all clients close before the server does.
-    sprintf(outbuf, "bye");
-    broadcast_buffer(-1, outbuf);
-    // Give some time to allow the clients to close first. Otherwise, restarting
-    // the server immediately results in "Address already in use."
-    usleep(100000);
-    // F_GETFD - Return the file descriptor flags.
-    if (fcntl(server_socket, F_GETFD) >= 0) {
-        close(server_socket);
+bool take_over(int sock) {
+    uint32_t version[2] = { HANDOFF_VERSION, sizeof(struct handoff_client) };
+    if (!handoff_send(sock, HANDOFF_HELLO, version, sizeof(version), NULL, 0,
+                      -1)) {
+        return false;
     }
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (fcntl(client_sockets[i], F_GETFD) >= 0) {
-            close(client_sockets[i]);
+    struct handoff_msg m;
+    while (handoff_recv(sock, -1, &m)) {
+        if (m.kind == HANDOFF_END) {
+            free(m.payload);
+            if (m.fd >= 0) {
+                close(m.fd);
+            }
+            return true;
+        }
+        if (m.kind == HANDOFF_LISTENER && m.len == sizeof(int) && m.fd >= 0) {
+            int id;
+            memcpy(&id, m.payload, sizeof(int));
+            // A worker this process does not have loses its listener.
+            if (id >= 0 && id < num_workers &&
+                    workers[id].server_socket == -1) {
+                workers[id].server_socket = m.fd;
+                m.fd = -1;
+            }
+        } else if (m.kind == HANDOFF_LOCAL_LISTENER && m.fd >= 0) {
+            // It is only kept if this process has a Unix socket as well.
+            if (local_socket_path && local_socket == -1) {
+                local_socket = m.fd;
+                m.fd = -1;
+            }
+        } else if (m.kind == HANDOFF_CLIENT && m.fd >= 0 &&
+                   m.len >= sizeof(struct handoff_client)) {
+            struct handoff_client h;
+            memcpy(&h, m.payload, sizeof(struct handoff_client));
+            size_t rest = m.len - sizeof(struct handoff_client);
+            struct worker *w = &workers[(unsigned)h.worker % num_workers];
+            if (h.input_len > rest || h.output_len != rest - h.input_len) {
+                errno = EPROTO;
+                free(m.payload);
+                close(m.fd);
+                return false;
+            }
+            if (w->num_parked == w->parked_capacity) {
+                int new_capacity = w->parked_capacity
+                                   ? w->parked_capacity * 2
+                                   : INITIAL_CONNECTIONS;
+                struct parked_client *new_parked = realloc(w->parked,
+                    new_capacity * sizeof(struct parked_client));
+                if (!new_parked) {
+                    free(m.payload);
+                    close(m.fd);
+                    return false;
+                }
+                w->parked = new_parked;
+                w->parked_capacity = new_capacity;
+            }
+            struct parked_client *p = &w->parked[w->num_parked++];
+            h.username[MAX_NAME_LEN] = h.room[MAX_NAME_LEN] = '\0';
+            h.ip[INET_ADDRSTRLEN - 1] = '\0';
+            h.flags &= CLIENT_LEGACY | CLIENT_DEFLATE | CLIENT_WANTS_DEFLATE |
+                       CLIENT_LOCAL;
+            p->state = h;
+            p->fd = m.fd;
+            p->room = -1;
+            p->joined = 0;
+            // The data stays in the payload, moved up to its start.
+            memmove(m.payload, m.payload + sizeof(struct handoff_client),
+                    rest);
+            p->data = m.payload;
+            m.payload = NULL;
+            m.fd = -1;
+        } else if (m.kind == HANDOFF_HISTORY && history_capacity > 0 &&
+                   m.len >= sizeof(struct handoff_line)) {
+            struct handoff_line line;
+            memcpy(&line, m.payload, sizeof(struct handoff_line));
+            line.room[MAX_NAME_LEN] = '\0';
+            recover_line(line.room, strlen(line.room), line.type,
+                         m.payload + sizeof(struct handoff_line),
+                         m.len - sizeof(struct handoff_line));
+        } else if (m.kind >= HANDOFF_CLUSTER &&
+                   m.kind <= HANDOFF_CLUSTER_LINK && clustered &&
+                   !cluster_take_over(&m)) {
+            free(m.payload);
+            return false;
         }
-        if (usernames[i]) {
-            free(usernames[i]);
+        free(m.payload);
+        if (m.fd >= 0) {
+            close(m.fd);
         }
     }
+    return false;
 }
 
 /**
- * Disconnects a client from the server, freeing up resources to be used by
- * another potential client.
+ * Puts the users taken over from the previous process back in the roster and
+ * in their rooms before the workers start, so no one else can take their
+ * names and they miss no chat line. Client j of a worker ends up in slot j
+ * of the worker's empty connection table, which is given to its first
+ * connection, generation 1.
  */
-void disconnect_client(int index, char *ip, int port) {
-    print_date_time_header(stdout);
-    printf("Host [%s:%d] disconnected.\n", ip, port);
-
-    sprintf(outbuf, "User [%s] left the chat room.", usernames[index]);
-    broadcast_buffer(index, outbuf);
-
-    // Close the socket and mark the array index as -1 for reuse.
-    close(client_sockets[index]);
-    client_sockets[index] = -1;
-    // Free up the usernames index and mark the array index as NULL for reuse.
-    free(usernames[index]);
-    usernames[index] = NULL;
-    // Keep track of the number of connections.
-    num_connections--;
+void register_parked() {
+    for (int i = 0; i < num_workers; i++) {
+        for (int j = 0; j < workers[i].num_parked; j++) {
+            struct parked_client *p = &workers[i].parked[j];
+            if (p->state.state != STATE_ACTIVE) {
+                continue;
+            }
+            if (!roster_add(p->state.username, i, j, 1)) {
+                log_printf(LOG_WARNING, "Warning: Failed to take over user "
+                           "'%s'. %s.", p->state.username, strerror(errno));
+                close(p->fd);
+                free(p->data);
+                p->fd = -1;
+                continue;
+            }
+            size_t len = strlen(p->state.room);
+            int room = is_room_name(p->state.room, len)
+                       ? open_room(p->state.room, len) : -1;
+            struct room *r = rooms[room == -1 ? LOBBY_ROOM : room];
+            p->room = room == -1 ? LOBBY_ROOM : room;
+            pthread_mutex_lock(&r->lock);
+            p->joined = r->next_seq;
+            pthread_mutex_unlock(&r->lock);
+            atomic_fetch_or(&r->workers[i / 64], (uint64_t)1 << (i % 64));
+            atomic_fetch_add(&r->num_members, 1);
+        }
+    }
 }
 
 /**
- * Handles an incoming connection.
- * Performs the tasks required to accept the connection and add the client
- * to the system.
+ * Broadcasts a message sent to a room on another node of the cluster to the
+ * members of the room on this node. Chat lines go into the history and the
+ * journal like the ones sent here. Called on the thread of the cluster.
  */
-int handle_server_socket() {
-    // Try to accept incoming connection.
-    int new_socket = accept(server_socket,
-                            (struct sockaddr *)&server_addr,
-                            &addrlen);
-    if (new_socket < 0 && errno != EINTR) {   
-        fprintf(stderr,
-                "Error: Failed to accept incoming connection. %s.\n",
-                strerror(errno));
-        return EXIT_FAILURE;
-    }   
-
-    // If the server is maxed out, refuse the connection.
-    if (num_connections >= MAX_CONNECTIONS) {
-        print_date_time_header(stdout);
-        printf("Connection from [%s:%d] refused.\n",
-               inet_ntoa(server_addr.sin_addr),
-               ntohs(server_addr.sin_port));
-        close(new_socket);
-        return EXIT_SUCCESS; // Not a failure, just a limitation.
+void broadcast_remote_line(const char *room, size_t room_len,
+                           unsigned char type, const char *text, size_t len) {
+    if (!is_room_name(room, room_len) || len > BUFLEN) {
+        log_printf(LOG_WARNING, "Warning: Dropped a malformed message from "
+                   "the cluster.");
+        return;
     }
-
-    char connection_str[24];
-    sprintf(connection_str, "[%s:%d]", inet_ntoa(server_addr.sin_addr),
-            ntohs(server_addr.sin_port));
-    // Log information about the client's connection.
-    print_date_time_header(stdout);
-    printf("New connection from %s.\n", connection_str);
-   
-    // Send a welcome message to the new connection.
-    create_welcome_msg();
-    if (send(new_socket, outbuf, strlen(outbuf), 0) == -1 && errno != EINTR) {
-        print_date_time_header(stderr);
-        fprintf(stderr,
-                "Warning: Failed to send welcome message. %s.\n",
-                strerror(errno));
-    } else {
-        print_date_time_header(stdout);
-        printf("Welcome message sent to %s.\n", connection_str);
+    int id = open_room(room, room_len);
+    struct message *msg = id == -1 ? NULL
+                                   : message_create(type, NULL, 0, text, len);
+    if (!msg) {
+        log_printf(LOG_WARNING, "Warning: Failed to broadcast message from "
+                   "the cluster. %s.", strerror(errno));
+        return;
     }
+    broadcast_message(-1, id, msg);
+    message_unref(msg);
+}
 
-    // Receive the user name from the client.
-    int bytes_recvd = recv(new_socket, inbuf, MAX_MSG_LEN + 1, 0);
-    if (bytes_recvd == -1) {
-        print_date_time_header(stderr);
-        fprintf(stderr, "Warning: Failed to receive user name. %s.\n",
-                strerror(errno));
-    } else if (bytes_recvd == 0) {
-        return EXIT_SUCCESS; // Client hung up prematurely.
-    } else {
-        inbuf[bytes_recvd] = '\0';
-        print_date_time_header(stdout);
-        printf("Associated user name '%s' with %s.\n", inbuf, connection_str);
+/**
+ * Relays a message sent by a user on another node of the cluster to the
+ * worker of its recipient, if the recipient is connected to this node.
+ * Called on the thread of the cluster.
+ */
+void deliver_remote_direct(const char *name, size_t name_len,
+                           unsigned char type, const char *text, size_t len) {
+    if (name_len == 0 || name_len > MAX_NAME_LEN || len > BUFLEN) {
+        return;
     }
-
-    // Add new socket to array of sockets.
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {   
-        if (client_sockets[i] == -1) {
-            client_sockets[i] = new_socket;
-            usernames[i] = strdup(inbuf);
-            num_connections++;
-            sprintf(outbuf, "User [%s] joined the chat room.", usernames[i]);
-            broadcast_buffer(i, outbuf);
-            break;   
-        }   
+    char user[MAX_NAME_LEN + 1];
+    memcpy(user, name, name_len);
+    user[name_len] = '\0';
+    struct user_entry to;
+    to.name[0] = '\0';
+    pthread_mutex_lock(&roster_lock);
+    if (users_capacity > 0) {
+        to = users[find_user(user)];
     }
-
-    return EXIT_SUCCESS;
+    pthread_mutex_unlock(&roster_lock);
+    if (to.name[0] == '\0' || to.worker == WORKER_REMOTE) {
+        return;
+    }
+    struct message *msg = message_create(type, NULL, 0, text, len);
+    if (!msg) {
+        log_printf(LOG_WARNING, "Warning: Failed to send private message. "
+                   "%s.", strerror(errno));
+        return;
+    }
+    if (atomic_load_explicit(&num_deflate_clients, memory_order_relaxed) > 0) {
+        message_compress(msg);
+    }
+    relay_message(to.worker, ROOM_DIRECT, SEQ_ALWAYS, to.index, to.generation,
+                  msg);
+    message_unref(msg);
 }
 
 /**
- * Handles data received from a client.
- * Based on the data received, the function either disconnects the client or
- * broadcasts the client's message to all other clients on the system.
+ * Adds a user connected to the node in the given slot of the cluster to the
+ * roster, or removes one. Called on the thread of the cluster.
  */
-void handle_client_socket(int index) {
-    int port = 0;
-    char ip[16];
-
-    if (getpeername(client_sockets[index], (struct sockaddr*)&server_addr,
-                    &addrlen) == 0) {
-        inet_ntop(AF_INET, &(server_addr.sin_addr), ip, 16);
-        port = ntohs(server_addr.sin_port);
-    } else {
-         // Set string to 0.0.0.0 if getpeername fails.
-         // We don't really want to error out for this reason alone.
-         // It should never happen, anyway.
-        sprintf(ip, "0.0.0.0");
+void track_remote_user(const char *name, size_t len, int node,
+                       bool present) {
+    if (len == 0 || len > MAX_NAME_LEN) {
+        return;
     }
-
-    // Read the incoming message and use the number of bytes read to
-    // check if the client disconnected.
-    int bytes_recvd = recv(client_sockets[index], inbuf, MAX_MSG_LEN + 1, 0);
-    if (bytes_recvd == -1 && errno != EINTR) {
-        print_date_time_header(stderr);
-        fprintf(stderr,
-                "Warning: Failed to receive incoming message from "
-                "[%s:%d]. %s.\n", ip, port, strerror(errno));
-    } else if (bytes_recvd == 0) {
-        // The client disconnected.
-        disconnect_client(index, ip, port);
-    } else {
-        // Process the incoming data. If "bye", the client disconnected.
-        // Otherwise, broadcast the message to all the other users.
-        inbuf[bytes_recvd] = '\0';
-        print_date_time_header(stdout);
-        printf("Received from '%s' at [%s:%d]: %s\n", usernames[index],
-               ip, port, inbuf);
-        if (strcmp(inbuf, "bye") == 0) {
-            disconnect_client(index, ip, port);
+    char user[MAX_NAME_LEN + 1];
+    memcpy(user, name, len);
+    user[len] = '\0';
+    if (!present) {
+        roster_remove(user, node);
+    } else if (!roster_add(user, WORKER_REMOTE, node, 0)) {
+        // Two nodes may let users with the same name in at the same time.
+        // Each of them keeps its own.
+        if (errno == EEXIST) {
+            log_printf(LOG_WARNING, "Warning: User name '%s' is taken on this "
+                       "node and another one.", user);
         } else {
-            sprintf(outbuf, "[%s]: %s", usernames[index], inbuf);
-            broadcast_buffer(index, outbuf);
+            log_printf(LOG_WARNING, "Warning: Failed to add user '%s' of "
+                       "another node. %s.", user, strerror(errno));
         }
     }
 }
 
+/**
+ * Sets up the thread of the cluster, which relays messages to the workers
+ * from a pool of its own.
+ */
+void start_cluster_thread() {
+    pool_init(&remote_nodes, sizeof(struct inbox_node),
+              METRIC_POOL_INBOX_NODES);
+}
+
+/**
+ * Lets go of what the thread of the cluster set up. Its nodes may still be
+ * in the inboxes of the workers, so the pool is freed along with theirs.
+ */
+void end_cluster_thread() {
+    pool_detach(&remote_nodes);
+    message_compress_end();
+}
+
 /**
  * Main function.
- * Initializes variables, runs the main loop, and cleans up.
+ * Initializes variables, starts the workers, and waits for them to finish.
+ * Worker 0 runs on the main thread, so by default the server is
+ * single-threaded.
  */
 int main(int argc, char *argv[]) {
     int retval = EXIT_SUCCESS;
- 
-    // Parse command line argument for port number.
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
+    // A new process started on a hot restart finds the socket leading back
+    // to the process it takes over from. The new process itself is started
+    // with the same arguments.
+    server_argv = argv;
+    int takeover_fd = handoff_inherit();
+
+    // Parse command line arguments for the number of workers and port number.
+    int opt;
+    int limit_arg;
+    char *binary_log_path = NULL;
+    bool history_limit_set = false;
+    while ((opt = getopt(argc, argv,
+                         "Lw:q:p:l:B:e:H:J:A:m:b:i:P:C:N:U:")) != -1) {
+        switch (opt) {
+            case 'L':
+                legacy_protocol = true;
+                break;
+            case 'w':
+                if (!parse_int(optarg, &num_workers, "number of workers")) {
+                    return EXIT_FAILURE;
+                }
+                if (num_workers < 1 || num_workers > MAX_WORKERS) {
+                    fprintf(stderr, "Error: number of workers must be in range "
+                            "[1, %d].\n", MAX_WORKERS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'q':
+                if (!parse_int(optarg, &limit_arg, "queue limit")) {
+                    return EXIT_FAILURE;
+                }
+                // A queue must at least hold one full message.
+                if (limit_arg < BUFLEN) {
+                    fprintf(stderr, "Error: queue limit must be at least %d "
+                            "bytes.\n", BUFLEN);
+                    return EXIT_FAILURE;
+                }
+                queue_limit = limit_arg;
+                break;
+            case 'p':
+                if (strcmp(optarg, "drop") == 0) {
+                    slow_policy = POLICY_DROP_OLDEST;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    slow_policy = POLICY_DISCONNECT;
+                } else if (strcmp(optarg, "block") == 0) {
+                    slow_policy = POLICY_BACKPRESSURE;
+                } else {
+                    fprintf(stderr, "Error: Invalid slow consumer policy "
+                            "'%s'.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l':
+                if (!log_parse_level(optarg, &log_level)) {
+                    fprintf(stderr, "Error: Invalid log level '%s'.\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'B':
+                binary_log_path = optarg;
+                break;
+            case 'e':
+                if (strcmp(optarg, "epoll") == 0) {
+                    engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    engine = ENGINE_URING;
+                } else {
+                    fprintf(stderr, "Error: Invalid engine '%s'.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'H':
+                if (!parse_int(optarg, &limit_arg, "history limit")) {
+                    return EXIT_FAILURE;
+                }
+                if (limit_arg < 0) {
+                    fprintf(stderr, "Error: history limit must not be "
+                            "negative.\n");
+                    return EXIT_FAILURE;
+                }
+                history_limit = limit_arg;
+                history_limit_set = true;
+                break;
+            case 'J':
+                journal_dir = optarg;
+                break;
+            case 'A':
+                admin_socket_path = optarg;
+                break;
+            case 'm':
+            case 'b':
+                if (!parse_int(optarg, &limit_arg, opt == 'm' ? "message rate"
+                                                              : "byte rate")) {
+                    return EXIT_FAILURE;
+                }
+                if (limit_arg < 0) {
+                    fprintf(stderr, "Error: %s must not be negative.\n",
+                            opt == 'm' ? "message rate" : "byte rate");
+                    return EXIT_FAILURE;
+                }
+                if (opt == 'm') {
+                    message_rate = limit_arg;
+                } else {
+                    byte_rate = limit_arg;
+                }
+                break;
+            case 'i':
+            case 'P':
+                if (!parse_int(optarg, &limit_arg,
+                               opt == 'i' ? "idle timeout" : "ping interval")) {
+                    return EXIT_FAILURE;
+                }
+                if (limit_arg < 0) {
+                    fprintf(stderr, "Error: %s must not be negative.\n",
+                            opt == 'i' ? "idle timeout" : "ping interval");
+                    return EXIT_FAILURE;
+                }
+                if (opt == 'i') {
+                    idle_timeout = (uint64_t)limit_arg * 1000;
+                } else {
+                    ping_interval = (uint64_t)limit_arg * 1000;
+                }
+                break;
+            case 'C':
+                if (!parse_int(optarg, &cluster_port, "cluster port")) {
+                    return EXIT_FAILURE;
+                }
+                if (cluster_port < 1024 || cluster_port > 65535) {
+                    fprintf(stderr, "Error: cluster port must be in range "
+                            "[1024, 65535].\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'N':
+                cluster_peers = optarg;
+                break;
+            case 'U':
+                local_socket_path = optarg;
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    clustered = cluster_port != 0 || cluster_peers;
+    // Without an idle timeout, a client that misses a few pings in a row is
+    // taken for dead.
+    if (ping_interval > 0 && idle_timeout == 0) {
+        idle_timeout = PING_MISSES * ping_interval;
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, USAGE, argv[0]);
         return EXIT_FAILURE;
     }
-    int port;   
-    if (!parse_int(argv[1], &port, "port number")) {
+    int port;
+    if (!parse_int(argv[optind], &port, "port number")) {
         return EXIT_FAILURE;
     }
     if (port < 1024 || port > 65535) {
@@ -294,6 +4837,13 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    // io_uring may be missing or disabled, in which case epoll does the job.
+    if (engine == ENGINE_URING && !probe_uring()) {
+        fprintf(stderr, "Warning: io_uring is not available. %s. Falling back "
+                "to epoll.\n", strerror(errno));
+        engine = ENGINE_EPOLL;
+    }
+
     // Set up a signal handler for SIGINT, CTRL+C.
     struct sigaction action;
     memset(&action, 0, sizeof(struct sigaction));
@@ -303,113 +4853,259 @@ int main(int argc, char *argv[]) {
                 strerror(errno));
         return EXIT_FAILURE;
     }
+    // Ignore SIGPIPE, so sending to a client that has gone away reports
+    // EPIPE instead of terminating the server. SIGUSR2 is ignored until the
+    // workers are up, and asks for a hot restart from then on.
+    action.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &action, NULL) == -1 ||
+            sigaction(SIGUSR2, &action, NULL) == -1) {
+        fprintf(stderr, "Error: Failed to register signal handler. %s.\n",
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
 
-    // Initialize all client sockets to -1 and usernames to NULL.
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        client_sockets[i] = -1;
-        usernames[i] = NULL;
+    // Raise the limit on open files as far as we are allowed, since every
+    // client needs a file descriptor.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+            limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
     }
 
-    // Create a server socket.
-    if ((server_socket = socket(AF_INET , SOCK_STREAM , 0)) < 0) {
-        fprintf(stderr, "Error: Failed to create socket. %s.\n",
+    // The history is sent to a new member all at once, so it must fit in the
+    // send queue. 0 turns the history off. Without -H, the default shrinks
+    // to fit a small queue limit instead.
+    if (!history_limit_set && history_limit > queue_limit) {
+        history_limit = queue_limit;
+    }
+    if (history_limit > queue_limit) {
+        fprintf(stderr, "Error: history limit must not exceed the queue "
+                "limit of %zu bytes.\n", queue_limit);
+        return EXIT_FAILURE;
+    }
+    history_capacity = history_limit / sizeof(struct message);
+
+    // Every user starts out in the lobby.
+    if (open_room(LOBBY_NAME, strlen(LOBBY_NAME)) != LOBBY_ROOM) {
+        fprintf(stderr, "Error: Failed to create the lobby. %s.\n",
                 strerror(errno));
         return EXIT_FAILURE;
     }
 
-    int opt;
-    // SO_REUSEADDR tells the kernel that even if this port is busy (in the
-    // TIME_WAIT state), go ahead and reuse it anyway. If it is busy, but with
-    // another state, you will still get an address already in use error. It is
-    // useful if your server has been shut down, and then restarted right away
-    // while sockets are still active on its port.
-    if (setsockopt(
-            server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) != 0) {
-        fprintf(stderr, "Error: Failed to set socket options. %s.\n",
+    // Set up every worker with its own listener and wake-up eventfd before
+    // any of them starts, so errors are reported up front.
+    if (!(workers = calloc(num_workers, sizeof(struct worker)))) {
+        fprintf(stderr, "Error: Failed to allocate workers. %s.\n",
                 strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].id = i;
+        workers[i].server_socket = -1;
+        workers[i].wake_fd = -1;
+        atomic_init(&workers[i].wake_pending, false);
+        inbox_init(&workers[i].inbox);
+    }
+
+    // On a hot restart, the previous process hands over its listeners, its
+    // clients, and the history it has no journal for. It lets go of the
+    // journal, the admin socket, and the log only once it is done.
+    if (takeover_fd >= 0 && !take_over(takeover_fd)) {
+        fprintf(stderr, "Error: Failed to take over from the previous "
+                "process. %s.\n", strerror(errno));
+        close(takeover_fd);
         retval = EXIT_FAILURE;
         goto EXIT;
     }
 
-    memset(&server_addr, 0, addrlen);         // Zero out structure
-    server_addr.sin_family = AF_INET;         // Internet address family
-    server_addr.sin_addr.s_addr = INADDR_ANY; // Internet address, 32 bits
-    server_addr.sin_port = htons(port);       // Server port, 16 bits
+    // Rebuild the history of every room from the journal, then keep adding
+    // to it. The journal is written by a background thread, which syncs
+    // many lines at once, so the workers never wait for the disk.
+    if (journal_dir &&
+            !journal_start(journal_dir, history_capacity ? recover_line
+                                                         : NULL)) {
+        fprintf(stderr, "Error: Failed to open journal in '%s'. %s.\n",
+                journal_dir, strerror(errno));
+        retval = EXIT_FAILURE;
+        goto EXIT;
+    }
+    // The users taken over join their rooms after the history is back, so
+    // none of it is sent to them again.
+    register_parked();
 
-    // Bind to the local address.
-    if (bind(server_socket, (struct sockaddr *)&server_addr, addrlen) < 0) {
-        fprintf(stderr, "Error: Failed to bind socket to port %d. %s.\n", port,
-                strerror(errno));
+    int num_started = 1;
+    for (int i = 0; i < num_workers; i++) {
+        if (workers[i].server_socket == -1 &&
+                (workers[i].server_socket = create_server_socket(port)) < 0) {
+            retval = EXIT_FAILURE;
+            goto EXIT;
+        }
+        if ((workers[i].wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            fprintf(stderr, "Error: Failed to create eventfd. %s.\n",
+                    strerror(errno));
+            retval = EXIT_FAILURE;
+            goto EXIT;
+        }
+    }
+    // Clients on the same host may connect through a Unix socket instead,
+    // and be sent their messages through shared memory.
+    if (local_socket_path && local_socket == -1 &&
+            (local_socket = create_local_socket(local_socket_path)) < 0) {
         retval = EXIT_FAILURE;
         goto EXIT;
     }
 
-    // Mark the socket so it will listen for incoming connections.
-    if (listen(server_socket, MAX_CONNECTIONS) < 0) {
-        fprintf(stderr,
-                "Error: Failed to listen for incoming connections. %s.\n",
-                strerror(errno));
+    // Every worker counts into its own block of metrics, which the admin
+    // thread adds up whenever they are read.
+    if (!metrics_start(admin_socket_path, num_workers)) {
+        if (admin_socket_path) {
+            fprintf(stderr, "Error: Failed to open admin socket '%s'. %s.\n",
+                    admin_socket_path, strerror(errno));
+        } else {
+            fprintf(stderr, "Error: Failed to allocate metrics. %s.\n",
+                    strerror(errno));
+        }
         retval = EXIT_FAILURE;
         goto EXIT;
     }
 
     printf("Chat server is up and running on port %d.\nPress CTRL+C to exit.\n",
            port);
-    fd_set sockset;
-    int max_socket;
-    while (running) {
-        // Zero out and set socket descriptors for server sockets.
-        // This must be reset every time select() is called.
-        FD_ZERO(&sockset);
-        FD_SET(server_socket, &sockset);
-        max_socket = server_socket;
-
-        // Add client sockets to set.
-        for (int i = 0; i < MAX_CONNECTIONS; i++) {   
-            // If socket descriptor is valid, add it to the set.
-            if (client_sockets[i] > -1) {
-                FD_SET(client_sockets[i], &sockset);
-            }
-            // Keep track of the highest file descriptor number.
-            // It is needed for the select() function.
-            if (client_sockets[i] > max_socket) {
-                max_socket = client_sockets[i];
-            }
-        }
-
-        // Wait for activity on one of the sockets.
-        // Timeout is NULL, so wait indefinitely.
-        if (select(max_socket + 1, &sockset, NULL, NULL, NULL) < 0
-                && errno != EINTR) {
-            print_date_time_header(stderr);
-            fprintf(stderr, "Error: select() failed. %s.\n", strerror(errno));
+    fflush(stdout);
+
+    // From here on, log lines are written by a background thread, so the
+    // workers never wait on the terminal or the log file.
+    if (!log_start(binary_log_path, takeover_fd >= 0)) {
+        fprintf(stderr, "Error: Failed to start logging. %s.\n",
+                strerror(errno));
+        retval = EXIT_FAILURE;
+        goto EXIT;
+    }
+
+    // Users of the other nodes of the cluster share the rooms and the roster
+    // with the users of this one. A background thread keeps the links to the
+    // other nodes, so the workers never wait on them.
+    if (clustered) {
+        struct cluster_handlers handlers = {
+            broadcast_remote_line, deliver_remote_direct, track_remote_user,
+            start_cluster_thread, end_cluster_thread
+        };
+        if (!cluster_start(cluster_port, cluster_peers, &handlers)) {
+            fprintf(stderr, "Error: Failed to join the cluster. %s.\n",
+                    strerror(errno));
             retval = EXIT_FAILURE;
             goto EXIT;
         }
+    }
 
-        // If there is activity on the server socket, handle the incoming
-        // connection.
-        if (running && FD_ISSET(server_socket, &sockset)) {
-            if (handle_server_socket() == EXIT_FAILURE) {
-                retval = EXIT_FAILURE;
-                goto EXIT;
-            }
+    // Block SIGINT and SIGUSR2 in the other workers, so CTRL+C and a request
+    // for a hot restart always interrupt the main thread, which then stops
+    // the rest.
+    sigset_t sigint_set, old_set;
+    sigemptyset(&sigint_set);
+    sigaddset(&sigint_set, SIGINT);
+    sigaddset(&sigint_set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &sigint_set, &old_set);
+    for (; num_started < num_workers; num_started++) {
+        errno = pthread_create(&workers[num_started].thread, NULL, run_worker,
+                               &workers[num_started]);
+        if (errno != 0) {
+            fprintf(stderr, "Error: Failed to start worker %d. %s.\n",
+                    num_started, strerror(errno));
+            stop_workers();
+            retval = EXIT_FAILURE;
+            break;
         }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    action.sa_handler = catch_signal;
+    if (atomic_load(&running) && sigaction(SIGUSR2, &action, NULL) == -1) {
+        log_printf(LOG_WARNING, "Warning: Failed to register signal handler. "
+                   "%s.", strerror(errno));
+    }
 
-        // Find and handle the client sockets sending messages.
-        for (int i = 0; running && i < MAX_CONNECTIONS; i++) {
-            // Important to check for open socket before FD_ISSET.
-            if (client_sockets[i] > -1 && 
-                FD_ISSET(client_sockets[i], &sockset)) {  
-                handle_client_socket(i);
-            }   
+    if (atomic_load(&running)) {
+        run_worker(&workers[0]);
+        retval = workers[0].retval;
+    }
+    stop_workers();
+    for (int i = 1; i < num_started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].retval == EXIT_FAILURE) {
+            retval = EXIT_FAILURE;
         }
     }
 
 EXIT:
-    cleanup();
+    // On a hot restart, the links to the other nodes were set aside before
+    // the workers stopped, and go over to the new process. Otherwise, no more
+    // messages come in from the other nodes once the history is freed, and
+    // they see the users of this one leave along with it.
+    if (handoff_fd >= 0) {
+        hand_off();
+    }
+    cluster_stop();
+    for (int i = 0; i < num_workers; i++) {
+        // Clients that were taken over by a worker that never started.
+        for (int j = 0; j < workers[i].num_parked; j++) {
+            if (workers[i].parked[j].fd != -1) {
+                close(workers[i].parked[j].fd);
+                free(workers[i].parked[j].data);
+            }
+        }
+        free(workers[i].parked);
+        if (workers[i].server_socket >= 0) {
+            close(workers[i].server_socket);
+        }
+        if (workers[i].wake_fd >= 0) {
+            close(workers[i].wake_fd);
+        }
+        struct inbox_node *node;
+        while ((node = inbox_pop(&workers[i].inbox))) {
+            message_unref(node->msg);
+            pool_put(node->pool, node);
+        }
+    }
+    // The new process accepts from the same Unix socket, so its path stays.
+    if (local_socket >= 0) {
+        close(local_socket);
+        if (handoff_fd < 0) {
+            unlink(local_socket_path);
+        }
+    }
+    journal_stop();
+    for (int i = 0; i < num_rooms; i++) {
+        for (unsigned j = 0; j < rooms[i]->history_count; j++) {
+            message_unref(rooms[i]->history[(rooms[i]->history_head + j) %
+                                            history_capacity]);
+        }
+        free(rooms[i]->history);
+        pthread_mutex_destroy(&rooms[i]->lock);
+        free(rooms[i]);
+    }
+    message_unref(cached_welcome);
+    free(roster);
+    free(users);
+    metrics_stop();
+    // Every message and node has been let go of, so the pools of the workers
+    // can be freed.
+    for (int i = 0; i < num_workers; i++) {
+        message_cache_destroy(&workers[i].messages);
+        pool_destroy(&workers[i].inbox_nodes);
+    }
+    pool_destroy(&remote_nodes);
+    free(workers);
+    log_stop();
     printf("\n");
-    print_date_time_header(stdout);
-    printf("Shutting down.\n");
+    // The new process opens the journal, the admin socket, and the log once
+    // this one has let go of them.
+    if (handoff_fd >= 0) {
+        handoff_send(handoff_fd, HANDOFF_END, NULL, 0, NULL, 0, -1);
+        close(handoff_fd);
+        log_printf(LOG_INFO, "Handed over to the new process.");
+        return retval;
+    }
+    log_printf(LOG_INFO, "Shutting down.");
     return retval;
 }
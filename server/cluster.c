@@ -0,0 +1,1748 @@
+/*******************************************************************************
+ * Name          : cluster.c
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Links the server to the other nodes of a cluster, so users
+ *                 connected to any node share the same rooms and roster.
+ ******************************************************************************/
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "cluster.h"
+#include "log.h"
+
+// Milliseconds between attempts to link to a node that could not be reached.
+#define CLUSTER_RETRY_INTERVAL 1000
+// Bytes a link may have waiting to be sent before the node at the other end
+// is taken to be stuck, and the link is dropped.
+#define CLUSTER_MAX_BACKLOG (64 * 1024 * 1024)
+// Most payload bytes that may wait for the thread of the cluster. Beyond
+// that, messages are dropped rather than letting memory grow without bound.
+// Users logging in and leaving are always kept.
+#define CLUSTER_MAX_PENDING (64 * 1024 * 1024)
+// Longest payload of a record taken from another node.
+#define CLUSTER_MAX_RECORD (16 * 1024 * 1024)
+// Bytes in a record before the payload: the length, the kind, and the
+// sequence number.
+#define CLUSTER_RECORD_HEADER 13
+// Bytes of a hello: the magic, the version, and the id of the node.
+#define CLUSTER_HELLO_LEN 20
+// Bytes read from a link at a time.
+#define CLUSTER_READ_SIZE 65536
+// Initial number of entries in a set of user names.
+#define CLUSTER_INITIAL_NAMES 64
+
+/**
+ * Kinds of records sent over a link.
+ */
+enum record_kind_t {
+    RECORD_HELLO = 1,  // Id of the node, sent first on every link.
+    RECORD_USERS,      // Users on the node, as of the last record numbered.
+    RECORD_LINE,       // Message sent to a room.
+    RECORD_DIRECT,     // Message sent to a single user.
+    RECORD_USER_ADD,   // User logged in.
+    RECORD_USER_REMOVE // User left.
+};
+
+/**
+ * Record waiting to be sent to the other nodes. A message is held by
+ * reference, so the payload is never copied until it goes out.
+ */
+struct cluster_entry {
+    struct cluster_entry *next;
+    unsigned char kind;
+    struct message *msg; // NULL for users logging in and leaving.
+    unsigned char name_len;
+    char name[];         // Room or user name.
+};
+
+/**
+ * Growable buffer of bytes.
+ */
+struct buffer {
+    char *data;
+    size_t len, capacity;
+};
+
+/**
+ * Set of user names, kept as an open-addressing hash table with linear
+ * probing, at most half full. Each name is stored after a byte holding its
+ * length, and empty entries are NULL.
+ */
+struct name_set {
+    char **names;
+    unsigned capacity, count;
+};
+
+/**
+ * Node at the other end of one or more links, in a slot that stays the same
+ * for as long as the node is linked. The users connected to it are kept, so
+ * they can be reported as gone when the node is.
+ */
+struct origin {
+    uint64_t id;       // 0 if the slot is free.
+    uint64_t last_seq; // Last record of the node handled.
+    bool synced;       // A snapshot of its users has come in.
+    int num_links;
+    struct name_set users;
+};
+
+/**
+ * Node this one links to, as listed when the server was started.
+ */
+struct peer {
+    char *address; // As it was given, for log lines.
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint64_t id;       // Id the node sent the last time it was linked, or 0.
+    uint64_t retry_at; // When to try linking to it again, in milliseconds.
+    bool linked;       // A link made to it is open.
+    bool is_self;      // It is this very node.
+    bool failing;      // Linking to it failed, and that has been logged.
+};
+
+/**
+ * TCP connection to another node, made to one of the peers or accepted from
+ * any node.
+ */
+struct link {
+    int fd;
+    int peer;        // Peer the link was made to, or -1 if it was accepted.
+    int origin;      // Node at the other end, or -1 until its hello is in.
+    bool connecting; // connect() has not completed yet.
+    bool dead;       // To be closed once the current pass is over.
+    char address[INET6_ADDRSTRLEN + 8];
+    struct buffer out, in;
+    size_t out_sent; // Bytes at the front of out already sent.
+};
+
+/**
+ * State of this node handed over to a new process on a hot restart, sent
+ * along with the listener. The users on this node follow.
+ */
+struct handoff_cluster {
+    uint64_t node_id;
+    uint64_t last_seq;
+};
+
+/**
+ * Peer whose id is known, handed over to a new process. Its address, as it
+ * was given, follows.
+ */
+struct handoff_peer {
+    uint64_t id;
+    bool is_self;
+};
+
+/**
+ * Node linked to, handed over to a new process. Its users follow.
+ */
+struct handoff_node {
+    uint64_t id;
+    uint64_t last_seq;
+    bool synced;
+};
+
+/**
+ * Link handed over to a new process, sent along with its socket. It is
+ * followed by what came in on it that has not been handled yet, then by
+ * what has not been sent on it yet.
+ */
+struct handoff_link {
+    uint64_t origin;
+    bool to_peer; // Made to the peer with the address of the link.
+    uint32_t in_len;
+    char address[INET6_ADDRSTRLEN + 8];
+};
+
+// Records pushed by the workers, newest first. The thread of the cluster
+// takes the whole list at once, so pushing never takes a lock. Records may
+// be pushed before the thread starts, and are sent once it does.
+static _Atomic(struct cluster_entry *) pending = NULL;
+static atomic_size_t pending_bytes = 0;
+// Number of messages thrown away because the thread fell too far behind.
+static atomic_ulong num_dropped = 0;
+static atomic_bool stopped = false;
+
+static pthread_t thread;
+static atomic_bool running = false;
+// Set when the thread is stopped for a hot restart, so it leaves the links
+// open for the new process.
+static bool suspending = false;
+// The thread sleeps in poll() on the eventfd along with its sockets. It is
+// only written to once per batch of records.
+static int wake_fd = -1;
+static atomic_bool wake_pending = false;
+static struct cluster_handlers handlers;
+
+// State of the links. Only the thread of the cluster touches it once it is
+// running.
+static uint64_t node_id;
+static int listen_fd = -1;
+static struct peer *peers = NULL;
+static int num_peers = 0;
+static struct link *links = NULL;
+static int num_links = 0, links_capacity = 0;
+static struct origin *origins = NULL;
+static int num_origins = 0;
+// Users connected to this node, for the snapshot that starts every link,
+// and the number of the last record sent.
+static struct name_set local_users;
+static uint64_t last_seq = 0;
+// Records taken from the workers in one pass, sent as a whole to every link.
+static struct buffer batch;
+// Peers whose ids the previous process knew, until the peers are looked up.
+static struct peer *adopted_peers = NULL;
+static int num_adopted_peers = 0;
+
+/**
+ * Returns the time of the monotonic clock in milliseconds.
+ */
+static uint64_t clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void put_u32(char *p, uint32_t value) {
+    value = htonl(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+static uint32_t get_u32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return ntohl(value);
+}
+
+static void put_u64(char *p, uint64_t value) {
+    put_u32(p, value >> 32);
+    put_u32(p + 4, (uint32_t)value);
+}
+
+static uint64_t get_u64(const char *p) {
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+/**
+ * Makes room for extra more bytes at the end of a buffer.
+ * Returns true on success, false if memory could not be allocated.
+ */
+static bool reserve(struct buffer *b, size_t extra) {
+    if (b->len + extra <= b->capacity) {
+        return true;
+    }
+    size_t capacity = b->capacity ? b->capacity : 4096;
+    while (capacity < b->len + extra) {
+        capacity *= 2;
+    }
+    char *data = realloc(b->data, capacity);
+    if (!data) {
+        return false;
+    }
+    b->data = data;
+    b->capacity = capacity;
+    return true;
+}
+
+/**
+ * Appends the header of a record with a payload of the given length to a
+ * buffer. Returns where the payload goes, or NULL if memory could not be
+ * allocated.
+ */
+static char *add_record(struct buffer *b, unsigned char kind, uint64_t seq,
+                        size_t payload_len) {
+    if (!reserve(b, CLUSTER_RECORD_HEADER + payload_len)) {
+        return NULL;
+    }
+    char *p = b->data + b->len;
+    put_u32(p, CLUSTER_RECORD_HEADER - 4 + payload_len);
+    p[4] = kind;
+    put_u64(p + 5, seq);
+    b->len += CLUSTER_RECORD_HEADER + payload_len;
+    return p + CLUSTER_RECORD_HEADER;
+}
+
+/**
+ * Hashes a name with FNV-1a.
+ */
+static unsigned hash_name(const char *name, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Returns the position of the name in the set if it is there. Otherwise,
+ * returns the position of the empty entry where it would go. The set must
+ * not be empty.
+ */
+static unsigned set_find(const struct name_set *s, const char *name,
+                         size_t len) {
+    unsigned mask = s->capacity - 1;
+    unsigned i = hash_name(name, len) & mask;
+    while (s->names[i] && ((unsigned char)s->names[i][0] != len ||
+                           memcmp(s->names[i] + 1, name, len) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static bool set_contains(const struct name_set *s, const char *name,
+                         size_t len) {
+    return s->capacity > 0 && s->names[set_find(s, name, len)];
+}
+
+/**
+ * Adds a name to the set. Returns true if it was added, false if it was
+ * there already or memory could not be allocated.
+ */
+static bool set_add(struct name_set *s, const char *name, size_t len) {
+    if (set_contains(s, name, len)) {
+        return false;
+    }
+    if ((s->count + 1) * 2 > s->capacity) {
+        unsigned capacity = s->capacity ? s->capacity * 2
+                                        : CLUSTER_INITIAL_NAMES;
+        char **names = calloc(capacity, sizeof(char *));
+        if (!names) {
+            goto FAIL;
+        }
+        struct name_set grown = { names, capacity, s->count };
+        for (unsigned i = 0; i < s->capacity; i++) {
+            if (s->names[i]) {
+                grown.names[set_find(&grown, s->names[i] + 1,
+                                     (unsigned char)s->names[i][0])] =
+                    s->names[i];
+            }
+        }
+        free(s->names);
+        *s = grown;
+    }
+    char *entry = malloc(len + 1);
+    if (!entry) {
+        goto FAIL;
+    }
+    entry[0] = len;
+    memcpy(entry + 1, name, len);
+    s->names[set_find(s, name, len)] = entry;
+    s->count++;
+    return true;
+
+FAIL:
+    log_printf(LOG_WARNING, "Warning: Failed to keep track of user '%.*s'. "
+               "%s.", (int)len, name, strerror(errno));
+    return false;
+}
+
+/**
+ * Removes a name from the set. The entries after it in the same run are
+ * moved back into the gap where they can be, so no markers are left behind.
+ * Returns true if it was removed, false if it was not there.
+ */
+static bool set_remove(struct name_set *s, const char *name, size_t len) {
+    if (!set_contains(s, name, len)) {
+        return false;
+    }
+    unsigned mask = s->capacity - 1;
+    unsigned i = set_find(s, name, len);
+    free(s->names[i]);
+    for (unsigned j = (i + 1) & mask; s->names[j]; j = (j + 1) & mask) {
+        unsigned home = hash_name(s->names[j] + 1,
+                                  (unsigned char)s->names[j][0]) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            s->names[i] = s->names[j];
+            i = j;
+        }
+    }
+    s->names[i] = NULL;
+    s->count--;
+    return true;
+}
+
+static void set_clear(struct name_set *s) {
+    for (unsigned i = 0; i < s->capacity; i++) {
+        free(s->names[i]);
+    }
+    free(s->names);
+    s->names = NULL;
+    s->capacity = s->count = 0;
+}
+
+/**
+ * Returns the number of bytes the names in the set take up when each is
+ * written after a byte holding its length.
+ */
+static size_t names_size(const struct name_set *s) {
+    size_t size = 0;
+    for (unsigned i = 0; i < s->capacity; i++) {
+        if (s->names[i]) {
+            size += 1 + (unsigned char)s->names[i][0];
+        }
+    }
+    return size;
+}
+
+/**
+ * Writes the names in the set to dst, each after a byte holding its length.
+ */
+static void copy_names(const struct name_set *s, char *dst) {
+    for (unsigned i = 0; i < s->capacity; i++) {
+        if (s->names[i]) {
+            size_t len = 1 + (unsigned char)s->names[i][0];
+            memcpy(dst, s->names[i], len);
+            dst += len;
+        }
+    }
+}
+
+/**
+ * Reads names, each after a byte holding its length, into an empty set.
+ * Returns false if they are malformed, in which case the set is left empty.
+ */
+static bool read_names(struct name_set *s, const char *p, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t name_len = (unsigned char)p[pos];
+        if (pos + 1 + name_len > len) {
+            set_clear(s);
+            return false;
+        }
+        set_add(s, p + pos + 1, name_len);
+        pos += 1 + name_len;
+    }
+    return true;
+}
+
+/**
+ * Returns a random id for this node. It is never 0, which marks a free slot
+ * of the table of nodes.
+ */
+static uint64_t random_id() {
+    uint64_t id = 0;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+        id = (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid() ^ clock_ms();
+    }
+    return id ? id : 1;
+}
+
+/**
+ * Wakes up the thread of the cluster, unless a wake-up is already
+ * outstanding.
+ */
+static void wake_thread() {
+    if (!atomic_exchange(&wake_pending, true) && wake_fd >= 0) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            log_printf(LOG_WARNING, "Warning: Failed to wake up the cluster. "
+                       "%s.", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Pushes a record for the other nodes onto the list of pending records.
+ */
+static void push_entry(unsigned char kind, const char *name,
+                       struct message *msg) {
+    if (atomic_load_explicit(&stopped, memory_order_relaxed)) {
+        return;
+    }
+    size_t len = msg ? msg->header_len + msg->body_len : 0;
+    if (msg && atomic_fetch_add(&pending_bytes, len) + len >
+            CLUSTER_MAX_PENDING) {
+        atomic_fetch_sub(&pending_bytes, len);
+        atomic_fetch_add(&num_dropped, 1);
+        return;
+    }
+    size_t name_len = strlen(name);
+    struct cluster_entry *e = malloc(sizeof(struct cluster_entry) + name_len);
+    if (!e) {
+        if (msg) {
+            atomic_fetch_sub(&pending_bytes, len);
+            atomic_fetch_add(&num_dropped, 1);
+        } else {
+            log_printf(LOG_WARNING, "Warning: Failed to tell the cluster "
+                       "about user '%s'. %s.", name, strerror(errno));
+        }
+        return;
+    }
+    e->kind = kind;
+    e->msg = msg ? message_ref(msg) : NULL;
+    e->name_len = name_len;
+    memcpy(e->name, name, name_len);
+    e->next = atomic_load_explicit(&pending, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak(&pending, &e->next, e));
+    wake_thread();
+}
+
+/**
+ * Sends a message broadcast to a room on this node to the other nodes.
+ */
+void cluster_publish_line(const char *room, struct message *msg) {
+    push_entry(RECORD_LINE, room, msg);
+}
+
+/**
+ * Sends a message to a user connected to another node. Every node gets it,
+ * and the one the user is on delivers it.
+ */
+void cluster_publish_direct(const char *name, struct message *msg) {
+    push_entry(RECORD_DIRECT, name, msg);
+}
+
+/**
+ * Tells the other nodes that a user logged in to this node or left it.
+ */
+void cluster_publish_user(const char *name, bool present) {
+    push_entry(present ? RECORD_USER_ADD : RECORD_USER_REMOVE, name, NULL);
+}
+
+/**
+ * Adds a record pending from the workers to the batch, numbered as the next
+ * record of this node.
+ */
+static void add_entry(struct cluster_entry *e) {
+    if (e->kind == RECORD_USER_ADD) {
+        // A user the other nodes know about already, such as one taken over
+        // from the previous process, is not announced again.
+        if (set_contains(&local_users, e->name, e->name_len)) {
+            return;
+        }
+        set_add(&local_users, e->name, e->name_len);
+    } else if (e->kind == RECORD_USER_REMOVE) {
+        set_remove(&local_users, e->name, e->name_len);
+    }
+    size_t text_len = e->msg ? e->msg->header_len + e->msg->body_len : 0;
+    size_t payload_len = 1 + e->name_len + (e->msg ? 1 + text_len : 0);
+    char *p = add_record(&batch, e->kind, last_seq + 1, payload_len);
+    if (!p) {
+        log_printf(LOG_WARNING, "Warning: Failed to send a record to the "
+                   "cluster. %s.", strerror(errno));
+        return;
+    }
+    last_seq++;
+    *p++ = e->name_len;
+    memcpy(p, e->name, e->name_len);
+    p += e->name_len;
+    if (e->msg) {
+        *p++ = e->msg->type;
+        memcpy(p, e->msg->header, e->msg->header_len);
+        memcpy(p + e->msg->header_len, e->msg->body, e->msg->body_len);
+    }
+}
+
+/**
+ * Marks a link as failed. A link to a peer that keeps failing is only
+ * logged the first time.
+ */
+static void fail_link(struct link *l, const char *what, int error) {
+    l->dead = true;
+    if (l->peer >= 0 && l->origin < 0) {
+        if (peers[l->peer].failing) {
+            return;
+        }
+        peers[l->peer].failing = true;
+    }
+    if (error) {
+        log_printf(LOG_WARNING, "Warning: %s node %s. %s.", what, l->address,
+                   strerror(error));
+    } else {
+        log_printf(LOG_WARNING, "Warning: %s node %s.", what, l->address);
+    }
+}
+
+/**
+ * Adds bytes to the data waiting to be sent on a link. A node that has let
+ * too much pile up is dropped rather than holding up the rest.
+ */
+static void queue_output(struct link *l, const char *data, size_t len) {
+    if (l->dead) {
+        return;
+    }
+    if (l->out.len - l->out_sent + len > CLUSTER_MAX_BACKLOG) {
+        fail_link(l, "Dropped the link to slow", 0);
+        return;
+    }
+    if (l->out_sent > 0) {
+        memmove(l->out.data, l->out.data + l->out_sent,
+                l->out.len - l->out_sent);
+        l->out.len -= l->out_sent;
+        l->out_sent = 0;
+    }
+    if (!reserve(&l->out, len)) {
+        fail_link(l, "Failed to queue data for", errno);
+        return;
+    }
+    memcpy(l->out.data + l->out.len, data, len);
+    l->out.len += len;
+}
+
+/**
+ * Sends as much of the data waiting on a link as the socket takes.
+ */
+static void flush_link(struct link *l) {
+    while (!l->dead && l->out_sent < l->out.len) {
+        ssize_t n = send(l->fd, l->out.data + l->out_sent,
+                         l->out.len - l->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fail_link(l, "Failed to send to", errno);
+            }
+            return;
+        }
+        l->out_sent += n;
+    }
+    if (l->out_sent == l->out.len) {
+        l->out.len = l->out_sent = 0;
+    }
+}
+
+/**
+ * Takes the records pushed by the workers, in the order they were pushed,
+ * and sends them to every node in a single batch.
+ */
+static void take_pending() {
+    struct cluster_entry *list = atomic_exchange(&pending, NULL);
+    // The list is newest first, so reverse it.
+    struct cluster_entry *ordered = NULL;
+    while (list) {
+        struct cluster_entry *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    batch.len = 0;
+    while (ordered) {
+        struct cluster_entry *e = ordered;
+        ordered = e->next;
+        add_entry(e);
+        if (e->msg) {
+            atomic_fetch_sub(&pending_bytes,
+                             e->msg->header_len + e->msg->body_len);
+            message_unref(e->msg);
+        }
+        free(e);
+    }
+    if (batch.len > 0) {
+        for (int i = 0; i < num_links; i++) {
+            if (!links[i].connecting) {
+                queue_output(&links[i], batch.data, batch.len);
+            }
+        }
+    }
+    unsigned long dropped = atomic_exchange(&num_dropped, 0);
+    if (dropped > 0) {
+        log_printf(LOG_WARNING, "Warning: Dropped %lu messages for the "
+                   "cluster, which fell behind.", dropped);
+    }
+}
+
+/**
+ * Starts sending on a link once it is connected: the hello, then the users
+ * on this node as of the last record sent. Every record after that goes out
+ * on all links alike.
+ */
+static void start_link(struct link *l) {
+    int one = 1;
+    setsockopt(l->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    char *p = add_record(&l->out, RECORD_HELLO, 0, CLUSTER_HELLO_LEN);
+    char *q = p ? add_record(&l->out, RECORD_USERS, last_seq,
+                             names_size(&local_users))
+                : NULL;
+    if (!q) {
+        fail_link(l, "Failed to greet", errno);
+        return;
+    }
+    // The snapshot may have moved the buffer.
+    p = q - CLUSTER_RECORD_HEADER - CLUSTER_HELLO_LEN;
+    memcpy(p, CLUSTER_MAGIC, 8);
+    put_u32(p + 8, CLUSTER_VERSION);
+    put_u64(p + 12, node_id);
+    copy_names(&local_users, q);
+    flush_link(l);
+}
+
+/**
+ * Adds a link over the given socket to the table of links.
+ * Returns the link, or NULL if memory could not be allocated, in which case
+ * the socket is closed.
+ */
+static struct link *add_link(int fd, int peer, const char *address) {
+    if (num_links == links_capacity) {
+        int capacity = links_capacity ? links_capacity * 2 : 8;
+        struct link *grown = realloc(links, capacity * sizeof(struct link));
+        if (!grown) {
+            log_printf(LOG_WARNING, "Warning: Failed to link to node %s. %s.",
+                       address, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        links = grown;
+        links_capacity = capacity;
+    }
+    struct link *l = &links[num_links++];
+    memset(l, 0, sizeof(struct link));
+    l->fd = fd;
+    l->peer = peer;
+    l->origin = -1;
+    snprintf(l->address, sizeof(l->address), "%s", address);
+    return l;
+}
+
+/**
+ * Forgets a node that is no longer linked. Its users are reported as gone.
+ */
+static void drop_origin(int slot) {
+    struct origin *o = &origins[slot];
+    log_printf(LOG_INFO, "Node %016" PRIx64 " left the cluster with %u "
+               "users.", o->id, o->users.count);
+    for (unsigned i = 0; i < o->users.capacity; i++) {
+        if (o->users.names[i] && handlers.user) {
+            handlers.user(o->users.names[i] + 1,
+                          (unsigned char)o->users.names[i][0], slot, false);
+        }
+    }
+    set_clear(&o->users);
+    o->id = 0;
+    o->last_seq = 0;
+    o->synced = false;
+}
+
+/**
+ * Closes the link in the given slot of the table and moves the last link
+ * into its place. A peer is tried again a while later.
+ */
+static void close_link(int i) {
+    struct link *l = &links[i];
+    close(l->fd);
+    if (l->peer >= 0) {
+        peers[l->peer].linked = false;
+        peers[l->peer].retry_at = clock_ms() + CLUSTER_RETRY_INTERVAL;
+    }
+    if (l->origin >= 0) {
+        log_printf(LOG_INFO, "Lost link to node %s.", l->address);
+        if (--origins[l->origin].num_links == 0) {
+            drop_origin(l->origin);
+        }
+    }
+    free(l->out.data);
+    free(l->in.data);
+    links[i] = links[--num_links];
+}
+
+/**
+ * Closes every link without a word to the nodes at the other end or to the
+ * handlers, once the thread of the cluster is done with them.
+ */
+static void discard_links() {
+    for (int i = 0; i < num_links; i++) {
+        close(links[i].fd);
+        free(links[i].out.data);
+        free(links[i].in.data);
+    }
+    num_links = 0;
+}
+
+/**
+ * Closes the links that failed during the current pass.
+ */
+static void sweep_links() {
+    for (int i = num_links - 1; i >= 0; i--) {
+        if (links[i].dead) {
+            close_link(i);
+        }
+    }
+}
+
+/**
+ * Returns the slot of the node with the given id, or -1 if it is not linked.
+ */
+static int lookup_origin(uint64_t id) {
+    for (int i = 0; i < num_origins; i++) {
+        if (origins[i].id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns the slot of the node with the given id, taking a free slot for a
+ * node not seen before, or -1 if memory could not be allocated.
+ */
+static int find_origin(uint64_t id) {
+    int slot = lookup_origin(id);
+    if (slot >= 0) {
+        return slot;
+    }
+    for (int i = 0; i < num_origins && slot < 0; i++) {
+        if (origins[i].id == 0) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        struct origin *grown =
+            realloc(origins, (num_origins + 1) * sizeof(struct origin));
+        if (!grown) {
+            return -1;
+        }
+        origins = grown;
+        slot = num_origins++;
+    }
+    memset(&origins[slot], 0, sizeof(struct origin));
+    origins[slot].id = id;
+    return slot;
+}
+
+/**
+ * Handles the hello that opens a link. Two nodes that both list each other
+ * make a link each, and only one of them is kept: the one made by the node
+ * with the lower id, so both ends drop the same one.
+ * Returns false if the link is to be closed.
+ */
+static bool greet(struct link *l, uint64_t id) {
+    if (id == node_id) {
+        // A node may be listed along with the others it links to.
+        if (l->peer >= 0) {
+            peers[l->peer].is_self = true;
+        }
+        l->dead = true;
+        return false;
+    }
+    if (l->peer >= 0) {
+        peers[l->peer].id = id;
+        peers[l->peer].failing = false;
+    }
+    int slot = find_origin(id);
+    if (slot < 0) {
+        fail_link(l, "Failed to keep track of", errno);
+        return false;
+    }
+    uint64_t made_by = l->peer >= 0 ? node_id : id;
+    for (int i = 0; i < num_links; i++) {
+        struct link *other = &links[i];
+        if (other == l || other->dead || other->origin != slot) {
+            continue;
+        }
+        if (made_by < (other->peer >= 0 ? node_id : id)) {
+            // The node stays linked through this link instead.
+            other->dead = true;
+            other->origin = -1;
+            origins[slot].num_links--;
+        } else {
+            l->dead = true;
+            return false;
+        }
+    }
+    l->origin = slot;
+    if (origins[slot].num_links++ == 0) {
+        log_printf(LOG_INFO, "Linked to node %s with id %016" PRIx64 ".",
+                   l->address, id);
+    }
+    return true;
+}
+
+/**
+ * Reports the users of a node that changed between the set known so far and
+ * a snapshot of them.
+ */
+static void report_changes(int slot, const struct name_set *from,
+                           const struct name_set *to, bool present) {
+    for (unsigned i = 0; i < to->capacity; i++) {
+        const char *name = to->names[i];
+        if (name && !set_contains(from, name + 1, (unsigned char)name[0]) &&
+                handlers.user) {
+            handlers.user(name + 1, (unsigned char)name[0], slot, present);
+        }
+    }
+}
+
+/**
+ * Takes in the users of a node as of the record with the given number. A
+ * snapshot older than what is known already is ignored. Users missing from
+ * it are reported as gone, then new ones as present.
+ * Returns false if the snapshot is malformed.
+ */
+static bool take_snapshot(struct link *l, uint64_t seq, const char *p,
+                          size_t len) {
+    struct origin *o = &origins[l->origin];
+    if (o->synced && seq <= o->last_seq) {
+        return true;
+    }
+    struct name_set snapshot = { NULL, 0, 0 };
+    if (!read_names(&snapshot, p, len)) {
+        return false;
+    }
+    if (o->synced) {
+        log_printf(LOG_WARNING, "Warning: Missed %" PRIu64 " records from "
+                   "node %s.", seq - o->last_seq, l->address);
+    }
+    report_changes(l->origin, &snapshot, &o->users, false);
+    report_changes(l->origin, &o->users, &snapshot, true);
+    set_clear(&o->users);
+    o->users = snapshot;
+    o->last_seq = seq;
+    o->synced = true;
+    return true;
+}
+
+/**
+ * Handles a record that came in on a link. A record of a node that already
+ * came in on another link is ignored.
+ * Returns false if the link is to be closed.
+ */
+static bool handle_record(struct link *l, unsigned char kind, uint64_t seq,
+                          const char *p, size_t len) {
+    if (l->origin < 0) {
+        if (kind != RECORD_HELLO || len < CLUSTER_HELLO_LEN ||
+                memcmp(p, CLUSTER_MAGIC, 8) != 0) {
+            fail_link(l, "Got no hello from", 0);
+            return false;
+        }
+        if (get_u32(p + 8) != CLUSTER_VERSION) {
+            fail_link(l, "Cannot speak the version of", 0);
+            return false;
+        }
+        return greet(l, get_u64(p + 12));
+    }
+    if (kind == RECORD_USERS) {
+        return take_snapshot(l, seq, p, len);
+    }
+    struct origin *o = &origins[l->origin];
+    if (kind == RECORD_HELLO || seq <= o->last_seq) {
+        return true;
+    }
+    if (seq > o->last_seq + 1) {
+        log_printf(LOG_WARNING, "Warning: Missed %" PRIu64 " records from "
+                   "node %s.", seq - o->last_seq - 1, l->address);
+    }
+    o->last_seq = seq;
+    // Every record after the hello starts with a room or user name.
+    size_t name_len = len > 0 ? (unsigned char)p[0] : 0;
+    if (len == 0 || 1 + name_len > len) {
+        return false;
+    }
+    const char *name = p + 1;
+    const char *text = name + name_len + 1;
+    size_t text_len = len - name_len - 2;
+    switch (kind) {
+        case RECORD_LINE:
+        case RECORD_DIRECT:
+            if (2 + name_len > len) {
+                return false;
+            }
+            if (kind == RECORD_LINE && handlers.line) {
+                handlers.line(name, name_len, text[-1], text, text_len);
+            } else if (kind == RECORD_DIRECT && handlers.direct) {
+                handlers.direct(name, name_len, text[-1], text, text_len);
+            }
+            break;
+        case RECORD_USER_ADD:
+            if (set_add(&o->users, name, name_len) && handlers.user) {
+                handlers.user(name, name_len, l->origin, true);
+            }
+            break;
+        case RECORD_USER_REMOVE:
+            if (set_remove(&o->users, name, name_len) && handlers.user) {
+                handlers.user(name, name_len, l->origin, false);
+            }
+            break;
+        default:
+            // Kinds added by later versions are skipped.
+            break;
+    }
+    return true;
+}
+
+/**
+ * Reads what has come in on a link and handles every complete record.
+ */
+static void read_link(struct link *l) {
+    if (!reserve(&l->in, CLUSTER_READ_SIZE)) {
+        fail_link(l, "Failed to read from", errno);
+        return;
+    }
+    ssize_t n = recv(l->fd, l->in.data + l->in.len, CLUSTER_READ_SIZE, 0);
+    if (n <= 0) {
+        if (n == 0) {
+            l->dead = true;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            fail_link(l, "Failed to read from", errno);
+        }
+        return;
+    }
+    l->in.len += n;
+    size_t pos = 0;
+    while (!l->dead && l->in.len - pos >= 4) {
+        uint32_t len = get_u32(l->in.data + pos);
+        if (len < CLUSTER_RECORD_HEADER - 4 ||
+                len > CLUSTER_RECORD_HEADER - 4 + CLUSTER_MAX_RECORD) {
+            fail_link(l, "Got a malformed record from", 0);
+            return;
+        }
+        if (l->in.len - pos < 4 + (size_t)len) {
+            break;
+        }
+        const char *r = l->in.data + pos;
+        if (!handle_record(l, r[4], get_u64(r + 5), r + CLUSTER_RECORD_HEADER,
+                           len - (CLUSTER_RECORD_HEADER - 4)) && !l->dead) {
+            fail_link(l, "Got a malformed record from", 0);
+        }
+        pos += 4 + len;
+    }
+    memmove(l->in.data, l->in.data + pos, l->in.len - pos);
+    l->in.len -= pos;
+}
+
+/**
+ * Starts linking to a peer. The connection is completed by the event loop.
+ */
+static void connect_peer(int i) {
+    struct peer *p = &peers[i];
+    p->retry_at = clock_ms() + CLUSTER_RETRY_INTERVAL;
+    int fd = socket(p->addr.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        if (!p->failing) {
+            p->failing = true;
+            log_printf(LOG_WARNING, "Warning: Failed to link to node %s. %s.",
+                       p->address, strerror(errno));
+        }
+        return;
+    }
+    struct link *l = add_link(fd, i, p->address);
+    if (!l) {
+        return;
+    }
+    p->linked = true;
+    if (connect(fd, (struct sockaddr *)&p->addr, p->addr_len) == 0) {
+        start_link(l);
+    } else if (errno == EINPROGRESS) {
+        l->connecting = true;
+    } else {
+        fail_link(l, "Failed to link to", errno);
+    }
+}
+
+/**
+ * Links to every peer that is due to be tried. A peer already linked to
+ * through a link it made itself is left alone.
+ * Returns how many milliseconds until the next peer is due, or -1 if none is.
+ */
+static int link_peers() {
+    uint64_t now = clock_ms();
+    int timeout = -1;
+    for (int i = 0; i < num_peers; i++) {
+        struct peer *p = &peers[i];
+        if (p->linked || p->is_self) {
+            continue;
+        }
+        if (p->id != 0 && lookup_origin(p->id) >= 0) {
+            continue;
+        }
+        if (p->retry_at <= now) {
+            connect_peer(i);
+        } else if (timeout < 0 || p->retry_at - now < (uint64_t)timeout) {
+            timeout = p->retry_at - now;
+        }
+    }
+    return timeout;
+}
+
+/**
+ * Completes a connection to a peer, once poll() says it is done one way or
+ * the other.
+ */
+static void finish_connect(struct link *l) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+        error = errno;
+    }
+    if (error) {
+        fail_link(l, "Failed to link to", error);
+        return;
+    }
+    l->connecting = false;
+    start_link(l);
+}
+
+/**
+ * Accepts every link waiting on the listener.
+ */
+static void accept_links() {
+    while (true) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept(listen_fd, (struct sockaddr *)&addr, &addr_len);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_printf(LOG_WARNING, "Warning: Failed to accept a link. "
+                           "%s.", strerror(errno));
+            }
+            return;
+        }
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+                fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+            log_printf(LOG_WARNING, "Warning: Failed to accept a link. %s.",
+                       strerror(errno));
+            close(fd);
+            continue;
+        }
+        char host[INET6_ADDRSTRLEN], port[8], address[INET6_ADDRSTRLEN + 8];
+        if (getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof(host),
+                        port, sizeof(port),
+                        NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+            strcpy(host, "?");
+            strcpy(port, "?");
+        }
+        snprintf(address, sizeof(address), "%s:%s", host, port);
+        struct link *l = add_link(fd, -1, address);
+        if (l) {
+            start_link(l);
+        }
+    }
+}
+
+/**
+ * Body of the thread of the cluster. Sends the records of this node to
+ * every link in batches, and hands the records of the other nodes to the
+ * handlers.
+ */
+static void *run_cluster(void *arg) {
+    if (handlers.on_start) {
+        handlers.on_start();
+    }
+    // The users of the nodes taken over from the previous process are all
+    // there is to go on until more records come in from them.
+    for (int i = 0; i < num_origins; i++) {
+        struct name_set *users = &origins[i].users;
+        for (unsigned j = 0; j < users->capacity; j++) {
+            if (users->names[j] && handlers.user) {
+                handlers.user(users->names[j] + 1,
+                              (unsigned char)users->names[j][0], i, true);
+            }
+        }
+    }
+    struct pollfd *fds = NULL;
+    int fds_capacity = 0;
+    while (atomic_load(&running)) {
+        // Clear the flag before taking the records, so a record pushed from
+        // now on triggers another wake-up.
+        atomic_store(&wake_pending, false);
+        take_pending();
+        int timeout = link_peers();
+        for (int i = 0; i < num_links; i++) {
+            if (!links[i].connecting) {
+                flush_link(&links[i]);
+            }
+        }
+        sweep_links();
+        if (num_links + 2 > fds_capacity) {
+            int capacity = (num_links + 2) * 2;
+            struct pollfd *grown =
+                realloc(fds, capacity * sizeof(struct pollfd));
+            if (!grown) {
+                log_printf(LOG_WARNING, "Warning: Failed to watch the links. "
+                           "%s.", strerror(errno));
+                continue;
+            }
+            fds = grown;
+            fds_capacity = capacity;
+        }
+        fds[0] = (struct pollfd) { .fd = wake_fd, .events = POLLIN };
+        fds[1] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+        int num_polled = num_links;
+        for (int i = 0; i < num_polled; i++) {
+            struct link *l = &links[i];
+            fds[i + 2].fd = l->fd;
+            fds[i + 2].events = l->connecting ? POLLOUT :
+                POLLIN | (l->out_sent < l->out.len ? POLLOUT : 0);
+            fds[i + 2].revents = 0;
+        }
+        if (poll(fds, num_polled + 2, timeout) <= 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) == -1 &&
+                    errno != EAGAIN) {
+                log_printf(LOG_WARNING, "Warning: Failed to read wake-up "
+                           "event. %s.", strerror(errno));
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            accept_links();
+        }
+        for (int i = 0; i < num_polled; i++) {
+            struct link *l = &links[i];
+            short revents = fds[i + 2].revents;
+            if (!revents || l->dead) {
+                continue;
+            }
+            if (l->connecting) {
+                finish_connect(l);
+                continue;
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_link(l);
+            }
+            if (revents & POLLOUT) {
+                flush_link(l);
+            }
+        }
+        sweep_links();
+    }
+    // Send what is left before letting go of the links, unless they are
+    // about to be handed over.
+    if (!suspending) {
+        take_pending();
+        for (int i = 0; i < num_links; i++) {
+            if (!links[i].connecting) {
+                flush_link(&links[i]);
+            }
+        }
+        while (num_links > 0) {
+            close_link(num_links - 1);
+        }
+    }
+    free(fds);
+    if (handlers.on_exit) {
+        handlers.on_exit();
+    }
+    return NULL;
+}
+
+/**
+ * Looks up the address of every peer in a comma-separated list of
+ * "host:port" entries. An IPv6 address goes in brackets.
+ * Returns true on success, false on failure.
+ */
+static bool resolve_peers(const char *list) {
+    char *copy = strdup(list);
+    if (!copy) {
+        return false;
+    }
+    bool ok = true;
+    char *save = NULL;
+    for (char *entry = strtok_r(copy, ",", &save); entry;
+         entry = strtok_r(NULL, ",", &save)) {
+        char *colon = strrchr(entry, ':');
+        if (!colon || colon == entry || colon[1] == '\0') {
+            log_printf(LOG_ERROR, "Error: Node '%s' is not host:port.",
+                       entry);
+            errno = EINVAL;
+            ok = false;
+            break;
+        }
+        struct peer *grown =
+            realloc(peers, (num_peers + 1) * sizeof(struct peer));
+        if (!grown) {
+            ok = false;
+            break;
+        }
+        peers = grown;
+        struct peer *p = &peers[num_peers];
+        memset(p, 0, sizeof(struct peer));
+        if (!(p->address = strdup(entry))) {
+            ok = false;
+            break;
+        }
+        num_peers++;
+        *colon = '\0';
+        char *host = entry;
+        size_t host_len = strlen(host);
+        if (host[0] == '[' && host[host_len - 1] == ']') {
+            host[host_len - 1] = '\0';
+            host++;
+        }
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int rc = getaddrinfo(host, colon + 1, &hints, &res);
+        if (rc != 0) {
+            log_printf(LOG_ERROR, "Error: Failed to look up node '%s'. %s.",
+                       p->address, gai_strerror(rc));
+            errno = EINVAL;
+            ok = false;
+            break;
+        }
+        memcpy(&p->addr, res->ai_addr, res->ai_addrlen);
+        p->addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+    free(copy);
+    return ok;
+}
+
+/**
+ * Frees the peers the previous process knew.
+ */
+static void free_adopted_peers() {
+    for (int i = 0; i < num_adopted_peers; i++) {
+        free(adopted_peers[i].address);
+    }
+    free(adopted_peers);
+    adopted_peers = NULL;
+    num_adopted_peers = 0;
+}
+
+/**
+ * Ties what was taken over from the previous process to the peers, once they
+ * are looked up. Peers are matched by address, so the ids the previous
+ * process learned and the links it made carry over. A node no link was
+ * handed over for is forgotten, as it would have been had the link closed.
+ */
+static void finish_take_over() {
+    for (int i = 0; i < num_peers; i++) {
+        for (int j = 0; j < num_adopted_peers; j++) {
+            if (strcmp(peers[i].address, adopted_peers[j].address) == 0) {
+                peers[i].id = adopted_peers[j].id;
+                peers[i].is_self = adopted_peers[j].is_self;
+            }
+        }
+    }
+    free_adopted_peers();
+    for (int i = 0; i < num_links; i++) {
+        struct link *l = &links[i];
+        if (l->peer < 0) {
+            continue;
+        }
+        l->peer = -1;
+        for (int j = 0; j < num_peers && l->peer < 0; j++) {
+            if (strcmp(peers[j].address, l->address) == 0) {
+                l->peer = j;
+                peers[j].linked = true;
+            }
+        }
+    }
+    for (int i = 0; i < num_origins; i++) {
+        if (origins[i].id != 0 && origins[i].num_links == 0) {
+            set_clear(&origins[i].users);
+            memset(&origins[i], 0, sizeof(struct origin));
+        }
+    }
+}
+
+/**
+ * Takes in a node listed to link to whose id the previous process knew.
+ * Returns true on success, false on failure with errno set.
+ */
+static bool take_peer(const char *p, size_t len) {
+    struct handoff_peer hp;
+    if (len < sizeof(struct handoff_peer)) {
+        errno = EPROTO;
+        return false;
+    }
+    memcpy(&hp, p, sizeof(struct handoff_peer));
+    struct peer *grown = realloc(adopted_peers,
+                                 (num_adopted_peers + 1) * sizeof(struct peer));
+    if (!grown) {
+        return false;
+    }
+    adopted_peers = grown;
+    struct peer *peer = &adopted_peers[num_adopted_peers];
+    memset(peer, 0, sizeof(struct peer));
+    if (!(peer->address = strndup(p + sizeof(struct handoff_peer),
+                                  len - sizeof(struct handoff_peer)))) {
+        return false;
+    }
+    peer->id = hp.id;
+    peer->is_self = hp.is_self;
+    num_adopted_peers++;
+    return true;
+}
+
+/**
+ * Takes in a node linked to by the previous process, and the users on it.
+ * Returns true on success, false on failure with errno set.
+ */
+static bool take_node(const char *p, size_t len) {
+    struct handoff_node n;
+    if (len < sizeof(struct handoff_node)) {
+        errno = EPROTO;
+        return false;
+    }
+    memcpy(&n, p, sizeof(struct handoff_node));
+    int slot = n.id != 0 ? find_origin(n.id) : -1;
+    if (slot < 0) {
+        if (n.id == 0) {
+            errno = EPROTO;
+        }
+        return false;
+    }
+    struct origin *o = &origins[slot];
+    o->last_seq = n.last_seq;
+    o->synced = n.synced;
+    set_clear(&o->users);
+    if (!read_names(&o->users, p + sizeof(struct handoff_node),
+                    len - sizeof(struct handoff_node))) {
+        errno = EPROTO;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Takes over a link from the previous process, with what came in on it that
+ * was not handled yet and what was not sent on it yet. The socket is closed
+ * on failure.
+ * Returns true on success, false on failure with errno set.
+ */
+static bool take_link(const char *p, size_t len, int fd) {
+    struct handoff_link hl;
+    if (len < sizeof(struct handoff_link)) {
+        close(fd);
+        errno = EPROTO;
+        return false;
+    }
+    memcpy(&hl, p, sizeof(struct handoff_link));
+    p += sizeof(struct handoff_link);
+    len -= sizeof(struct handoff_link);
+    hl.address[sizeof(hl.address) - 1] = '\0';
+    int slot = hl.origin != 0 && hl.in_len <= len ? find_origin(hl.origin)
+                                                  : -1;
+    if (slot < 0) {
+        close(fd);
+        if (hl.origin == 0 || hl.in_len > len) {
+            errno = EPROTO;
+        }
+        return false;
+    }
+    // The peer the link was made to is found once the peers are looked up.
+    struct link *l = add_link(fd, hl.to_peer ? 0 : -1, hl.address);
+    if (!l) {
+        return false;
+    }
+    l->origin = slot;
+    origins[slot].num_links++;
+    size_t out_len = len - hl.in_len;
+    if (!reserve(&l->in, hl.in_len) || !reserve(&l->out, out_len)) {
+        return false;
+    }
+    memcpy(l->in.data, p, hl.in_len);
+    l->in.len = hl.in_len;
+    memcpy(l->out.data, p + hl.in_len, out_len);
+    l->out.len = out_len;
+    return true;
+}
+
+/**
+ * Takes in part of the cluster handed over by the previous process, before
+ * the cluster starts. The file descriptor that came with the message, if
+ * any, is taken, and set to -1 in the message.
+ * Returns true on success, false on failure with errno set.
+ */
+bool cluster_take_over(struct handoff_msg *m) {
+    int fd = m->fd;
+    m->fd = -1;
+    if (m->kind == HANDOFF_CLUSTER_LINK && fd >= 0) {
+        return take_link(m->payload, m->len, fd);
+    }
+    // Only a link and the state of this node come with a descriptor.
+    if (fd >= 0 && m->kind != HANDOFF_CLUSTER) {
+        close(fd);
+        fd = -1;
+    }
+    if (m->kind == HANDOFF_CLUSTER_PEER) {
+        return take_peer(m->payload, m->len);
+    } else if (m->kind == HANDOFF_CLUSTER_NODE) {
+        return take_node(m->payload, m->len);
+    } else if (m->kind == HANDOFF_CLUSTER &&
+               m->len >= sizeof(struct handoff_cluster)) {
+        struct handoff_cluster c;
+        memcpy(&c, m->payload, sizeof(struct handoff_cluster));
+        node_id = c.node_id;
+        last_seq = c.last_seq;
+        if (fd >= 0) {
+            if (listen_fd >= 0) {
+                close(listen_fd);
+            }
+            listen_fd = fd;
+        }
+        set_clear(&local_users);
+        if (read_names(&local_users,
+                       m->payload + sizeof(struct handoff_cluster),
+                       m->len - sizeof(struct handoff_cluster))) {
+            return true;
+        }
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    errno = EPROTO;
+    return false;
+}
+
+/**
+ * Opens the socket other nodes link to on the given port.
+ * Returns true on success, false on failure with errno set.
+ */
+static bool open_listener(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    int one = 1;
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+                            SOCK_CLOEXEC, 0)) < 0) {
+        return false;
+    }
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one,
+                   sizeof(one)) < 0 ||
+            bind(listen_fd, (struct sockaddr *)&addr,
+                 sizeof(struct sockaddr_in)) < 0 ||
+            listen(listen_fd, SOMAXCONN) < 0) {
+        int saved = errno;
+        close(listen_fd);
+        listen_fd = -1;
+        errno = saved;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Joins the cluster. Other nodes link to this one on the given port, unless
+ * it is 0, and this one links to every node in the comma-separated list of
+ * peers, which may be NULL. Links that fail are tried again every second.
+ * Records published before the cluster starts are sent once it does.
+ * Returns true on success, false on failure with errno set.
+ */
+bool cluster_start(int port, const char *peer_list,
+                   const struct cluster_handlers *h) {
+    handlers = *h;
+    // A node taken over from the previous process keeps its id.
+    bool taken_over = node_id != 0;
+    if (!taken_over) {
+        node_id = random_id();
+    }
+    if (peer_list && !resolve_peers(peer_list)) {
+        goto FAIL;
+    }
+    finish_take_over();
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        goto FAIL;
+    }
+    // A listener taken over is only kept if it is on the same port.
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    if (listen_fd >= 0 &&
+            (getsockname(listen_fd, (struct sockaddr *)&addr,
+                         &addr_len) < 0 || ntohs(addr.sin_port) != port)) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if (port && listen_fd < 0 && !open_listener(port)) {
+        goto FAIL;
+    }
+    if (taken_over) {
+        log_printf(LOG_INFO, "Took over %d links to the cluster as node "
+                   "%016" PRIx64 ".", num_links, node_id);
+    } else {
+        log_printf(LOG_INFO, "Joining the cluster as node %016" PRIx64 ".",
+                   node_id);
+    }
+    atomic_store(&running, true);
+    // The thread never handles signals, so block them all while it starts.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = pthread_create(&thread, NULL, run_cluster, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        atomic_store(&running, false);
+        errno = rc;
+        goto FAIL;
+    }
+    return true;
+
+FAIL:;
+    int saved = errno;
+    cluster_stop();
+    errno = saved;
+    return false;
+}
+
+/**
+ * Stops the thread of the cluster, if it is running.
+ */
+static void stop_thread() {
+    if (atomic_load(&running)) {
+        atomic_store(&running, false);
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) == -1) {
+            log_printf(LOG_WARNING, "Warning: Failed to wake up the cluster. "
+                       "%s.", strerror(errno));
+        }
+        pthread_join(thread, NULL);
+    }
+}
+
+/**
+ * Stops the thread of the cluster on a hot restart, before the workers stop,
+ * so whatever it took in from the other nodes reaches the workers in time to
+ * be handed over. The links are left open for cluster_hand_off(), and what
+ * comes in on them from then on waits for the new process. Records published
+ * in the meantime are kept.
+ */
+void cluster_suspend() {
+    suspending = true;
+    stop_thread();
+}
+
+/**
+ * Sends a message made up of data followed by the names in a set to the new
+ * process. The file descriptor goes along with it, unless it is -1.
+ * Returns true on success, false on failure with errno set.
+ */
+static bool send_names(int sock, uint32_t kind, const void *data, size_t len,
+                       const struct name_set *s, int fd) {
+    size_t names_len = names_size(s);
+    char *names = malloc(names_len + 1);
+    if (!names) {
+        return false;
+    }
+    copy_names(s, names);
+    bool sent = handoff_send(sock, kind, data, len, names, names_len, fd);
+    free(names);
+    return sent;
+}
+
+/**
+ * Hands the links to the other nodes over to the new process after
+ * cluster_suspend(), along with all it takes to carry on where this process
+ * left off: the id of this node, the numbers of the last records sent and
+ * handled, and the users on every node. The other nodes see no difference.
+ * Records published since the thread stopped go out on the links first. A
+ * link with too much left on it to hand over is dropped instead, and linked
+ * again by one end or the other. The links are closed here either way.
+ * Returns true on success, false on failure with errno set.
+ */
+bool cluster_hand_off(int sock) {
+    take_pending();
+    struct handoff_cluster c = { node_id, last_seq };
+    bool sent = send_names(sock, HANDOFF_CLUSTER, &c,
+                           sizeof(struct handoff_cluster), &local_users,
+                           listen_fd);
+    for (int i = 0; sent && i < num_peers; i++) {
+        struct peer *p = &peers[i];
+        if (p->id != 0 || p->is_self) {
+            struct handoff_peer hp = { p->id, p->is_self };
+            sent = handoff_send(sock, HANDOFF_CLUSTER_PEER, &hp,
+                                sizeof(struct handoff_peer), p->address,
+                                strlen(p->address), -1);
+        }
+    }
+    for (int i = 0; sent && i < num_origins; i++) {
+        struct origin *o = &origins[i];
+        if (o->id != 0) {
+            struct handoff_node n = { o->id, o->last_seq, o->synced };
+            sent = send_names(sock, HANDOFF_CLUSTER_NODE, &n,
+                              sizeof(struct handoff_node), &o->users, -1);
+        }
+    }
+    for (int i = 0; sent && i < num_links; i++) {
+        struct link *l = &links[i];
+        // A link that is still being set up is made again.
+        if (l->connecting || l->dead || l->origin < 0) {
+            continue;
+        }
+        struct handoff_link hl;
+        memset(&hl, 0, sizeof(struct handoff_link));
+        hl.origin = origins[l->origin].id;
+        hl.to_peer = l->peer >= 0;
+        hl.in_len = l->in.len;
+        strcpy(hl.address, l->address);
+        // What is left to send goes right after what came in.
+        size_t out_len = l->out.len - l->out_sent;
+        if (!(sent = reserve(&l->in, out_len))) {
+            break;
+        }
+        memcpy(l->in.data + l->in.len, l->out.data + l->out_sent, out_len);
+        sent = handoff_send(sock, HANDOFF_CLUSTER_LINK, &hl,
+                            sizeof(struct handoff_link), l->in.data,
+                            l->in.len + out_len, l->fd);
+        if (!sent && errno == EMSGSIZE) {
+            log_printf(LOG_WARNING, "Warning: Dropped the link to node %s, "
+                       "which had too much left on it to hand over.",
+                       l->address);
+            sent = true;
+        }
+    }
+    discard_links();
+    return sent;
+}
+
+/**
+ * Sends the records still pending, closes every link, and stops the thread
+ * of the cluster. Users of the other nodes are reported as gone. Records
+ * published from then on are ignored. After cluster_suspend(), the links
+ * left are closed without a word.
+ */
+void cluster_stop() {
+    atomic_store(&stopped, true);
+    stop_thread();
+    discard_links();
+    free_adopted_peers();
+    // Records pushed before the thread ever started.
+    struct cluster_entry *e = atomic_exchange(&pending, NULL);
+    while (e) {
+        struct cluster_entry *next = e->next;
+        message_unref(e->msg);
+        free(e);
+        e = next;
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    for (int i = 0; i < num_peers; i++) {
+        free(peers[i].address);
+    }
+    free(peers);
+    peers = NULL;
+    num_peers = 0;
+    for (int i = 0; i < num_origins; i++) {
+        set_clear(&origins[i].users);
+    }
+    free(origins);
+    origins = NULL;
+    num_origins = 0;
+    free(links);
+    links = NULL;
+    links_capacity = 0;
+    set_clear(&local_users);
+    free(batch.data);
+    batch.data = NULL;
+    batch.len = batch.capacity = 0;
+}
@@ -0,0 +1,80 @@
+/*******************************************************************************
+ * Name          : cluster.h
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Links the server to the other nodes of a cluster, so users
+ *                 connected to any node share the same rooms and roster.
+ ******************************************************************************/
+#ifndef CLUSTER_H_
+#define CLUSTER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "handoff.h"
+#include "message.h"
+
+/*
+ * Every node of a cluster links to every other node over TCP. Both ends of
+ * a link send a stream of records, each made up of a 4-byte length of the
+ * rest of the record, a 1-byte kind, and an 8-byte sequence number, followed
+ * by the payload. Numbers are in network byte order. A link starts with a
+ * hello, whose payload is the 8 bytes "CHATNODE", a 4-byte version, and the
+ * 8-byte id of the node, then a snapshot of the users connected to the node.
+ * Every other record the node sends is numbered, in the order it was sent,
+ * and goes out on all of its links, so a record that comes in on more than
+ * one link is only handled once. On a hot restart, the links are handed over
+ * to the new process along with the clients, and it carries on with the same
+ * id and numbers, so the other nodes never notice.
+ */
+#define CLUSTER_MAGIC   "CHATNODE"
+#define CLUSTER_VERSION 1
+
+/**
+ * Called for every chat line sent in a room on another node. The text is the
+ * whole payload of the message.
+ */
+typedef void (*cluster_line_fn)(const char *room, size_t room_len,
+                                unsigned char type, const char *text,
+                                size_t len);
+/**
+ * Called for every message sent to a single user by a user on another node.
+ */
+typedef void (*cluster_direct_fn)(const char *name, size_t name_len,
+                                  unsigned char type, const char *text,
+                                  size_t len);
+/**
+ * Called whenever a user logs in to another node or leaves it. The node is a
+ * small number that stays the same for as long as the node is linked, and
+ * users on a node that is no longer linked are reported as gone.
+ */
+typedef void (*cluster_user_fn)(const char *name, size_t len, int node,
+                                bool present);
+/**
+ * Called on the thread of the cluster when it starts and right before it
+ * ends, so the handlers can set up state of their own on it.
+ */
+typedef void (*cluster_thread_fn)();
+
+/**
+ * Functions the records from other nodes are handed to. They are all called
+ * on the thread of the cluster. Any of them may be NULL.
+ */
+struct cluster_handlers {
+    cluster_line_fn line;
+    cluster_direct_fn direct;
+    cluster_user_fn user;
+    cluster_thread_fn on_start, on_exit;
+};
+
+bool cluster_start(int port, const char *peers,
+                   const struct cluster_handlers *handlers);
+void cluster_stop();
+void cluster_suspend();
+bool cluster_hand_off(int sock);
+bool cluster_take_over(struct handoff_msg *m);
+void cluster_publish_line(const char *room, struct message *msg);
+void cluster_publish_direct(const char *name, struct message *msg);
+void cluster_publish_user(const char *name, bool present);
+
+#endif
@@ -0,0 +1,286 @@
+/*******************************************************************************
+ * Name          : handoff.c
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Hands the sockets and state of a running server over to a
+ *                 new process of the server, through a Unix socket.
+ ******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "handoff.h"
+
+extern char **environ;
+
+/**
+ * Closes every file descriptor from first on in a child that is about to
+ * exec. Only async-signal-safe calls are made.
+ */
+static void close_from(int first) {
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, first, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+    struct rlimit limit;
+    int last = getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+               limit.rlim_cur < 65536 ? (int)limit.rlim_cur : 65536;
+    for (int fd = first; fd < last; fd++) {
+        close(fd);
+    }
+}
+
+/**
+ * Starts a new process of the server with the given arguments, connected to
+ * this one by a Unix socket. The new process finds its end of the socket at
+ * HANDOFF_CHILD_FD, and nothing else this process has open, so the sockets
+ * of the clients are only ever held by processes that know about them.
+ * Returns this end of the socket, or -1 on failure with errno set.
+ */
+int handoff_spawn(char *const argv[], pid_t *pid) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        return -1;
+    }
+    // The environment of the new process is put together before the fork,
+    // since the child may only make async-signal-safe calls.
+    char setting[sizeof(HANDOFF_ENV) + 16];
+    snprintf(setting, sizeof(setting), "%s=%d", HANDOFF_ENV,
+             HANDOFF_CHILD_FD);
+    size_t count = 0;
+    while (environ[count]) {
+        count++;
+    }
+    char **env = malloc((count + 2) * sizeof(char *));
+    if (!env) {
+        goto FAIL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], HANDOFF_ENV "=", sizeof(HANDOFF_ENV)) != 0) {
+            env[n++] = environ[i];
+        }
+    }
+    env[n++] = setting;
+    env[n] = NULL;
+    if ((*pid = fork()) == -1) {
+        free(env);
+        goto FAIL;
+    }
+    if (*pid == 0) {
+        // dup2() clears close-on-exec on the copy, but does nothing if the
+        // descriptor is already where it has to be.
+        if (fds[1] == HANDOFF_CHILD_FD) {
+            fcntl(fds[1], F_SETFD, 0);
+        } else if (dup2(fds[1], HANDOFF_CHILD_FD) < 0) {
+            _exit(127);
+        }
+        close_from(HANDOFF_CHILD_FD + 1);
+        environ = env;
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    free(env);
+    close(fds[1]);
+    return fds[0];
+
+FAIL:;
+    int saved_errno = errno;
+    close(fds[0]);
+    close(fds[1]);
+    errno = saved_errno;
+    return -1;
+}
+
+/**
+ * Returns the socket leading back to the process this one takes over from,
+ * or -1 if the process was started from scratch.
+ */
+int handoff_inherit() {
+    const char *value = getenv(HANDOFF_ENV);
+    if (!value) {
+        return -1;
+    }
+    int fd = atoi(value);
+    unsetenv(HANDOFF_ENV);
+    if (fd < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Sends a message made up of data followed by extra, either of which may be
+ * empty, to the other process. The file descriptor goes along with it,
+ * unless it is -1. Blocks until the whole message has been sent.
+ * Returns true on success, false on failure with errno set.
+ */
+bool handoff_send(int sock, uint32_t kind, const void *data, size_t len,
+                  const void *extra, size_t extra_len, int fd) {
+    if (len + extra_len > HANDOFF_MAX_LEN) {
+        errno = EMSGSIZE;
+        return false;
+    }
+    uint32_t header[2] = { kind, len + extra_len };
+    struct iovec iov[3] = {
+        { header, sizeof(header) },
+        { (void *)data, len },
+        { (void *)extra, extra_len }
+    };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    size_t remaining = sizeof(header) + len + extra_len;
+    while (remaining > 0) {
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        remaining -= sent;
+        // The descriptor went out with the first part of the message.
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+/**
+ * Receives exactly len bytes, waiting at most timeout milliseconds for each
+ * part of them, or indefinitely if timeout is -1. A file descriptor that
+ * comes along is stored in *fd, and any more than one are closed.
+ * Returns true on success, false on failure with errno set.
+ */
+static bool recv_all(int sock, char *buf, size_t len, int timeout, int *fd) {
+    while (len > 0) {
+        if (timeout >= 0) {
+            struct pollfd p = { .fd = sock, .events = POLLIN };
+            int rc = poll(&p, 1, timeout);
+            if (rc == 0) {
+                errno = ETIMEDOUT;
+                return false;
+            }
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+        }
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(4 * sizeof(int))];
+        } control;
+        struct iovec iov = { buf, len };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET ||
+                    cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < num_fds; i++) {
+                int passed;
+                memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int),
+                       sizeof(int));
+                if (*fd == -1) {
+                    *fd = passed;
+                } else {
+                    close(passed);
+                }
+            }
+        }
+        if (n == 0) {
+            errno = EPIPE;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Receives the next message from the other process, waiting at most timeout
+ * milliseconds for each part of it, or indefinitely if timeout is -1. The
+ * caller frees the payload and owns the file descriptor, if there is one.
+ * Returns true on success, false on failure with errno set.
+ */
+bool handoff_recv(int sock, int timeout, struct handoff_msg *m) {
+    uint32_t header[2];
+    m->payload = NULL;
+    m->fd = -1;
+    if (!recv_all(sock, (char *)header, sizeof(header), timeout, &m->fd)) {
+        goto FAIL;
+    }
+    m->kind = header[0];
+    m->len = header[1];
+    if (m->len > HANDOFF_MAX_LEN) {
+        errno = EMSGSIZE;
+        goto FAIL;
+    }
+    // One more byte, so an empty payload is not a NULL one.
+    if (!(m->payload = malloc(m->len + 1)) ||
+            !recv_all(sock, m->payload, m->len, timeout, &m->fd)) {
+        goto FAIL;
+    }
+    return true;
+
+FAIL:;
+    int saved_errno = errno;
+    free(m->payload);
+    m->payload = NULL;
+    if (m->fd >= 0) {
+        close(m->fd);
+        m->fd = -1;
+    }
+    errno = saved_errno;
+    return false;
+}
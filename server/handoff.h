@@ -0,0 +1,60 @@
+/*******************************************************************************
+ * Name          : handoff.h
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Hands the sockets and state of a running server over to a
+ *                 new process of the server, through a Unix socket.
+ ******************************************************************************/
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Environment variable telling a new process of the server which of its file
+// descriptors leads back to the process it takes over from.
+#define HANDOFF_ENV "CHATSERVER_HANDOFF_FD"
+// File descriptor the new process finds its end of the socket at.
+#define HANDOFF_CHILD_FD 3
+// Longest payload of a single message.
+#define HANDOFF_MAX_LEN (64 << 20)
+
+/**
+ * Kinds of messages passed between the process handing its clients over and
+ * the one taking them over.
+ */
+enum handoff_kind_t {
+    HANDOFF_HELLO = 1, // The new process is ready, and the format it reads.
+    HANDOFF_LISTENER,  // Listening socket of a worker.
+    HANDOFF_CLIENT,    // Socket of a client and the state of the client.
+    HANDOFF_HISTORY,   // Chat line in the history of a room.
+    HANDOFF_END,       // Everything has been handed over.
+    // Kinds added later, after the ones every process knows about.
+    HANDOFF_LOCAL_LISTENER, // Unix socket local clients connect to.
+    HANDOFF_CLUSTER,        // Id of the node, its users, and its listener.
+    HANDOFF_CLUSTER_PEER,   // Node listed to link to, as far as it is known.
+    HANDOFF_CLUSTER_NODE,   // Node linked to, and the users on it.
+    HANDOFF_CLUSTER_LINK    // Link to another node, and the data left on it.
+};
+
+/**
+ * Message received from the other process. The payload is malloc'd, and the
+ * message may carry a file descriptor, or -1.
+ */
+struct handoff_msg {
+    uint32_t kind;
+    uint32_t len;
+    char *payload;
+    int fd;
+};
+
+int handoff_spawn(char *const argv[], pid_t *pid);
+int handoff_inherit();
+bool handoff_send(int sock, uint32_t kind, const void *data, size_t len,
+                  const void *extra, size_t extra_len, int fd);
+bool handoff_recv(int sock, int timeout, struct handoff_msg *m);
+
+#endif
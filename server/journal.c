@@ -0,0 +1,535 @@
+/*******************************************************************************
+ * Name          : journal.c
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Append-only journal of the chat lines sent in every room,
+ *                 written by a background thread with group commit.
+ ******************************************************************************/
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "journal.h"
+#include "log.h"
+
+// A new segment is started once the current one would grow past this size.
+#define JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+// Number of segments kept. The oldest one is deleted when a new one starts.
+#define JOURNAL_KEEP_SEGMENTS 8
+// Size of the buffer records are collected in before they are written out.
+#define JOURNAL_BATCH_SIZE (1024 * 1024)
+// Most payload bytes that may wait for the writer. Beyond that, records are
+// dropped rather than letting memory grow without bound.
+#define JOURNAL_MAX_PENDING (64 * 1024 * 1024)
+// Bytes in a record before the room name: the body length, the checksum,
+// the timestamp, the message type, and the room name length.
+#define JOURNAL_RECORD_HEADER 14
+// Milliseconds the writer sleeps when there is nothing to write, unless it
+// is woken up.
+#define JOURNAL_IDLE_WAIT 100
+// Microseconds the writer lets records pile up after a commit before it
+// starts the next one, so a busy server syncs many records at once instead
+// of a few at a time. A record may take this long to become durable on top
+// of the time the sync takes.
+#define JOURNAL_COMMIT_INTERVAL 2000
+// Room for the path of a segment: the directory and the segment's file name.
+#define JOURNAL_PATH_LEN (PATH_MAX + 16)
+
+/**
+ * Chat line waiting to be written. It holds a reference to the message that
+ * was broadcast, so the payload is never copied until it is written out.
+ */
+struct journal_entry {
+    struct journal_entry *next;
+    struct message *msg;
+    unsigned char room_len;
+    char room[];
+};
+
+// Entries pushed by the workers, newest first. The writer takes the whole
+// list at once, so pushing never takes a lock.
+static _Atomic(struct journal_entry *) pending = NULL;
+static atomic_size_t pending_bytes = 0;
+// Number of records thrown away because the writer fell too far behind.
+static atomic_ulong num_dropped = 0;
+
+static pthread_t writer;
+static atomic_bool running = false;
+// The writer sleeps on the condition variable when there is nothing to
+// write. Producers only take the lock to wake it up.
+static atomic_bool writer_asleep = false;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+// State of the segment being written. Only the writer touches it once it is
+// running.
+static char journal_dir[PATH_MAX];
+static int segment_fd = -1;
+static unsigned segment_num = 0;
+static size_t segment_len = 0;
+static char batch[JOURNAL_BATCH_SIZE];
+static size_t batch_len = 0;
+
+// Tables for computing the CRC-32 8 bytes at a time. crc_table[0] is the
+// usual byte-at-a-time table, and crc_table[k] advances a byte through k more
+// bytes of zeros.
+static uint32_t crc_table[8][256];
+
+/**
+ * Fills in the tables for the CRC-32 used by zlib and Ethernet.
+ */
+static void crc32_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t c = crc_table[k - 1][i];
+            crc_table[k][i] = crc_table[0][c & 0xff] ^ (c >> 8);
+        }
+    }
+}
+
+/**
+ * Returns the CRC-32 of len bytes of data, continuing from crc. Start with a
+ * crc of 0. The bulk of the data is handled 8 bytes at a time, which is
+ * several times faster than a byte at a time.
+ */
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                             (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][p[4]] ^ crc_table[2][p[5]] ^
+              crc_table[1][p[6]] ^ crc_table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+ * Writes out whatever has been collected in the batch.
+ */
+static void flush_batch() {
+    size_t done = 0;
+    while (done < batch_len) {
+        ssize_t n = write(segment_fd, batch + done, batch_len - done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_printf(LOG_WARNING, "Warning: Failed to write to journal. "
+                       "%s.", strerror(errno));
+            break;
+        }
+        done += n;
+    }
+    batch_len = 0;
+}
+
+/**
+ * Builds the path of a segment.
+ */
+static void segment_path(char *path, unsigned num) {
+    snprintf(path, JOURNAL_PATH_LEN, "%s/%08u.jnl", journal_dir, num);
+}
+
+/**
+ * Creates segment number segment_num and makes it the one being written. The
+ * segment from JOURNAL_KEEP_SEGMENTS ago is deleted.
+ * Returns true on success, false on failure with errno set.
+ */
+static bool open_segment() {
+    char path[JOURNAL_PATH_LEN];
+    segment_path(path, segment_num);
+    segment_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    if (segment_fd < 0) {
+        return false;
+    }
+    segment_len = strlen(JOURNAL_MAGIC);
+    if (write(segment_fd, JOURNAL_MAGIC, segment_len) != segment_len) {
+        int saved_errno = errno;
+        close(segment_fd);
+        segment_fd = -1;
+        unlink(path);
+        errno = saved_errno;
+        return false;
+    }
+    // Make the new file itself durable, not only its contents.
+    int dir_fd = open(journal_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    if (segment_num >= JOURNAL_KEEP_SEGMENTS) {
+        segment_path(path, segment_num - JOURNAL_KEEP_SEGMENTS);
+        unlink(path);
+    }
+    return true;
+}
+
+/**
+ * Adds a record for a chat line to the batch, starting a new segment if the
+ * current one is full.
+ */
+static void append_record(const struct journal_entry *e) {
+    if (segment_fd < 0) {
+        return; // The last segment could not be started.
+    }
+    size_t payload_len = e->msg->header_len + e->msg->body_len;
+    size_t record_len = JOURNAL_RECORD_HEADER + e->room_len + payload_len;
+    if (segment_len + record_len > JOURNAL_SEGMENT_SIZE &&
+            segment_len > strlen(JOURNAL_MAGIC)) {
+        flush_batch();
+        fdatasync(segment_fd);
+        close(segment_fd);
+        segment_num++;
+        if (!open_segment()) {
+            log_printf(LOG_ERROR, "Error: Failed to start journal segment "
+                       "%u. %s.", segment_num, strerror(errno));
+            return;
+        }
+    }
+    if (batch_len + record_len > JOURNAL_BATCH_SIZE) {
+        flush_batch();
+    }
+    char *rec = batch + batch_len;
+    uint32_t body_len = htonl(record_len - 8);
+    uint32_t secs = htonl((uint32_t)time(NULL));
+    memcpy(rec, &body_len, 4);
+    memcpy(rec + 8, &secs, 4);
+    rec[12] = e->msg->type;
+    rec[13] = e->room_len;
+    char *p = rec + JOURNAL_RECORD_HEADER;
+    memcpy(p, e->room, e->room_len);
+    p += e->room_len;
+    memcpy(p, e->msg->header, e->msg->header_len);
+    memcpy(p + e->msg->header_len, e->msg->body, e->msg->body_len);
+    uint32_t crc = htonl(crc32_update(0, rec + 8, record_len - 8));
+    memcpy(rec + 4, &crc, 4);
+    batch_len += record_len;
+    segment_len += record_len;
+}
+
+/**
+ * Writes out every entry waiting for the writer and syncs the segment once
+ * for all of them. Entries pushed while the sync is going on are committed
+ * together by the next call.
+ * Returns the number of entries written.
+ */
+static int commit_pending() {
+    struct journal_entry *list = atomic_exchange(&pending, NULL);
+    // The list is newest first, so reverse it.
+    struct journal_entry *ordered = NULL;
+    while (list) {
+        struct journal_entry *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    int count = 0;
+    while (ordered) {
+        struct journal_entry *e = ordered;
+        ordered = e->next;
+        append_record(e);
+        atomic_fetch_sub(&pending_bytes,
+                         e->msg->header_len + e->msg->body_len);
+        message_unref(e->msg);
+        free(e);
+        count++;
+    }
+    if (count > 0 && segment_fd >= 0) {
+        flush_batch();
+        if (fdatasync(segment_fd) == -1) {
+            log_printf(LOG_WARNING, "Warning: Failed to sync journal. %s.",
+                       strerror(errno));
+        }
+    }
+    unsigned long dropped = atomic_exchange(&num_dropped, 0);
+    if (dropped > 0) {
+        log_printf(LOG_WARNING, "Warning: %lu messages were not journaled.",
+                   dropped);
+    }
+    return count;
+}
+
+/**
+ * Body of the writer thread. Commits entries until the journal is stopped
+ * and nothing is left to write.
+ */
+static void *run_writer(void *arg) {
+    while (true) {
+        if (commit_pending() > 0) {
+            if (atomic_load(&running)) {
+                usleep(JOURNAL_COMMIT_INTERVAL);
+            }
+            continue;
+        }
+        if (!atomic_load(&running)) {
+            break;
+        }
+        // Announce the nap before looking for entries one last time, so a
+        // producer either sees the writer asleep or its entry is seen here.
+        pthread_mutex_lock(&writer_lock);
+        atomic_store(&writer_asleep, true);
+        if (!atomic_load(&pending) && atomic_load(&running)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += JOURNAL_IDLE_WAIT * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&writer_cond, &writer_lock, &deadline);
+        }
+        atomic_store(&writer_asleep, false);
+        pthread_mutex_unlock(&writer_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Hands every record in a segment to replay, up to the first record that is
+ * cut short or fails its checksum. The segment is mapped into memory, so it
+ * is scanned without copying.
+ * Returns the number of records found.
+ */
+static unsigned long scan_segment(const char *path, journal_replay_fn replay) {
+    unsigned long count = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    size_t magic_len = strlen(JOURNAL_MAGIC);
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size <= magic_len) {
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_printf(LOG_WARNING, "Warning: Failed to map journal segment %s. "
+                   "%s.", path, strerror(errno));
+        return 0;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+    if (memcmp(data, JOURNAL_MAGIC, magic_len) != 0) {
+        log_printf(LOG_WARNING, "Warning: %s is not a journal segment.",
+                   path);
+        munmap((void *)data, size);
+        return 0;
+    }
+    size_t off = magic_len;
+    while (size - off >= JOURNAL_RECORD_HEADER) {
+        const char *rec = data + off;
+        uint32_t body_len, crc;
+        memcpy(&body_len, rec, 4);
+        memcpy(&crc, rec + 4, 4);
+        body_len = ntohl(body_len);
+        unsigned char room_len = rec[13];
+        if (body_len < JOURNAL_RECORD_HEADER - 8 + room_len ||
+                body_len > size - off - 8 ||
+                crc32_update(0, rec + 8, body_len) != ntohl(crc)) {
+            log_printf(LOG_WARNING, "Warning: Journal segment %s ends with "
+                       "%zu bytes of incomplete or damaged records.", path,
+                       size - off);
+            break;
+        }
+        const char *room = rec + JOURNAL_RECORD_HEADER;
+        replay(room, room_len, rec[12], room + room_len,
+               body_len - (JOURNAL_RECORD_HEADER - 8) - room_len);
+        off += 8 + body_len;
+        count++;
+    }
+    munmap((void *)data, size);
+    return count;
+}
+
+/**
+ * Compares segment numbers for qsort().
+ */
+static int compare_segments(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Finds the segments in the journal directory, creating the directory if it
+ * does not exist, and hands the records in them to replay, oldest first,
+ * unless replay is NULL. segment_num is set to the number after the newest
+ * segment.
+ * Returns true on success, false on failure with errno set.
+ */
+static bool recover(journal_replay_fn replay) {
+    DIR *dir = opendir(journal_dir);
+    if (!dir) {
+        if (errno == ENOENT && mkdir(journal_dir, 0755) == 0) {
+            return true;
+        }
+        return false;
+    }
+    unsigned *nums = NULL;
+    size_t num_segments = 0, capacity = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        unsigned num;
+        int len = 0;
+        if (sscanf(ent->d_name, "%8u.jnl%n", &num, &len) != 1 ||
+                len != (int)strlen(ent->d_name)) {
+            continue;
+        }
+        if (num_segments == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            unsigned *new_nums = realloc(nums, capacity * sizeof(unsigned));
+            if (!new_nums) {
+                free(nums);
+                closedir(dir);
+                return false;
+            }
+            nums = new_nums;
+        }
+        nums[num_segments++] = num;
+    }
+    closedir(dir);
+    // nums is still NULL if there are no segments, which qsort() must not get.
+    if (num_segments > 0) {
+        qsort(nums, num_segments, sizeof(unsigned), compare_segments);
+    }
+    unsigned long num_records = 0;
+    for (size_t i = 0; i < num_segments; i++) {
+        if (replay) {
+            char path[JOURNAL_PATH_LEN];
+            segment_path(path, nums[i]);
+            num_records += scan_segment(path, replay);
+        }
+        segment_num = nums[i] + 1;
+    }
+    free(nums);
+    if (replay && num_segments > 0) {
+        log_printf(LOG_INFO, "Recovered %lu messages from %zu journal "
+                   "segments.", num_records, num_segments);
+    }
+    return true;
+}
+
+/**
+ * Opens the journal in the given directory and starts the writer thread.
+ * Every record already in the journal is handed to replay first, unless
+ * replay is NULL. New records go into a new segment, so a damaged end of the
+ * last segment is never written after.
+ * Returns true on success, false on failure with errno set.
+ */
+bool journal_start(const char *dir, journal_replay_fn replay) {
+    if (strlen(dir) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(journal_dir, dir);
+    crc32_init();
+    if (!recover(replay) || !open_segment()) {
+        return false;
+    }
+    atomic_store(&running, true);
+    // The writer never handles signals, so block them all while it starts.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = pthread_create(&writer, NULL, run_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        atomic_store(&running, false);
+        close(segment_fd);
+        segment_fd = -1;
+        errno = rc;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Commits the remaining records and stops the writer thread. A segment
+ * without any records is removed.
+ */
+void journal_stop() {
+    if (!atomic_load(&running)) {
+        return;
+    }
+    atomic_store(&running, false);
+    pthread_mutex_lock(&writer_lock);
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer, NULL);
+    if (segment_fd >= 0) {
+        close(segment_fd);
+        segment_fd = -1;
+        if (segment_len == strlen(JOURNAL_MAGIC)) {
+            char path[JOURNAL_PATH_LEN];
+            segment_path(path, segment_num);
+            unlink(path);
+        }
+    }
+}
+
+/**
+ * Adds a chat line sent in the given room to the journal. The writer commits
+ * it along with the other lines that came in while it was busy, so callers
+ * never wait for the disk. If the writer has fallen too far behind, the line
+ * is dropped rather than making the caller wait.
+ */
+void journal_append(const char *room, struct message *msg) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+        return;
+    }
+    size_t len = msg->header_len + msg->body_len;
+    if (atomic_fetch_add(&pending_bytes, len) + len > JOURNAL_MAX_PENDING) {
+        atomic_fetch_sub(&pending_bytes, len);
+        atomic_fetch_add(&num_dropped, 1);
+        return;
+    }
+    size_t room_len = strlen(room);
+    struct journal_entry *e = malloc(sizeof(struct journal_entry) + room_len);
+    if (!e) {
+        atomic_fetch_sub(&pending_bytes, len);
+        atomic_fetch_add(&num_dropped, 1);
+        return;
+    }
+    e->msg = message_ref(msg);
+    e->room_len = room_len;
+    memcpy(e->room, room, room_len);
+    e->next = atomic_load_explicit(&pending, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak(&pending, &e->next, e));
+    // Pushing the entry must not be reordered with the check for a sleeping
+    // writer, or the writer could miss it. Only the first producer to find
+    // the writer asleep wakes it up.
+    if (atomic_load(&writer_asleep) && atomic_exchange(&writer_asleep, false)) {
+        pthread_mutex_lock(&writer_lock);
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_lock);
+    }
+}
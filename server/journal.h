@@ -0,0 +1,39 @@
+/*******************************************************************************
+ * Name          : journal.h
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Append-only journal of the chat lines sent in every room,
+ *                 written by a background thread with group commit.
+ ******************************************************************************/
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "message.h"
+
+/*
+ * The journal is a directory of segments named by their number, such as
+ * "00000042.jnl". Each segment starts with the 8 bytes "CHATJNL1". Each chat
+ * line follows as a record made up of a 4-byte body length and a 4-byte
+ * CRC-32 of the body, then the body: a 4-byte timestamp in seconds since the
+ * epoch, a 1-byte message type, a 1-byte room name length, the room name, and
+ * the payload of the message. Numbers are in network byte order. A record
+ * that is cut short or fails its checksum ends the segment.
+ */
+#define JOURNAL_MAGIC "CHATJNL1"
+
+/**
+ * Called for every record found in the journal when it is opened, oldest
+ * first.
+ */
+typedef void (*journal_replay_fn)(const char *room, size_t room_len,
+                                  unsigned char type, const char *payload,
+                                  size_t len);
+
+bool journal_start(const char *dir, journal_replay_fn replay);
+void journal_stop();
+void journal_append(const char *room, struct message *msg);
+
+#endif
@@ -0,0 +1,352 @@
+/*******************************************************************************
+ * Name          : log.c
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Asynchronous logging. Workers hand log lines to a
+ *                 background thread, which writes them out in batches.
+ ******************************************************************************/
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "log.h"
+
+// Number of log lines that can wait for the writer. Must be a power of 2.
+#define LOG_RING_SIZE 1024
+// Longest log line kept. Longer lines are cut short.
+#define LOG_LINE_LEN 1280
+// Size of the buffers the writer collects lines in before writing them out.
+#define LOG_BATCH_SIZE 65536
+// Milliseconds the writer sleeps when there is nothing to write, unless it
+// is woken up.
+#define LOG_IDLE_WAIT 100
+
+/**
+ * Slot in the ring of log lines. The sequence number tells whether the slot
+ * is free for the next producer or holds a line for the writer.
+ */
+struct log_record {
+    atomic_size_t seq;
+    unsigned char level;
+    time_t time;
+    unsigned short len;
+    char text[LOG_LINE_LEN];
+};
+
+/**
+ * Buffer a batch of log lines is collected in before it is written out with a
+ * single call.
+ */
+struct log_batch {
+    FILE *output;
+    size_t len;
+    char data[LOG_BATCH_SIZE];
+};
+
+enum log_level_t log_level = LOG_DEBUG;
+
+// Bounded multi-producer, single-consumer queue of log lines. Producers claim
+// a slot by advancing enqueue_pos and publish it by bumping its sequence
+// number, so logging never takes a lock. Only the writer moves dequeue_pos.
+static struct log_record ring[LOG_RING_SIZE];
+static atomic_size_t enqueue_pos = 0;
+static size_t dequeue_pos = 0;
+// Number of lines thrown away because the ring was full.
+static atomic_ulong num_dropped = 0;
+
+static pthread_t writer;
+static atomic_bool running = false;
+// The writer sleeps on the condition variable when the ring is empty.
+// Producers only take the lock to wake it up.
+static atomic_bool writer_asleep = false;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+// Binary log file, or NULL for text on stdout and stderr.
+static FILE *binary_log = NULL;
+static struct log_batch out_batch, err_batch;
+
+// Text of the timestamp for the second in timestamp_time. Formatting it is
+// the most expensive part of a text log line, so it is only done once a
+// second. Only the writer uses it, unless the writer is not running.
+static time_t timestamp_time = -1;
+static char timestamp[64];
+static size_t timestamp_len = 0;
+
+/**
+ * Parses the name of a log level.
+ * Returns true on success, false if the name is not a log level.
+ */
+bool log_parse_level(const char *name, enum log_level_t *level) {
+    static const char *names[] = { "error", "warning", "info", "debug" };
+    for (int i = 0; i <= LOG_DEBUG; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Writes out whatever has been collected in a batch.
+ */
+static void flush_batch(struct log_batch *batch) {
+    if (batch->len > 0) {
+        fwrite(batch->data, 1, batch->len, batch->output);
+        fflush(batch->output);
+        batch->len = 0;
+    }
+}
+
+/**
+ * Adds data to a batch, writing out the batch first if it has no room left.
+ */
+static void append_batch(struct log_batch *batch, const void *data,
+                         size_t len) {
+    if (batch->len + len > LOG_BATCH_SIZE) {
+        flush_batch(batch);
+    }
+    memcpy(batch->data + batch->len, data, len);
+    batch->len += len;
+}
+
+/**
+ * Adds a log line to the batch it belongs in. Text lines start with the date
+ * and time, and warnings and errors go to stderr.
+ */
+static void format_line(unsigned char level, time_t t, const char *text,
+                        unsigned short len) {
+    if (binary_log) {
+        unsigned char hdr[7];
+        uint32_t secs = htonl((uint32_t)t);
+        uint16_t n = htons(len);
+        memcpy(hdr, &secs, 4);
+        hdr[4] = level;
+        memcpy(hdr + 5, &n, 2);
+        append_batch(&out_batch, hdr, sizeof(hdr));
+        append_batch(&out_batch, text, len);
+        return;
+    }
+    if (t != timestamp_time) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        timestamp_len = strftime(timestamp, sizeof(timestamp) - 2, "%c", &tm);
+        memcpy(timestamp + timestamp_len, ": ", 2);
+        timestamp_len += 2;
+        timestamp_time = t;
+    }
+    struct log_batch *batch = level <= LOG_WARNING ? &err_batch : &out_batch;
+    append_batch(batch, timestamp, timestamp_len);
+    append_batch(batch, text, len);
+    append_batch(batch, "\n", 1);
+}
+
+/**
+ * Writes out every log line waiting in the ring.
+ * Returns the number of lines written.
+ */
+static int drain_ring() {
+    int count = 0;
+    while (true) {
+        struct log_record *rec = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&rec->seq, memory_order_acquire) !=
+                dequeue_pos + 1) {
+            break;
+        }
+        format_line(rec->level, rec->time, rec->text, rec->len);
+        // Hand the slot back to the producers for the next lap of the ring.
+        atomic_store_explicit(&rec->seq, dequeue_pos + LOG_RING_SIZE,
+                              memory_order_release);
+        dequeue_pos++;
+        count++;
+    }
+    unsigned long dropped = atomic_exchange(&num_dropped, 0);
+    if (dropped > 0) {
+        char text[64];
+        int len = sprintf(text, "Warning: %lu log messages were dropped.",
+                          dropped);
+        format_line(LOG_WARNING, time(NULL), text, len);
+    }
+    flush_batch(&err_batch);
+    flush_batch(&out_batch);
+    return count;
+}
+
+/**
+ * Body of the writer thread. Writes out log lines until logging is stopped
+ * and the ring is empty.
+ */
+static void *run_writer(void *arg) {
+    while (true) {
+        if (drain_ring() > 0) {
+            continue;
+        }
+        if (!atomic_load(&running)) {
+            break;
+        }
+        // Announce the nap before looking at the ring one last time, so a
+        // producer either sees the writer asleep or its line is seen here.
+        pthread_mutex_lock(&writer_lock);
+        atomic_store(&writer_asleep, true);
+        struct log_record *rec = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (atomic_load(&rec->seq) != dequeue_pos + 1 &&
+                atomic_load(&running)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_IDLE_WAIT * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&writer_cond, &writer_lock, &deadline);
+        }
+        atomic_store(&writer_asleep, false);
+        pthread_mutex_unlock(&writer_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Wakes up the writer if it is waiting for log lines.
+ */
+static void wake_writer() {
+    if (atomic_load(&writer_asleep)) {
+        pthread_mutex_lock(&writer_lock);
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_lock);
+    }
+}
+
+/**
+ * Starts the writer thread. If binary_path is not NULL, the log is written
+ * to that file in the binary format instead of as text. The file is added to
+ * if append is set, as when taking over from a previous process, and is
+ * started over otherwise.
+ * Returns true on success, false on failure.
+ */
+bool log_start(const char *binary_path, bool append) {
+    out_batch.output = stdout;
+    err_batch.output = stderr;
+    if (binary_path) {
+        if (!(binary_log = fopen(binary_path, append ? "ab" : "wb"))) {
+            return false;
+        }
+        out_batch.output = binary_log;
+        // Opening for appending puts the position at the end of the file.
+        fseek(binary_log, 0, SEEK_END);
+        if (ftell(binary_log) == 0) {
+            append_batch(&out_batch, LOG_BINARY_MAGIC,
+                         strlen(LOG_BINARY_MAGIC));
+        }
+    }
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&ring[i].seq, i);
+    }
+    atomic_store(&running, true);
+    // The writer never handles signals, so block them all while it starts.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = pthread_create(&writer, NULL, run_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        atomic_store(&running, false);
+        errno = rc;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Writes out the remaining log lines and stops the writer thread. Lines
+ * logged from now on are written right away by the caller, as text.
+ */
+void log_stop() {
+    if (!atomic_load(&running)) {
+        return;
+    }
+    atomic_store(&running, false);
+    pthread_mutex_lock(&writer_lock);
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer, NULL);
+    if (binary_log) {
+        fclose(binary_log);
+        binary_log = NULL;
+        out_batch.output = stdout;
+    }
+}
+
+/**
+ * Logs a line at the given level, if the log level allows it. The line is
+ * formatted by the caller and written by the writer thread. If the writer
+ * has fallen too far behind, the line is dropped rather than making the
+ * caller wait.
+ */
+void log_printf(enum log_level_t level, const char *format, ...) {
+    if (level > log_level) {
+        return;
+    }
+    va_list args;
+    if (!atomic_load(&running)) {
+        // No writer, so write the line out right away. Before the writer
+        // has been started, the outputs are not set up yet.
+        if (!out_batch.output) {
+            out_batch.output = stdout;
+            err_batch.output = stderr;
+        }
+        char text[LOG_LINE_LEN];
+        va_start(args, format);
+        int len = vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        if (len >= (int)sizeof(text)) {
+            len = sizeof(text) - 1;
+        }
+        format_line(level, time(NULL), text, len < 0 ? 0 : len);
+        flush_batch(&err_batch);
+        flush_batch(&out_batch);
+        return;
+    }
+
+    // Claim the next slot, unless the writer has not freed it up yet.
+    struct log_record *rec;
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    while (true) {
+        rec = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if ((ptrdiff_t)(seq - pos) < 0) {
+            atomic_fetch_add(&num_dropped, 1);
+            return;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    va_start(args, format);
+    int len = vsnprintf(rec->text, LOG_LINE_LEN, format, args);
+    va_end(args);
+    if (len >= LOG_LINE_LEN) {
+        len = LOG_LINE_LEN - 1;
+    }
+    rec->len = len < 0 ? 0 : len;
+    rec->level = level;
+    rec->time = time(NULL);
+    // Publishing the line must not be reordered with the check for a
+    // sleeping writer, or the writer could miss it.
+    atomic_store(&rec->seq, pos + 1);
+    wake_writer();
+}
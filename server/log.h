@@ -0,0 +1,41 @@
+/*******************************************************************************
+ * Name          : log.h
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Asynchronous logging. Workers hand log lines to a
+ *                 background thread, which writes them out in batches.
+ ******************************************************************************/
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdbool.h>
+
+/**
+ * How much the server logs. Each level includes the ones above it. The
+ * contents of chat messages are only logged at LOG_DEBUG.
+ */
+enum log_level_t {
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+/*
+ * The binary log starts with the 8 bytes "CHATLOG1". Each line follows as a
+ * record made up of a 4-byte timestamp in seconds since the epoch, a 1-byte
+ * level, and a 2-byte text length, all in network byte order, and then the
+ * text itself without a newline.
+ */
+#define LOG_BINARY_MAGIC "CHATLOG1"
+
+extern enum log_level_t log_level;
+
+bool log_parse_level(const char *name, enum log_level_t *level);
+bool log_start(const char *binary_path, bool append);
+void log_stop();
+void log_printf(enum log_level_t level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,262 @@
+/*******************************************************************************
+ * Name          : message.c
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Immutable, reference-counted messages shared by every
+ *                 client a message is sent to.
+ ******************************************************************************/
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "message.h"
+
+// Sizes of the objects in each class of pooled messages, smallest first.
+static const size_t class_sizes[MESSAGE_NUM_CLASSES] = {
+    128, 256, 512, MESSAGE_MAX_POOLED
+};
+
+_Thread_local struct message_cache *message_cache = NULL;
+
+// Compressor of this thread, set up the first time it is needed and reset
+// for every message, since setting one up takes a lot of memory.
+static _Thread_local z_stream deflater;
+static _Thread_local bool deflater_ready = false;
+
+/**
+ * Sets up the pools of messages of the calling thread. They are reported
+ * in its metrics.
+ */
+void message_cache_init(struct message_cache *cache) {
+    for (int i = 0; i < MESSAGE_NUM_CLASSES; i++) {
+        pool_init(&cache->classes[i], class_sizes[i],
+                  METRIC_POOL_MESSAGES_128 + i);
+    }
+}
+
+/**
+ * Hands the pools of messages over to whichever thread drops the last
+ * reference to the messages still in use, once the owner is done with them.
+ */
+void message_cache_detach(struct message_cache *cache) {
+    for (int i = 0; i < MESSAGE_NUM_CLASSES; i++) {
+        pool_detach(&cache->classes[i]);
+    }
+}
+
+/**
+ * Frees the pools of messages, along with every message still in them.
+ */
+void message_cache_destroy(struct message_cache *cache) {
+    for (int i = 0; i < MESSAGE_NUM_CLASSES; i++) {
+        pool_destroy(&cache->classes[i]);
+    }
+}
+
+/**
+ * Creates a message of the given type with a reference count of 1 from the
+ * given header and body. Either may be empty. If body is NULL, room is made
+ * for body_len bytes, which the caller fills in before the message is
+ * shared. The message comes from the smallest pool of this thread it fits
+ * in, if there is one. Returns NULL if memory could not be allocated.
+ */
+struct message *message_create(unsigned char type,
+                               const char *header, size_t header_len,
+                               const char *body, size_t body_len) {
+    size_t size = sizeof(struct message) + header_len + body_len;
+    struct pool *pool = NULL;
+    if (message_cache) {
+        for (int i = 0; i < MESSAGE_NUM_CLASSES; i++) {
+            if (size <= class_sizes[i]) {
+                pool = &message_cache->classes[i];
+                break;
+            }
+        }
+    }
+    struct message *msg = pool ? pool_get(pool) : malloc(size);
+    if (!msg) {
+        return NULL;
+    }
+    msg->pool = pool;
+    msg->packed = NULL;
+    msg->packed_len = 0;
+    msg->verbatim = false;
+    atomic_init(&msg->refs, 1);
+    msg->type = type;
+    proto_write_header(msg->frame, type, header_len + body_len);
+    msg->header = (char *)(msg + 1);
+    msg->header_len = header_len;
+    if (header_len > 0) {
+        memcpy(msg->header, header, header_len);
+    }
+    msg->body = msg->header + header_len;
+    msg->body_len = body_len;
+    if (body && body_len > 0) {
+        memcpy(msg->body, body, body_len);
+    }
+    return msg;
+}
+
+/**
+ * Creates a message whose body is the given string, without the terminating
+ * null character.
+ */
+struct message *message_from_string(unsigned char type, const char *str) {
+    return message_create(type, NULL, 0, str, strlen(str));
+}
+
+/**
+ * Creates a message made up of bytes already in the form a client takes them
+ * in, such as the rest of the frames a previous process of the server was
+ * sending it. They are sent as they are, whatever the form.
+ */
+struct message *message_verbatim(const char *data, size_t len) {
+    struct message *msg = message_create(0, NULL, 0, data, len);
+    if (msg) {
+        msg->verbatim = true;
+    }
+    return msg;
+}
+
+/**
+ * Takes another reference to a message. Returns the message.
+ */
+struct message *message_ref(struct message *msg) {
+    atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+    return msg;
+}
+
+/**
+ * Drops a reference to a message, freeing it or putting it back into its
+ * pool if it was the last one. Any thread may drop a reference.
+ */
+void message_unref(struct message *msg) {
+    if (msg && atomic_fetch_sub_explicit(&msg->refs, 1,
+                                         memory_order_acq_rel) == 1) {
+        free(msg->packed);
+        if (msg->pool) {
+            pool_put(msg->pool, msg);
+        } else {
+            free(msg);
+        }
+    }
+}
+
+/**
+ * Compresses the payload of a message into a frame of its own, unless the
+ * payload is shorter than MESSAGE_COMPRESS_THRESHOLD or does not shrink.
+ * The message must not have been shared yet. Compressing it once lets every
+ * client that takes compressed messages be sent the same bytes.
+ * Returns true if the message has a compressed frame.
+ */
+bool message_compress(struct message *msg) {
+    size_t len = msg->header_len + msg->body_len;
+    if (msg->packed) {
+        return true;
+    }
+    if (msg->verbatim || len < MESSAGE_COMPRESS_THRESHOLD || len > UINT32_MAX) {
+        return false;
+    }
+    if (!deflater_ready) {
+        memset(&deflater, 0, sizeof(z_stream));
+        // Negative window bits make a raw deflate stream, with no header.
+        if (deflateInit2(&deflater, Z_BEST_SPEED, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        deflater_ready = true;
+    } else {
+        deflateReset(&deflater);
+    }
+    size_t prefix = PROTO_HEADER_LEN + sizeof(uint32_t);
+    size_t capacity = prefix + deflateBound(&deflater, len);
+    char *packed = malloc(capacity);
+    if (!packed) {
+        return false;
+    }
+    // The header and the body are fed in one after the other, so they come
+    // out as a single stream.
+    deflater.next_out = (Bytef *)packed + prefix;
+    deflater.avail_out = capacity - prefix;
+    deflater.next_in = (Bytef *)msg->header;
+    deflater.avail_in = msg->header_len;
+    int rc = deflate(&deflater, Z_NO_FLUSH);
+    if (rc == Z_OK) {
+        deflater.next_in = (Bytef *)msg->body;
+        deflater.avail_in = msg->body_len;
+        rc = deflate(&deflater, Z_FINISH);
+    }
+    size_t packed_len = prefix + deflater.total_out;
+    if (rc != Z_STREAM_END || packed_len >= PROTO_HEADER_LEN + len) {
+        free(packed);
+        return false;
+    }
+    proto_write_header(packed, msg->type | MSG_COMPRESSED,
+                       packed_len - PROTO_HEADER_LEN);
+    uint32_t original = htonl(len);
+    memcpy(packed + PROTO_HEADER_LEN, &original, sizeof(uint32_t));
+    msg->packed = packed;
+    msg->packed_len = packed_len;
+    return true;
+}
+
+/**
+ * Frees the compressor of the calling thread, if it has one.
+ */
+void message_compress_end() {
+    if (deflater_ready) {
+        deflateEnd(&deflater);
+        deflater_ready = false;
+    }
+}
+
+/**
+ * Returns the number of bytes in a message as sent on the wire in the given
+ * form.
+ */
+size_t message_len(const struct message *msg,
+                   enum message_encoding_t encoding) {
+    if (encoding == MESSAGE_DEFLATE && msg->packed) {
+        return msg->packed_len;
+    }
+    return (encoding != MESSAGE_RAW && !msg->verbatim ? PROTO_HEADER_LEN : 0) +
+           msg->header_len + msg->body_len;
+}
+
+/**
+ * Fills in iov with the parts of the message, as sent on the wire in the
+ * given form, that come after the first offset bytes. Empty parts are left
+ * out. Returns the number of iovecs used, which is at most MESSAGE_MAX_IOV.
+ */
+int message_iov(const struct message *msg, enum message_encoding_t encoding,
+                size_t offset, struct iovec *iov) {
+    int n = 0;
+    if (encoding == MESSAGE_DEFLATE && msg->packed) {
+        iov[n].iov_base = msg->packed + offset;
+        iov[n++].iov_len = msg->packed_len - offset;
+        return n;
+    }
+    if (encoding != MESSAGE_RAW && !msg->verbatim) {
+        if (offset < PROTO_HEADER_LEN) {
+            iov[n].iov_base = (char *)msg->frame + offset;
+            iov[n++].iov_len = PROTO_HEADER_LEN - offset;
+            offset = 0;
+        } else {
+            offset -= PROTO_HEADER_LEN;
+        }
+    }
+    if (offset < msg->header_len) {
+        iov[n].iov_base = msg->header + offset;
+        iov[n++].iov_len = msg->header_len - offset;
+        offset = 0;
+    } else {
+        offset -= msg->header_len;
+    }
+    if (offset < msg->body_len) {
+        iov[n].iov_base = msg->body + offset;
+        iov[n++].iov_len = msg->body_len - offset;
+    }
+    return n;
+}
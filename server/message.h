@@ -0,0 +1,96 @@
+/*******************************************************************************
+ * Name          : message.h
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Immutable, reference-counted messages shared by every
+ *                 client a message is sent to.
+ ******************************************************************************/
+#ifndef MESSAGE_H_
+#define MESSAGE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include "pool.h"
+#include "proto.h"
+
+/**
+ * Message built once per broadcast. Its payload is made up of a header (such
+ * as the "[name]: " prefix of a chat line) and a body, both stored right
+ * after the struct, so the whole message is a single allocation. The frame
+ * header is built along with it, so the message can be sent as-is to clients
+ * that speak the framed protocol, and without the frame header to legacy
+ * clients. Every send queue holding the message owns a reference to it, and
+ * the message is freed when the last reference is dropped. A message must
+ * not be changed once it has been shared. Small messages come from the
+ * pools of the thread that creates them, and go back to them from whichever
+ * thread drops the last reference. A long message may also carry a
+ * compressed frame, built once for every client that takes compressed
+ * messages. A verbatim message is sent as it is, in whatever form the client
+ * takes messages in.
+ */
+struct message {
+    atomic_int refs;
+    unsigned char type;
+    char frame[PROTO_HEADER_LEN];
+    size_t header_len, body_len;
+    char *header, *body;
+    struct pool *pool; // NULL if the message was malloc'd.
+    char *packed;      // Compressed frame, or NULL.
+    size_t packed_len; // Length of the compressed frame, header included.
+    bool verbatim;     // The body is sent alone, with no frame header.
+};
+
+/**
+ * Forms a message takes on the wire.
+ */
+enum message_encoding_t {
+    MESSAGE_RAW,     // The payload alone, for legacy clients.
+    MESSAGE_FRAMED,  // The frame header and the payload.
+    MESSAGE_DEFLATE  // The compressed frame if there is one, else framed.
+};
+
+// Payloads shorter than this are never compressed, since the few bytes
+// saved are not worth the time.
+#define MESSAGE_COMPRESS_THRESHOLD 128
+
+// Max number of iovecs message_iov() fills in.
+#define MESSAGE_MAX_IOV 3
+
+// Number of size classes of pooled messages, and the size of the largest,
+// struct included. Larger messages are malloc'd.
+#define MESSAGE_NUM_CLASSES 4
+#define MESSAGE_MAX_POOLED  1152
+
+/**
+ * Pools of messages of a thread, one per size class.
+ */
+struct message_cache {
+    struct pool classes[MESSAGE_NUM_CLASSES];
+};
+
+// Pools new messages created on this thread come from, or NULL to malloc
+// them.
+extern _Thread_local struct message_cache *message_cache;
+
+void message_cache_init(struct message_cache *cache);
+void message_cache_detach(struct message_cache *cache);
+void message_cache_destroy(struct message_cache *cache);
+
+struct message *message_create(unsigned char type,
+                               const char *header, size_t header_len,
+                               const char *body, size_t body_len);
+struct message *message_from_string(unsigned char type, const char *str);
+struct message *message_verbatim(const char *data, size_t len);
+struct message *message_ref(struct message *msg);
+void message_unref(struct message *msg);
+bool message_compress(struct message *msg);
+void message_compress_end();
+size_t message_len(const struct message *msg,
+                   enum message_encoding_t encoding);
+int message_iov(const struct message *msg, enum message_encoding_t encoding,
+                size_t offset, struct iovec *iov);
+
+#endif
@@ -0,0 +1,321 @@
+/*******************************************************************************
+ * Name          : metrics.c
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Counters, gauges, and histograms kept by every worker and
+ *                 served as text on a local admin socket.
+ ******************************************************************************/
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "log.h"
+#include "metrics.h"
+
+// Milliseconds the admin thread waits for a connection before it checks
+// whether it has been stopped.
+#define METRICS_POLL_INTERVAL 100
+// Room for the text of a snapshot of all the metrics.
+#define METRICS_TEXT_SIZE 16384
+// Seconds the admin thread keeps trying to send a snapshot to a reader that
+// does not take it.
+#define METRICS_SEND_TIMEOUT 1
+
+static const char *counter_names[NUM_METRIC_COUNTERS] = {
+    "chat_accepts_total",
+    "chat_refusals_total",
+    "chat_messages_in_total",
+    "chat_bytes_in_total",
+    "chat_messages_out_total",
+    "chat_bytes_out_total",
+    "chat_send_errors_total",
+    "chat_queue_drops_total",
+    "chat_slow_disconnects_total",
+    "chat_throttles_total",
+    "chat_yields_total",
+    "chat_idle_disconnects_total"
+};
+
+static const char *gauge_names[NUM_METRIC_GAUGES] = {
+    "chat_connections",
+    "chat_queued_messages",
+    "chat_queued_bytes",
+    "chat_throttled_clients"
+};
+
+static const char *histogram_names[NUM_METRIC_HISTOGRAMS] = {
+    "chat_loop_time_ns",
+    "chat_fanout_time_ns"
+};
+
+static const char *pool_names[NUM_METRIC_POOLS] = {
+    "connections",
+    "recv_buffers",
+    "sends",
+    "inbox_nodes",
+    "messages_128",
+    "messages_256",
+    "messages_512",
+    "messages_1152"
+};
+
+// Metrics of threads that are not workers, such as the main thread before
+// the workers start. Nobody reads them, but counting never has to check for
+// a missing block.
+static struct metrics unattached;
+_Thread_local struct metrics *metrics = &unattached;
+
+static struct metrics *blocks = NULL;
+static int num_blocks = 0;
+
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int admin_fd = -1;
+static pthread_t admin;
+static atomic_bool running = false;
+
+/**
+ * Appends a line to the text of a snapshot, if it fits.
+ */
+static void append_line(char *text, size_t *len, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void append_line(char *text, size_t *len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text + *len, METRICS_TEXT_SIZE - *len, format, args);
+    va_end(args);
+    if (n > 0 && *len + n < METRICS_TEXT_SIZE) {
+        *len += n;
+    }
+}
+
+/**
+ * Adds up the metrics of every worker and renders them in the Prometheus text
+ * format, one "name value" line per counter, gauge, and histogram bucket.
+ * Returns the length of the text.
+ */
+static size_t render_snapshot(char *text) {
+    size_t len = 0;
+    for (int c = 0; c < NUM_METRIC_COUNTERS; c++) {
+        uint64_t total = 0;
+        for (int i = 0; i < num_blocks; i++) {
+            total += atomic_load_explicit(&blocks[i].counters[c],
+                                          memory_order_relaxed);
+        }
+        append_line(text, &len, "# TYPE %s counter\n%s %llu\n",
+                    counter_names[c], counter_names[c],
+                    (unsigned long long)total);
+    }
+    for (int g = 0; g < NUM_METRIC_GAUGES; g++) {
+        int64_t total = 0;
+        for (int i = 0; i < num_blocks; i++) {
+            total += atomic_load_explicit(&blocks[i].gauges[g],
+                                          memory_order_relaxed);
+        }
+        append_line(text, &len, "# TYPE %s gauge\n%s %lld\n",
+                    gauge_names[g], gauge_names[g], (long long)total);
+    }
+    for (int h = 0; h < NUM_METRIC_HISTOGRAMS; h++) {
+        const char *name = histogram_names[h];
+        append_line(text, &len, "# TYPE %s histogram\n", name);
+        // Buckets are cumulative, each counting everything up to its bound.
+        uint64_t seen = 0;
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            for (int i = 0; i < num_blocks; i++) {
+                seen += atomic_load_explicit(
+                    &blocks[i].histograms[h].buckets[b], memory_order_relaxed);
+            }
+            if (b < METRICS_HIST_BUCKETS - 1) {
+                append_line(text, &len, "%s_bucket{le=\"%llu\"} %llu\n", name,
+                            1ULL << (b + 1), (unsigned long long)seen);
+            }
+        }
+        uint64_t sum = 0;
+        for (int i = 0; i < num_blocks; i++) {
+            sum += atomic_load_explicit(&blocks[i].histograms[h].sum,
+                                        memory_order_relaxed);
+        }
+        // The buckets are read one after the other while the workers keep
+        // counting, so the total is taken from them rather than from the
+        // separate count, which may be ahead.
+        append_line(text, &len, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu\n"
+                    "%s_count %llu\n", name, (unsigned long long)seen, name,
+                    (unsigned long long)sum, name, (unsigned long long)seen);
+    }
+    // Memory of the pools, labeled by pool.
+    append_line(text, &len, "# TYPE chat_pool_bytes gauge\n");
+    for (int p = 0; p < NUM_METRIC_POOLS; p++) {
+        int64_t total = 0;
+        for (int i = 0; i < num_blocks; i++) {
+            total += atomic_load_explicit(&blocks[i].pool_bytes[p],
+                                          memory_order_relaxed);
+        }
+        append_line(text, &len, "chat_pool_bytes{pool=\"%s\"} %lld\n",
+                    pool_names[p], (long long)total);
+    }
+    append_line(text, &len, "# TYPE chat_pool_objects gauge\n");
+    for (int p = 0; p < NUM_METRIC_POOLS; p++) {
+        int64_t total = 0;
+        for (int i = 0; i < num_blocks; i++) {
+            total += atomic_load_explicit(&blocks[i].pool_objects[p],
+                                          memory_order_relaxed) -
+                     atomic_load_explicit(&blocks[i].pool_returns[p],
+                                          memory_order_relaxed);
+        }
+        append_line(text, &len, "chat_pool_objects{pool=\"%s\"} %lld\n",
+                    pool_names[p], (long long)total);
+    }
+    return len;
+}
+
+/**
+ * Sends a snapshot of the metrics to a reader of the admin socket.
+ */
+static void serve_snapshot(int fd) {
+    static char text[METRICS_TEXT_SIZE];
+    struct timeval timeout = { .tv_sec = METRICS_SEND_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    size_t len = render_snapshot(text), done = 0;
+    while (done < len) {
+        ssize_t n = send(fd, text + done, len - done, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_printf(LOG_WARNING, "Warning: Failed to send metrics. %s.",
+                       strerror(errno));
+            break;
+        }
+        done += n;
+    }
+}
+
+/**
+ * Body of the admin thread. Answers every connection to the admin socket
+ * with a snapshot of the metrics, then closes it.
+ */
+static void *run_admin(void *arg) {
+    struct pollfd pfd = { .fd = admin_fd, .events = POLLIN };
+    while (atomic_load(&running)) {
+        if (poll(&pfd, 1, METRICS_POLL_INTERVAL) <= 0) {
+            continue;
+        }
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        serve_snapshot(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * Opens the admin socket at the given path. A socket left behind by an
+ * earlier run is replaced, but any other file at the path is left alone.
+ * Only the user running the server may connect to it.
+ * Returns true on success, false on failure with errno set.
+ */
+static bool open_admin_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if ((admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return false;
+    }
+    if (bind(admin_fd, (struct sockaddr *)&addr,
+             sizeof(struct sockaddr_un)) < 0 ||
+            chmod(path, S_IRUSR | S_IWUSR) < 0 ||
+            listen(admin_fd, SOMAXCONN) < 0) {
+        int saved = errno;
+        close(admin_fd);
+        admin_fd = -1;
+        errno = saved;
+        return false;
+    }
+    strcpy(socket_path, path);
+    return true;
+}
+
+/**
+ * Sets up the metrics of every worker. If admin_path is not NULL, a thread
+ * serves them on a Unix socket at that path, so they can be read with a tool
+ * such as "socat - UNIX-CONNECT:path".
+ * Returns true on success, false on failure with errno set.
+ */
+bool metrics_start(const char *admin_path, int num_workers) {
+    if (!(blocks = aligned_alloc(_Alignof(struct metrics),
+                                 num_workers * sizeof(struct metrics)))) {
+        return false;
+    }
+    memset(blocks, 0, num_workers * sizeof(struct metrics));
+    num_blocks = num_workers;
+    if (!admin_path) {
+        return true;
+    }
+    if (!open_admin_socket(admin_path)) {
+        return false;
+    }
+    atomic_store(&running, true);
+    // The admin thread never handles signals, so block them all while it
+    // starts.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = pthread_create(&admin, NULL, run_admin, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        atomic_store(&running, false);
+        close(admin_fd);
+        admin_fd = -1;
+        unlink(admin_path);
+        errno = rc;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Stops the admin thread and removes the admin socket. The metrics of the
+ * workers are freed, so no worker may be running anymore.
+ */
+void metrics_stop() {
+    if (atomic_load(&running)) {
+        atomic_store(&running, false);
+        pthread_join(admin, NULL);
+    }
+    if (admin_fd >= 0) {
+        close(admin_fd);
+        admin_fd = -1;
+        unlink(socket_path);
+    }
+    free(blocks);
+    blocks = NULL;
+    num_blocks = 0;
+}
+
+/**
+ * Makes the calling thread count into the metrics of the given worker.
+ */
+void metrics_attach(int worker) {
+    metrics = &blocks[worker];
+}
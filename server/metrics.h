@@ -0,0 +1,175 @@
+/*******************************************************************************
+ * Name          : metrics.h
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Counters, gauges, and histograms kept by every worker and
+ *                 served as text on a local admin socket.
+ ******************************************************************************/
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Counts that only ever go up.
+ */
+enum metric_counter_t {
+    METRIC_ACCEPTS,          // Connections accepted.
+    METRIC_REFUSALS,         // Connections refused for lack of resources.
+    METRIC_MESSAGES_IN,      // Messages received from clients.
+    METRIC_BYTES_IN,         // Bytes received from clients.
+    METRIC_MESSAGES_OUT,     // Messages sent to clients in full.
+    METRIC_BYTES_OUT,        // Bytes sent to clients.
+    METRIC_SEND_ERRORS,      // Sends that failed.
+    METRIC_QUEUE_DROPS,      // Messages thrown away instead of being sent.
+    METRIC_SLOW_DISCONNECTS, // Clients disconnected for not keeping up.
+    METRIC_THROTTLES,        // Clients stopped for going over a rate limit.
+    METRIC_YIELDS,           // Clients set aside after using up their turn.
+    METRIC_IDLE_DISCONNECTS, // Clients disconnected for staying quiet.
+    NUM_METRIC_COUNTERS
+};
+
+/**
+ * Values that go up and down.
+ */
+enum metric_gauge_t {
+    METRIC_CONNECTIONS,       // Open client connections.
+    METRIC_QUEUED_MESSAGES,   // Messages waiting in send queues.
+    METRIC_QUEUED_BYTES,      // Bytes waiting in send queues.
+    METRIC_THROTTLED_CLIENTS, // Clients not read from for going over a limit.
+    NUM_METRIC_GAUGES
+};
+
+/**
+ * Distributions of durations in nanoseconds.
+ */
+enum metric_histogram_t {
+    METRIC_LOOP_TIME,   // Time an event loop spends on one batch of events.
+    METRIC_FANOUT_TIME, // Time a worker takes to hand a message to a room.
+    NUM_METRIC_HISTOGRAMS
+};
+
+/**
+ * Pools of recycled objects, each reported with the bytes it holds and the
+ * number of its objects in use.
+ */
+enum metric_pool_t {
+    METRIC_POOL_CONNECTIONS,  // Slots of the connection table.
+    METRIC_POOL_RECV_BUFFERS, // Buffers for frames received in part.
+    METRIC_POOL_SENDS,        // Sends submitted to the io_uring.
+    METRIC_POOL_INBOX_NODES,  // Messages relayed to other workers.
+    METRIC_POOL_MESSAGES_128, // Messages by size, header included.
+    METRIC_POOL_MESSAGES_256,
+    METRIC_POOL_MESSAGES_512,
+    METRIC_POOL_MESSAGES_1152,
+    NUM_METRIC_POOLS
+};
+
+// Bucket i of a histogram counts the durations from 2^i up to 2^(i + 1)
+// nanoseconds. The last bucket also counts everything longer.
+#define METRICS_HIST_BUCKETS 32
+
+struct metric_histogram {
+    _Atomic uint64_t buckets[METRICS_HIST_BUCKETS];
+    _Atomic uint64_t count, sum;
+};
+
+/**
+ * Metrics of a single worker. Only the worker writes them, so updates are
+ * plain loads and stores that cannot tear, with no locked instructions. The
+ * admin thread adds up the blocks of every worker when it is asked for them.
+ */
+struct metrics {
+    _Alignas(64) _Atomic uint64_t counters[NUM_METRIC_COUNTERS];
+    _Atomic int64_t gauges[NUM_METRIC_GAUGES];
+    struct metric_histogram histograms[NUM_METRIC_HISTOGRAMS];
+    _Atomic int64_t pool_bytes[NUM_METRIC_POOLS];
+    _Atomic int64_t pool_objects[NUM_METRIC_POOLS];
+    // Objects put back into the worker's pools by other threads. Unlike the
+    // rest of the block, any thread adds to them.
+    _Atomic uint64_t pool_returns[NUM_METRIC_POOLS];
+};
+
+// Block of the worker running on this thread.
+extern _Thread_local struct metrics *metrics;
+
+bool metrics_start(const char *admin_path, int num_workers);
+void metrics_stop();
+void metrics_attach(int worker);
+
+/**
+ * Adds n to a counter of this worker.
+ */
+static inline void metrics_count(enum metric_counter_t c, uint64_t n) {
+    _Atomic uint64_t *p = &metrics->counters[c];
+    atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/**
+ * Adds delta, which may be negative, to a gauge of this worker.
+ */
+static inline void metrics_adjust(enum metric_gauge_t g, int64_t delta) {
+    _Atomic int64_t *p = &metrics->gauges[g];
+    atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) +
+                          delta, memory_order_relaxed);
+}
+
+/**
+ * Adds bytes to the memory held by a pool of this worker and objects to the
+ * number of its objects in use. Either may be negative.
+ */
+static inline void metrics_pool(enum metric_pool_t p, int64_t bytes,
+                                int64_t objects) {
+    _Atomic int64_t *b = &metrics->pool_bytes[p];
+    _Atomic int64_t *o = &metrics->pool_objects[p];
+    atomic_store_explicit(b, atomic_load_explicit(b, memory_order_relaxed) +
+                          bytes, memory_order_relaxed);
+    atomic_store_explicit(o, atomic_load_explicit(o, memory_order_relaxed) +
+                          objects, memory_order_relaxed);
+}
+
+/**
+ * Counts an object put back by another thread into a pool of the worker
+ * whose metrics are m.
+ */
+static inline void metrics_pool_return(struct metrics *m,
+                                       enum metric_pool_t p) {
+    atomic_fetch_add_explicit(&m->pool_returns[p], 1, memory_order_relaxed);
+}
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds, for timing what
+ * goes into a histogram.
+ */
+static inline uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Records the time elapsed since start in a histogram of this worker.
+ */
+static inline void metrics_record(enum metric_histogram_t h, uint64_t start) {
+    struct metric_histogram *hist = &metrics->histograms[h];
+    uint64_t elapsed = metrics_now() - start;
+    int bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+    if (bucket >= METRICS_HIST_BUCKETS) {
+        bucket = METRICS_HIST_BUCKETS - 1;
+    }
+    _Atomic uint64_t *p = &hist->buckets[bucket];
+    atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&hist->count, atomic_load_explicit(&hist->count,
+                          memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&hist->sum, atomic_load_explicit(&hist->sum,
+                          memory_order_relaxed) + elapsed,
+                          memory_order_relaxed);
+}
+
+#endif
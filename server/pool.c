@@ -0,0 +1,134 @@
+/*******************************************************************************
+ * Name          : pool.c
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Pools of fixed-size objects carved out of large slabs, so
+ *                 objects that come and go all the time are recycled instead
+ *                 of going back to the heap.
+ ******************************************************************************/
+#include <stdalign.h>
+#include <stdlib.h>
+#include "pool.h"
+
+// Objects and the slab header are padded to this, so every object is
+// aligned for any type.
+#define POOL_ALIGN alignof(max_align_t)
+
+// Only its address is used, to tell the threads apart.
+static _Thread_local char thread_id;
+
+/**
+ * Sets up an empty pool of objects of the given size, owned by the calling
+ * thread. Its memory is reported as the given pool in the metrics of that
+ * thread.
+ */
+void pool_init(struct pool *p, size_t object_size, enum metric_pool_t metric) {
+    object_size = (object_size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+    p->object_size = object_size;
+    p->objects_per_slab = object_size < POOL_SLAB_SIZE
+                        ? POOL_SLAB_SIZE / object_size : 1;
+    p->metric = metric;
+    atomic_init(&p->owner, (const void *)&thread_id);
+    p->metrics = metrics;
+    p->free_list = NULL;
+    p->slabs = NULL;
+    atomic_init(&p->returned, NULL);
+}
+
+/**
+ * Gives up ownership of a pool whose owner is done with it, but whose objects
+ * may still be in use. Objects put back from then on are counted as put back
+ * by another thread. Other threads may be putting objects back at the same
+ * time, so the owner is cleared with release ordering, which pool_put()
+ * pairs with an acquire load.
+ */
+void pool_detach(struct pool *p) {
+    atomic_store_explicit(&p->owner, NULL, memory_order_release);
+}
+
+/**
+ * Frees all the memory of a pool, including objects still in use. A pool
+ * that is all zeros, because it was never set up, is left as it is.
+ */
+void pool_destroy(struct pool *p) {
+    struct pool_slab *slab = p->slabs;
+    while (slab) {
+        struct pool_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    p->slabs = NULL;
+    p->free_list = NULL;
+    atomic_store(&p->returned, NULL);
+}
+
+/**
+ * Allocates another slab and puts its objects on the free list.
+ * Returns false if memory could not be allocated.
+ */
+static bool grow_pool(struct pool *p) {
+    size_t header = (sizeof(struct pool_slab) + POOL_ALIGN - 1) /
+                    POOL_ALIGN * POOL_ALIGN;
+    size_t bytes = header + p->objects_per_slab * p->object_size;
+    struct pool_slab *slab = malloc(bytes);
+    if (!slab) {
+        return false;
+    }
+    slab->next = p->slabs;
+    p->slabs = slab;
+    // Link the objects back to front, so they are handed out in order.
+    char *objects = (char *)slab + header;
+    for (size_t i = p->objects_per_slab; i-- > 0;) {
+        struct pool_object *obj =
+            (struct pool_object *)(objects + i * p->object_size);
+        obj->next = p->free_list;
+        p->free_list = obj;
+    }
+    metrics_pool(p->metric, bytes, 0);
+    return true;
+}
+
+/**
+ * Takes an object from a pool owned by the calling thread. Objects put back
+ * by other threads are reused before the pool grows.
+ * Returns NULL if memory could not be allocated.
+ */
+void *pool_get(struct pool *p) {
+    if (!p->free_list) {
+        if (atomic_load_explicit(&p->returned, memory_order_relaxed)) {
+            p->free_list = atomic_exchange_explicit(&p->returned, NULL,
+                                                    memory_order_acquire);
+        } else if (!grow_pool(p)) {
+            return NULL;
+        }
+    }
+    struct pool_object *obj = p->free_list;
+    p->free_list = obj->next;
+    metrics_pool(p->metric, 0, 1);
+    return obj;
+}
+
+/**
+ * Puts an object back into the pool it was taken from. Any thread may put
+ * objects back.
+ */
+void pool_put(struct pool *p, void *object) {
+    struct pool_object *obj = object;
+    if (atomic_load_explicit(&p->owner, memory_order_acquire) == &thread_id) {
+        obj->next = p->free_list;
+        p->free_list = obj;
+        metrics_pool(p->metric, 0, -1);
+        return;
+    }
+    // The owner only ever takes the whole stack, so a push cannot be fooled
+    // by an object that was taken and put back in the meantime.
+    struct pool_object *head =
+        atomic_load_explicit(&p->returned, memory_order_relaxed);
+    do {
+        obj->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&p->returned, &head, obj,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    metrics_pool_return(p->metrics, p->metric);
+}
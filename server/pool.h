@@ -0,0 +1,55 @@
+/*******************************************************************************
+ * Name          : pool.h
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Pools of fixed-size objects carved out of large slabs, so
+ *                 objects that come and go all the time are recycled instead
+ *                 of going back to the heap.
+ ******************************************************************************/
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "metrics.h"
+
+// Bytes of objects in each slab a pool allocates. A slab always holds at
+// least one object.
+#define POOL_SLAB_SIZE 65536
+
+struct pool_object {
+    struct pool_object *next;
+};
+
+struct pool_slab {
+    struct pool_slab *next;
+};
+
+/**
+ * Pool owned by a single thread. Only the owner takes objects from it, and
+ * objects it puts back go straight onto its free list, with no locked
+ * instructions. Any other thread may put objects back as well, onto a
+ * lock-free stack that the owner takes over as a whole once its free list
+ * runs out. Memory is only given back to the heap when the pool is destroyed.
+ * The memory of the pool and the number of objects in use are reported in
+ * the metrics of the owner.
+ */
+struct pool {
+    size_t object_size;
+    size_t objects_per_slab;
+    enum metric_pool_t metric;
+    _Atomic(const void *) owner;
+    struct metrics *metrics;
+    struct pool_object *free_list;
+    struct pool_slab *slabs;
+    _Atomic(struct pool_object *) returned;
+};
+
+void pool_init(struct pool *p, size_t object_size, enum metric_pool_t metric);
+void pool_detach(struct pool *p);
+void pool_destroy(struct pool *p);
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *object);
+
+#endif
@@ -0,0 +1,140 @@
+/*******************************************************************************
+ * Name          : proto.h
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Framed wire protocol shared by chat server and client.
+ ******************************************************************************/
+#ifndef PROTO_H_
+#define PROTO_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Every message on the wire is a frame: a 4-byte payload length in network
+ * byte order, a 1-byte message type, and then the payload itself. TCP is
+ * free to split or merge writes, so receivers must buffer input and parse as
+ * many complete frames as it holds.
+ *
+ * The legacy protocol has no framing at all: each recv() is assumed to hold
+ * exactly one message, and the string "bye" ends the session.
+ */
+#define PROTO_HEADER_LEN  5
+#define PROTO_MAX_PAYLOAD (16 * 1024 * 1024)
+
+enum msg_type_t {
+    MSG_WELCOME = 1, // Server -> client: welcome message and user list.
+    MSG_NAME,        // Client -> server: user name.
+    MSG_CHAT,        // Both ways: chat line.
+    MSG_JOIN,        // Server -> client: a user joined the chat room.
+    MSG_LEAVE,       // Server -> client: a user left the chat room.
+    MSG_BYE,         // Both ways: the sender is closing the connection.
+    MSG_INFO,        // Server -> client: reply to a command such as "/who".
+    MSG_NAME_TAKEN,  // Server -> client: the user name is in use, send another.
+    MSG_HELLO,       // Client -> server: comma-separated codecs it can decode.
+                     // Server -> client: the codec picked, or nothing.
+    MSG_PING,        // Server -> client: the client has been quiet a while.
+    MSG_PONG,        // Client -> server: answer to MSG_PING, with no payload.
+    MSG_RING         // Client -> server: wants a shared ring, or has made room.
+                     // Server -> client: the size of the shared ring.
+};
+
+/*
+ * A frame whose type has MSG_COMPRESSED set stands for the frame of the
+ * type without it, with the payload compressed by the codec picked during
+ * the handshake. Servers only send such frames to clients that sent a
+ * MSG_HELLO naming the codec, which they do after MSG_NAME, so servers that
+ * do not know MSG_HELLO simply ignore it. The only codec is "deflate": the
+ * payload is the 4-byte length of the original payload in network byte
+ * order, followed by a raw deflate stream.
+ */
+#define MSG_COMPRESSED      0x80
+#define PROTO_CODEC_DEFLATE "deflate"
+
+/*
+ * A client connected to the Unix socket of the server, and so on the same
+ * host, may ask for its frames to be written into shared memory instead of
+ * its socket by sending MSG_RING with no payload. Once everything queued for
+ * the socket has gone out, the server answers with MSG_RING, whose payload is
+ * the 4-byte size of the ring in network byte order, a power of 2. Along with
+ * it come two file descriptors: the shared memory, made up of a struct
+ * proto_ring followed by the ring itself, and an eventfd. From then on the
+ * server writes whole frames into the ring, and the client reads them out,
+ * while everything the client sends still goes through its socket.
+ *
+ * The head and the tail count the bytes ever read and written, so the ring
+ * holds tail - head bytes, starting at head modulo the size. A reader about
+ * to wait for more sets reader_waiting, and the writer clears it and signals
+ * the eventfd after adding to the ring. A writer that finds the ring full
+ * sets writer_waiting, and the reader clears it and sends MSG_RING after
+ * making room. The server goes back to the socket for good when the ring
+ * cannot take a frame at all, or on a hot restart, so a client reads what is
+ * left in the ring before reading its socket.
+ */
+struct proto_ring {
+    _Alignas(64) _Atomic uint32_t head;
+    _Atomic uint32_t reader_waiting;
+    _Alignas(64) _Atomic uint32_t tail;
+    _Atomic uint32_t writer_waiting;
+};
+
+/**
+ * Returns the bytes of a shared ring, which follow its counters.
+ */
+static inline char *proto_ring_data(struct proto_ring *r) {
+    return (char *)(r + 1);
+}
+
+/**
+ * A frame parsed out of a receive buffer. The payload points into the buffer
+ * and is not null-terminated.
+ */
+struct frame {
+    unsigned char type;
+    uint32_t len;
+    const char *payload;
+};
+
+/**
+ * Writes a frame header for a payload of len bytes into hdr, which must have
+ * room for PROTO_HEADER_LEN bytes.
+ */
+static inline void proto_write_header(char *hdr, unsigned char type,
+                                      uint32_t len) {
+    hdr[0] = (len >> 24) & 0xff;
+    hdr[1] = (len >> 16) & 0xff;
+    hdr[2] = (len >> 8) & 0xff;
+    hdr[3] = len & 0xff;
+    hdr[4] = type;
+}
+
+/**
+ * Parses the frame at the start of buf, which holds len bytes.
+ * Returns the number of bytes the frame takes up, 0 if buf does not hold a
+ * complete frame yet, or -1 if the frame's payload would be longer than
+ * max_payload.
+ */
+static inline ssize_t proto_parse_frame(const char *buf, size_t len,
+                                        uint32_t max_payload,
+                                        struct frame *f) {
+    if (len < PROTO_HEADER_LEN) {
+        return 0;
+    }
+    const unsigned char *hdr = (const unsigned char *)buf;
+    f->len = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) |
+             ((uint32_t)hdr[2] << 8) | hdr[3];
+    f->type = hdr[4];
+    if (f->len > max_payload) {
+        return -1;
+    }
+    if (len - PROTO_HEADER_LEN < f->len) {
+        return 0;
+    }
+    f->payload = buf + PROTO_HEADER_LEN;
+    return PROTO_HEADER_LEN + f->len;
+}
+
+#endif
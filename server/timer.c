@@ -0,0 +1,228 @@
+/*******************************************************************************
+ * Name          : timer.c
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Hierarchical timing wheel, holding one timer for every slot
+ *                 of a table, with constant-time setting and cancelling.
+ ******************************************************************************/
+#include <limits.h>
+#include <stddef.h>
+#include "timer.h"
+
+#define LEVEL_MASK (TIMER_SLOTS - 1)
+// Ticks the top level of the wheel reaches.
+#define TIMER_RANGE (1ULL << (TIMER_LEVELS * TIMER_LEVEL_BITS))
+
+/**
+ * Sets up an empty wheel whose clock starts at now_ms.
+ */
+void timer_wheel_init(struct timer_wheel *w, uint64_t now_ms) {
+    w->timers = NULL;
+    w->now = now_ms / TIMER_TICK_MS;
+    for (int i = 0; i <= TIMER_EXPIRED; i++) {
+        w->heads[i] = -1;
+    }
+    for (int i = 0; i < TIMER_LEVELS; i++) {
+        w->occupied[i] = 0;
+    }
+}
+
+/**
+ * Points the wheel at the table of timers, after it has been allocated or
+ * moved. The timers in the wheel keep their place.
+ */
+void timer_wheel_attach(struct timer_wheel *w, struct timer *timers) {
+    w->timers = timers;
+}
+
+/**
+ * Sets up a timer that is not in any wheel.
+ */
+void timer_clear(struct timer *t) {
+    t->prev = t->next = -1;
+    t->where = TIMER_IDLE;
+    t->expires = 0;
+}
+
+/**
+ * Puts a timer at the front of the list of a slot of the wheel.
+ */
+static void link_timer(struct timer_wheel *w, int id, int where) {
+    struct timer *t = &w->timers[id];
+    t->where = where;
+    t->prev = -1;
+    t->next = w->heads[where];
+    if (t->next != -1) {
+        w->timers[t->next].prev = id;
+    }
+    w->heads[where] = id;
+    if (where != TIMER_EXPIRED) {
+        w->occupied[where / TIMER_SLOTS] |= 1ULL << (where % TIMER_SLOTS);
+    }
+}
+
+/**
+ * Takes a timer out of the list it is in.
+ */
+static void unlink_timer(struct timer_wheel *w, int id) {
+    struct timer *t = &w->timers[id];
+    if (t->prev != -1) {
+        w->timers[t->prev].next = t->next;
+    } else {
+        w->heads[t->where] = t->next;
+    }
+    if (t->next != -1) {
+        w->timers[t->next].prev = t->prev;
+    }
+    if (w->heads[t->where] == -1 && t->where != TIMER_EXPIRED) {
+        w->occupied[t->where / TIMER_SLOTS] &=
+            ~(1ULL << (t->where % TIMER_SLOTS));
+    }
+    t->prev = t->next = -1;
+    t->where = TIMER_IDLE;
+}
+
+/**
+ * Puts a timer in the slot of the lowest level that reaches the tick it goes
+ * off at, or with the expired timers if that tick has passed.
+ */
+static void place_timer(struct timer_wheel *w, int id) {
+    struct timer *t = &w->timers[id];
+    if (t->expires <= w->now) {
+        link_timer(w, id, TIMER_EXPIRED);
+        return;
+    }
+    if (t->expires - w->now >= TIMER_RANGE) {
+        t->expires = w->now + TIMER_RANGE - 1;
+    }
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (delta >= 1ULL << ((level + 1) * TIMER_LEVEL_BITS)) {
+        level++;
+    }
+    int slot = (t->expires >> (level * TIMER_LEVEL_BITS)) & LEVEL_MASK;
+    link_timer(w, id, level * TIMER_SLOTS + slot);
+}
+
+/**
+ * Sets the timer of a slot of the table to go off at expires_ms, in place of
+ * whenever it was set to go off before.
+ */
+void timer_set(struct timer_wheel *w, int id, uint64_t expires_ms) {
+    struct timer *t = &w->timers[id];
+    if (t->where != TIMER_IDLE) {
+        unlink_timer(w, id);
+    }
+    t->expires = (expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    place_timer(w, id);
+}
+
+/**
+ * Stops the timer of a slot of the table, if it is set.
+ */
+void timer_cancel(struct timer_wheel *w, int id) {
+    if (w->timers[id].where != TIMER_IDLE) {
+        unlink_timer(w, id);
+    }
+}
+
+/**
+ * Returns the first tick after the current one at which a timer goes off or
+ * a slot is spread out over the level below, or UINT64_MAX if there is none.
+ */
+static uint64_t next_event(const struct timer_wheel *w) {
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t bits = w->occupied[level];
+        if (!bits) {
+            continue;
+        }
+        int shift = level * TIMER_LEVEL_BITS;
+        uint64_t turn = w->now >> shift;
+        // Rotate the bitmap so the slot after the current one comes first.
+        int start = (turn + 1) & LEVEL_MASK;
+        if (start) {
+            bits = (bits >> start) | (bits << (TIMER_SLOTS - start));
+        }
+        uint64_t tick = (turn + __builtin_ctzll(bits) + 1) << shift;
+        if (tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+/**
+ * Moves the wheel to the given tick. The slots of the higher levels whose
+ * span starts there are spread out over the levels below, top down, then
+ * the timers of the level-0 slot go off.
+ */
+static void handle_tick(struct timer_wheel *w, uint64_t tick) {
+    w->now = tick;
+    for (int level = TIMER_LEVELS - 1; level > 0; level--) {
+        int shift = level * TIMER_LEVEL_BITS;
+        if (tick & ((1ULL << shift) - 1)) {
+            continue;
+        }
+        int where = level * TIMER_SLOTS + ((tick >> shift) & LEVEL_MASK);
+        int id = w->heads[where];
+        w->heads[where] = -1;
+        w->occupied[level] &= ~(1ULL << (where % TIMER_SLOTS));
+        while (id != -1) {
+            int next = w->timers[id].next;
+            place_timer(w, id);
+            id = next;
+        }
+    }
+    int where = tick & LEVEL_MASK;
+    int id = w->heads[where];
+    w->heads[where] = -1;
+    w->occupied[0] &= ~(1ULL << where);
+    while (id != -1) {
+        int next = w->timers[id].next;
+        link_timer(w, id, TIMER_EXPIRED);
+        id = next;
+    }
+}
+
+/**
+ * Takes the next timer that has gone off by now_ms out of the wheel.
+ * Returns the slot of the table it belongs to, or -1 if there is none.
+ */
+int timer_expired(struct timer_wheel *w, uint64_t now_ms) {
+    uint64_t target = now_ms / TIMER_TICK_MS;
+    while (w->heads[TIMER_EXPIRED] == -1 && w->now < target) {
+        uint64_t next = next_event(w);
+        if (next > target) {
+            w->now = target; // Nothing happens in between.
+            break;
+        }
+        handle_tick(w, next);
+    }
+    int id = w->heads[TIMER_EXPIRED];
+    if (id != -1) {
+        unlink_timer(w, id);
+    }
+    return id;
+}
+
+/**
+ * Returns how many milliseconds after now_ms the wheel next has to be looked
+ * at, or -1 if it holds no timers. That may be before any timer goes off, if
+ * timers have to be moved to a lower level first.
+ */
+int timer_timeout(const struct timer_wheel *w, uint64_t now_ms) {
+    if (w->heads[TIMER_EXPIRED] != -1) {
+        return 0;
+    }
+    uint64_t next = next_event(w);
+    if (next == UINT64_MAX) {
+        return -1;
+    }
+    uint64_t due_ms = next * TIMER_TICK_MS;
+    if (due_ms <= now_ms) {
+        return 0;
+    }
+    return due_ms - now_ms > INT_MAX ? INT_MAX : (int)(due_ms - now_ms);
+}
@@ -0,0 +1,65 @@
+/*******************************************************************************
+ * Name          : timer.h
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Hierarchical timing wheel, holding one timer for every slot
+ *                 of a table, with constant-time setting and cancelling.
+ ******************************************************************************/
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Milliseconds per tick of the wheel. Timers never go off early, and go off
+// at most a tick late.
+#define TIMER_TICK_MS 10
+// Each level of the wheel has 2^TIMER_LEVEL_BITS slots, and every slot of a
+// level spans as many ticks as a whole turn of the level below. Timers set
+// further out than the top level reaches, a little over 46 hours, go off
+// when it ends.
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS      (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS     4
+
+// Where a timer is when it is not in any slot of the wheel.
+#define TIMER_IDLE -1
+// Where a timer is when it has gone off and not been handed out yet.
+#define TIMER_EXPIRED (TIMER_LEVELS * TIMER_SLOTS)
+
+/**
+ * Timer of one slot of the table the wheel belongs to. Timers are linked by
+ * their index in the table rather than by address, so the table may be
+ * moved when it grows.
+ */
+struct timer {
+    int prev, next;   // Neighbours in the list of its slot, or -1.
+    int where;        // Slot of the wheel, TIMER_EXPIRED, or TIMER_IDLE.
+    uint64_t expires; // Tick the timer goes off at.
+};
+
+/**
+ * Wheel of timers owned by a single thread. A level-0 slot holds the timers
+ * going off at one tick. A slot of a higher level holds the timers going off
+ * during its span, and is spread out over the level below when the wheel
+ * gets to it, so every timer is only moved once per level. Each level keeps
+ * a bitmap of the slots that hold timers, so the wheel skips ahead over
+ * empty ones instead of visiting every tick.
+ */
+struct timer_wheel {
+    struct timer *timers;
+    uint64_t now; // Last tick handled.
+    int heads[TIMER_LEVELS * TIMER_SLOTS + 1];
+    uint64_t occupied[TIMER_LEVELS];
+};
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now_ms);
+void timer_wheel_attach(struct timer_wheel *w, struct timer *timers);
+void timer_clear(struct timer *t);
+void timer_set(struct timer_wheel *w, int id, uint64_t expires_ms);
+void timer_cancel(struct timer_wheel *w, int id);
+int timer_expired(struct timer_wheel *w, uint64_t now_ms);
+int timer_timeout(const struct timer_wheel *w, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,359 @@
+/*******************************************************************************
+ * Name          : uring.c
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Minimal io_uring wrapper built on the raw system calls.
+ ******************************************************************************/
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+// The kernel reads the submission tail and writes the completion tail (and
+// the other way around for the heads), so they are accessed atomically.
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/**
+ * Sets up a ring with room for the given number of submission queue entries.
+ * The completion queue is made four times as large, since a single multishot
+ * request can complete many times.
+ * Returns true on success, false on failure with errno set.
+ */
+bool uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(struct uring));
+    memset(&p, 0, sizeof(struct io_uring_params));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return false;
+    }
+    r->features = p.features;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes +
+                      p.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels map both rings with a single mmap().
+    if (r->features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        goto FAIL;
+    }
+    if (r->features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd,
+                          IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto FAIL;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto FAIL;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    // Entries are always submitted in order, so slot i of the array simply
+    // points at entry i.
+    for (unsigned i = 0; i < r->sq_entries; i++) {
+        r->sq_array[i] = i;
+    }
+    return true;
+
+FAIL:;
+    int saved_errno = errno;
+    uring_exit(r);
+    errno = saved_errno;
+    return false;
+}
+
+/**
+ * Tears down a ring. The kernel cancels whatever is still in flight.
+ */
+void uring_exit(struct uring *r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    memset(r, 0, sizeof(struct uring));
+    r->fd = -1;
+}
+
+/**
+ * Returns true if the kernel supports every one of the given operations.
+ */
+bool uring_probe(struct uring *r, const int *ops, int num_ops) {
+    size_t size = sizeof(struct io_uring_probe) +
+                  IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) {
+        return false;
+    }
+    bool supported =
+        syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe,
+                IORING_OP_LAST) == 0;
+    for (int i = 0; supported && i < num_ops; i++) {
+        supported = ops[i] <= probe->last_op &&
+                    (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+/**
+ * Returns a zeroed submission queue entry to fill in. If the submission
+ * queue is full, the entries in it are submitted first.
+ * Returns NULL if no entry could be made available.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+    if (r->sqe_tail - load_acquire(r->sq_head) == r->sq_entries &&
+            uring_submit(r) < 0) {
+        return NULL;
+    }
+    if (r->sqe_tail - load_acquire(r->sq_head) == r->sq_entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sqe_tail++;
+    return sqe;
+}
+
+/**
+ * Makes the entries filled in so far visible to the kernel. Returns the
+ * number of entries that have not been consumed by the kernel yet.
+ */
+static unsigned flush_sq(struct uring *r) {
+    store_release(r->sq_tail, r->sqe_tail);
+    return r->sqe_tail - load_acquire(r->sq_head);
+}
+
+/**
+ * Submits the pending entries without waiting for anything to complete.
+ * Returns the number of entries submitted, or -1 on failure.
+ */
+int uring_submit(struct uring *r) {
+    unsigned pending = flush_sq(r);
+    int rc;
+    do {
+        rc = syscall(__NR_io_uring_enter, r->fd, pending, 0, 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+/**
+ * Submits the pending entries and waits for at least one completion, or
+ * until timeout milliseconds have passed. A negative timeout waits
+ * indefinitely. Returns -1 with errno set on failure; a signal shows up as
+ * EINTR and the timeout as ETIME.
+ */
+int uring_submit_and_wait(struct uring *r, int timeout) {
+    unsigned pending = flush_sq(r);
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    // Nothing to wait for if completions are already there.
+    unsigned wait_nr = uring_peek_cqe(r) ? 0 : 1;
+    return syscall(__NR_io_uring_enter, r->fd, pending, wait_nr,
+                   IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                   sizeof(arg));
+}
+
+/**
+ * Returns the oldest completion that has not been seen yet, or NULL if there
+ * is none.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == load_acquire(r->cq_tail)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+/**
+ * Hands the completion returned by uring_peek_cqe() back to the kernel.
+ */
+void uring_cqe_seen(struct uring *r) {
+    store_release(r->cq_head, *r->cq_head + 1);
+}
+
+/**
+ * Sets up a ring of entries buffers of buf_size bytes each and registers it
+ * with the kernel as the given buffer group.
+ * Returns true on success, false on failure with errno set.
+ */
+bool uring_buf_ring_init(struct uring *r, struct uring_buf_ring *b,
+                         uint16_t group, unsigned entries, unsigned buf_size) {
+    memset(b, 0, sizeof(struct uring_buf_ring));
+    b->ring_size = entries * sizeof(struct io_uring_buf);
+    // The ring has to be page aligned.
+    void *ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    b->ring = ring;
+    if (!(b->bufs = malloc((size_t)entries * buf_size))) {
+        munmap(b->ring, b->ring_size);
+        b->ring = NULL;
+        return false;
+    }
+    b->entries = entries;
+    b->buf_size = buf_size;
+    b->group = group;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)b->ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) != 0) {
+        int saved_errno = errno;
+        free(b->bufs);
+        munmap(b->ring, b->ring_size);
+        memset(b, 0, sizeof(struct uring_buf_ring));
+        errno = saved_errno;
+        return false;
+    }
+    for (unsigned i = 0; i < entries; i++) {
+        uring_buf_ring_recycle(b, i);
+    }
+    return true;
+}
+
+/**
+ * Unregisters a ring of buffers and frees it.
+ */
+void uring_buf_ring_exit(struct uring *r, struct uring_buf_ring *b) {
+    if (!b->ring) {
+        return;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = b->group;
+    syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_PBUF_RING,
+            &reg, 1);
+    free(b->bufs);
+    munmap(b->ring, b->ring_size);
+    memset(b, 0, sizeof(struct uring_buf_ring));
+}
+
+/**
+ * Gives a buffer back to the kernel once its contents have been used.
+ */
+void uring_buf_ring_recycle(struct uring_buf_ring *b, unsigned id) {
+    unsigned short tail = b->ring->tail;
+    struct io_uring_buf *buf = &b->ring->bufs[tail & (b->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(b, id);
+    buf->len = b->buf_size;
+    buf->bid = id;
+    store_release(&b->ring->tail, (unsigned short)(tail + 1));
+}
+
+/**
+ * Accepts connections on a listening socket until cancelled. Each accepted
+ * connection completes with its descriptor.
+ */
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+                                 uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+/**
+ * Receives from a socket until cancelled, the socket is shut down, or the
+ * buffer group runs dry. Each read completes with a buffer from the group.
+ */
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+                               uint16_t group, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+/**
+ * Sends a message. With zero_copy, the kernel sends straight from the
+ * caller's pages, which must stay untouched until a second completion
+ * flagged IORING_CQE_F_NOTIF arrives.
+ */
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, bool zero_copy,
+                        uint64_t user_data) {
+    sqe->opcode = zero_copy ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+/**
+ * Polls a descriptor for the given events until cancelled.
+ */
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+                               uint32_t events, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+/**
+ * Cancels the request submitted with the target user data.
+ */
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target,
+                       uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
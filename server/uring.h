@@ -0,0 +1,84 @@
+/*******************************************************************************
+ * Name          : uring.h
+ * Version       : 1.0
+ * Date          : October 16, 2026
+ * Last modified : October 16, 2026
+ * Description   : Minimal io_uring wrapper built on the raw system calls.
+ ******************************************************************************/
+#ifndef URING_H_
+#define URING_H_
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * Submission and completion rings shared with the kernel. Submission queue
+ * entries are filled in with uring_get_sqe() and handed to the kernel in one
+ * go by uring_submit_and_wait().
+ */
+struct uring {
+    int fd;
+    unsigned features;
+    // Submission queue.
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    unsigned sqe_tail; // Entries handed out, but not yet submitted.
+    struct io_uring_sqe *sqes;
+    // Completion queue.
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings to undo when the ring is torn down.
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/**
+ * Ring of buffers the kernel picks from when a read completes, so buffers
+ * are only tied up by sockets that actually have data.
+ */
+struct uring_buf_ring {
+    struct io_uring_buf_ring *ring;
+    char *bufs;
+    unsigned entries, buf_size;
+    uint16_t group;
+    size_t ring_size;
+};
+
+bool uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+bool uring_probe(struct uring *r, const int *ops, int num_ops);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_submit(struct uring *r);
+int uring_submit_and_wait(struct uring *r, int timeout);
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+bool uring_buf_ring_init(struct uring *r, struct uring_buf_ring *b,
+                         uint16_t group, unsigned entries, unsigned buf_size);
+void uring_buf_ring_exit(struct uring *r, struct uring_buf_ring *b);
+void uring_buf_ring_recycle(struct uring_buf_ring *b, unsigned id);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+                                 uint64_t user_data);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+                               uint16_t group, uint64_t user_data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, bool zero_copy,
+                        uint64_t user_data);
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+                               uint32_t events, uint64_t user_data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target,
+                       uint64_t user_data);
+
+/**
+ * Returns a pointer to the buffer with the given id.
+ */
+static inline char *uring_buf(struct uring_buf_ring *b, unsigned id) {
+    return b->bufs + (size_t)id * b->buf_size;
+}
+
+#endif
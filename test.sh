@@ -1,4 +1,45 @@
 #!/bin/bash
+# Builds the server and the load generator, then starts servers on a spare
+# port and runs short load tests against them. Fails if a server fails to
+# start, a connection fails, or a chat line is lost. Set PORT, or BENCH_ARGS
+# to change the load of the first test.
 
-echo "TODO"
-exit 1
\ No newline at end of file
+port=${PORT:-5901}
+bench_args=${BENCH_ARGS:-"-c 200 -t 2 -g 10 -r 2000 -s 128 -d 3"}
+
+make -C server >/dev/null || exit 1
+make -C bench >/dev/null || exit 1
+
+server_pid=
+trap 'kill $server_pid 2>/dev/null; wait $server_pid 2>/dev/null' EXIT
+
+# Runs the load generator with the arguments in $1 against a server started
+# with the rest of the arguments. Returns the status of the load generator.
+run_test() {
+    local args=$1
+    shift
+    ./server/chatserver -l warning "$@" "$port" &
+    server_pid=$!
+    sleep 0.5
+    if ! kill -0 $server_pid 2>/dev/null; then
+        echo "Error: The server failed to start."
+        return 1
+    fi
+    ./bench/chatbench $args 127.0.0.1 "$port"
+    local status=$?
+    kill $server_pid 2>/dev/null
+    wait $server_pid 2>/dev/null
+    return $status
+}
+
+status=0
+run_test "$bench_args" || status=1
+# A queue limit below the default history limit, with no -H, still starts.
+run_test "-c 20 -t 1 -g 10 -r 100 -s 64 -d 2" -w 2 -p drop -q 2048 ||
+    status=1
+if [ $status -eq 0 ]; then
+    echo "PASS"
+else
+    echo "FAIL"
+fi
+exit $status